@@ -37,6 +37,19 @@ Rename this file to lodepng.cpp to use it for C++, or to lodepng.c to use it for
 #include <fstream>
 #endif /*LODEPNG_COMPILE_CPP*/
 
+/*the runtime dispatch needs the target attribute to compile functions for other instruction sets*/
+#if defined(LODEPNG_COMPILE_CPU_DISPATCH) && (defined(__x86_64__) || defined(__i386__))\
+ && (defined(__clang__) || (defined(__GNUC__) && (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))))
+#define LODEPNG_X86_DISPATCH
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
+/*SSE2 is part of x86-64, so it is used without a runtime check when the compiler targets it*/
+#if defined(LODEPNG_X86_DISPATCH) && defined(__SSE2__)
+#define LODEPNG_SSE2
+#endif
+
 #define VERSION_STRING "20140823"
 
 #if defined(_MSC_VER) && (_MSC_VER >= 1310) /*Visual Studio: A few warning types are not desired here.*/
@@ -193,14 +206,6 @@ static unsigned uivector_push_back(uivector* p, unsigned c)
   return 1;
 }
 
-/*copy q to p, returns 1 if success, 0 if failure ==> nothing done*/
-static unsigned uivector_copy(uivector* p, const uivector* q)
-{
-  size_t i;
-  if(!uivector_resize(p, q->size)) return 0;
-  for(i = 0; i < q->size; i++) p->data[i] = q->data[i];
-  return 1;
-}
 #endif /*LODEPNG_COMPILE_ENCODER*/
 #endif /*LODEPNG_COMPILE_ZLIB*/
 
@@ -253,17 +258,6 @@ static void ucvector_init(ucvector* p)
   p->data = NULL;
   p->size = p->allocsize = 0;
 }
-
-#ifdef LODEPNG_COMPILE_DECODER
-/*resize and give all new elements the value*/
-static unsigned ucvector_resizev(ucvector* p, size_t size, unsigned char value)
-{
-  size_t oldsize = p->size, i;
-  if(!ucvector_resize(p, size)) return 0;
-  for(i = oldsize; i < size; i++) p->data[i] = value;
-  return 1;
-}
-#endif /*LODEPNG_COMPILE_DECODER*/
 #endif /*LODEPNG_COMPILE_PNG*/
 
 #ifdef LODEPNG_COMPILE_ZLIB
@@ -286,6 +280,84 @@ static unsigned ucvector_push_back(ucvector* p, unsigned char c)
 }
 #endif /*defined(LODEPNG_COMPILE_PNG) || defined(LODEPNG_COMPILE_ENCODER)*/
 
+/* ////////////////////////////////////////////////////////////////////////// */
+
+#if defined(LODEPNG_COMPILE_DECODER) || defined(LODEPNG_COMPILE_ENCODER)
+void lodepng_scratch_init(LodePNGScratch* scratch)
+{
+  unsigned i;
+  for(i = 0; i < LODEPNG_SCRATCH_BLOCKS; i++)
+  {
+    scratch->blocks[i] = 0;
+    scratch->sizes[i] = 0;
+  }
+}
+
+void lodepng_scratch_cleanup(LodePNGScratch* scratch)
+{
+  unsigned i;
+  for(i = 0; i < LODEPNG_SCRATCH_BLOCKS; i++) lodepng_free(scratch->blocks[i]);
+  lodepng_scratch_init(scratch);
+}
+
+/*used by the deflate hash and the PNG codec, a zlib-only decoder does not need them*/
+#if defined(LODEPNG_COMPILE_PNG) || defined(LODEPNG_COMPILE_ENCODER)
+/*Takes the smallest kept block of at least size bytes out of the scratch, or allocates a new
+one if there is none or scratch is NULL. If allocsize is not NULL, it receives the real size.
+The block can be freed or reallocated like any other, or given back with scratch_put.*/
+static void* scratch_get(LodePNGScratch* scratch, size_t size, size_t* allocsize)
+{
+  unsigned i, best = LODEPNG_SCRATCH_BLOCKS;
+  if(scratch)
+  {
+    for(i = 0; i < LODEPNG_SCRATCH_BLOCKS; i++)
+    {
+      if(scratch->blocks[i] && scratch->sizes[i] >= size
+         && (best == LODEPNG_SCRATCH_BLOCKS || scratch->sizes[i] < scratch->sizes[best])) best = i;
+    }
+    if(best != LODEPNG_SCRATCH_BLOCKS)
+    {
+      void* block = scratch->blocks[best];
+      if(allocsize) *allocsize = scratch->sizes[best];
+      scratch->blocks[best] = 0;
+      return block;
+    }
+  }
+  if(allocsize) *allocsize = size;
+  return lodepng_malloc(size);
+}
+
+/*Gives a block of size bytes to the scratch to be reused, or frees it if scratch is NULL. When
+all places are taken, the smallest block is freed, so the scratch keeps the largest ones.*/
+static void scratch_put(LodePNGScratch* scratch, void* block, size_t size)
+{
+  unsigned i, smallest = 0;
+  if(!block) return;
+  if(!scratch)
+  {
+    lodepng_free(block);
+    return;
+  }
+  for(i = 0; i < LODEPNG_SCRATCH_BLOCKS; i++)
+  {
+    if(!scratch->blocks[i])
+    {
+      smallest = i;
+      break;
+    }
+    if(scratch->sizes[i] < scratch->sizes[smallest]) smallest = i;
+  }
+  if(scratch->blocks[smallest] && scratch->sizes[smallest] >= size)
+  {
+    lodepng_free(block);
+    return;
+  }
+  lodepng_free(scratch->blocks[smallest]);
+  scratch->blocks[smallest] = block;
+  scratch->sizes[smallest] = size;
+}
+#endif /*defined(LODEPNG_COMPILE_PNG) || defined(LODEPNG_COMPILE_ENCODER)*/
+#endif /* defined(LODEPNG_COMPILE_DECODER) || defined(LODEPNG_COMPILE_ENCODER) */
 
 /* ////////////////////////////////////////////////////////////////////////// */
 
@@ -357,6 +429,48 @@ static void lodepng_add32bitInt(ucvector* buffer, unsigned value)
 }
 #endif /*LODEPNG_COMPILE_ENCODER*/
 
+#ifdef LODEPNG_X86_DISPATCH
+/* ////////////////////////////////////////////////////////////////////////// */
+/* / CPU features                                                           / */
+/* ////////////////////////////////////////////////////////////////////////// */
+
+/*compiles a function for the given instruction sets, only call it if lodepng_cpu_has them*/
+#define LODEPNG_TARGET(isa) __attribute__((target(isa)))
+
+#define LODEPNG_CPU_DETECTED 1u
+#define LODEPNG_CPU_PCLMUL 2u /*PCLMULQDQ and SSE4.1*/
+#define LODEPNG_CPU_SSSE3 4u
+#define LODEPNG_CPU_AVX2 8u
+
+static unsigned lodepng_cpu_detect(void)
+{
+  unsigned eax, ebx, ecx, edx;
+  unsigned features = LODEPNG_CPU_DETECTED;
+  if(!__get_cpuid(1, &eax, &ebx, &ecx, &edx)) return features;
+  if((ecx & bit_PCLMUL) && (ecx & bit_SSE4_1)) features |= LODEPNG_CPU_PCLMUL;
+  if(ecx & bit_SSSE3) features |= LODEPNG_CPU_SSSE3;
+  /*AVX2 also needs the OS to save the ymm registers, which xgetbv tells*/
+  if((ecx & bit_OSXSAVE) && (ecx & bit_AVX) && __get_cpuid_max(0, 0) >= 7)
+  {
+    unsigned xcr0, xcr0_high;
+    __asm__("xgetbv" : "=a"(xcr0), "=d"(xcr0_high) : "c"(0));
+    __cpuid_count(7, 0, eax, ebx, ecx, edx);
+    if((xcr0 & 6) == 6 && (ebx & bit_AVX2)) features |= LODEPNG_CPU_AVX2;
+  }
+  return features;
+}
+
+/*returns whether the CPU supports all of the given features*/
+static int lodepng_cpu_has(unsigned features)
+{
+  /*detected on first use, threads racing here all store the same value*/
+  static volatile unsigned detected = 0;
+  unsigned value = detected;
+  if(!value) detected = value = lodepng_cpu_detect();
+  return (value & features) == features;
+}
+#endif /*LODEPNG_X86_DISPATCH*/
+
 /* ////////////////////////////////////////////////////////////////////////// */
 /* / File IO                                                                / */
 /* ////////////////////////////////////////////////////////////////////////// */
@@ -502,11 +616,13 @@ Huffman tree struct, containing multiple representations of the tree
 */
 typedef struct HuffmanTree
 {
-  unsigned* tree2d;
   unsigned* tree1d;
   unsigned* lengths; /*the lengths of the codes of the 1d-tree*/
   unsigned maxbitlen; /*maximum number of bits a single code can get*/
   unsigned numcodes; /*number of symbols in the alphabet = number of codes*/
+  /*decoding lookup table, see HuffmanTree_makeTable*/
+  unsigned char* table_len; /*length of the code at this index*/
+  unsigned short* table_value; /*symbol at this index, or start of the second level table*/
 } HuffmanTree;
 
 /*function used for debug purposes to draw the tree in ascii art with C++*/
@@ -524,77 +640,125 @@ static void HuffmanTree_draw(HuffmanTree* tree)
 
 static void HuffmanTree_init(HuffmanTree* tree)
 {
-  tree->tree2d = 0;
   tree->tree1d = 0;
   tree->lengths = 0;
+  tree->table_len = 0;
+  tree->table_value = 0;
 }
 
 static void HuffmanTree_cleanup(HuffmanTree* tree)
 {
-  lodepng_free(tree->tree2d);
   lodepng_free(tree->tree1d);
   lodepng_free(tree->lengths);
+  lodepng_free(tree->table_len);
+  lodepng_free(tree->table_value);
 }
 
-/*the tree representation used by the decoder. return value is error*/
-static unsigned HuffmanTree_make2DTree(HuffmanTree* tree)
+#ifdef LODEPNG_COMPILE_DECODER
+/*number of bits of the first level of the decoding table*/
+#define FIRSTBITS 9u
+/*value in the decoding table for codes that don't exist in the tree*/
+#define INVALIDSYMBOL 65535u
+
+static unsigned reverseBits(unsigned bits, unsigned num)
 {
-  unsigned nodefilled = 0; /*up to which node it is filled*/
-  unsigned treepos = 0; /*position in the tree (1 of the numcodes columns)*/
-  unsigned n, i;
+  unsigned i, result = 0;
+  for(i = 0; i < num; i++) result |= ((bits >> (num - i - 1u)) & 1u) << i;
+  return result;
+}
 
-  tree->tree2d = (unsigned*)lodepng_malloc(tree->numcodes * 2 * sizeof(unsigned));
-  if(!tree->tree2d) return 83; /*alloc fail*/
+/*
+the tree representation used by the decoder, return value is error.
+The first level of the table is indexed by the next FIRSTBITS bits of the stream (in the
+order they appear in the stream, so reversed compared to tree1d). Codes that are longer
+than FIRSTBITS point to a second level table, indexed by the remaining bits of the longest
+code with that prefix. table_len contains the length of the code, or for the entries
+pointing to a second level table the length of the longest code in it.
+*/
+static unsigned HuffmanTree_makeTable(HuffmanTree* tree)
+{
+  static const unsigned headsize = 1u << FIRSTBITS;
+  static const unsigned mask = (1u << FIRSTBITS) - 1u;
+  size_t i, pointer, size;
+  unsigned* maxlens = (unsigned*)lodepng_malloc(headsize * sizeof(unsigned));
+  if(!maxlens) return 83; /*alloc fail*/
 
-  /*
-  convert tree1d[] to tree2d[][]. In the 2D array, a value of 32767 means
-  uninited, a value >= numcodes is an address to another bit, a value < numcodes
-  is a code. The 2 rows are the 2 possible bit values (0 or 1), there are as
-  many columns as codes - 1.
-  A good huffmann tree has N * 2 - 1 nodes, of which N - 1 are internal nodes.
-  Here, the internal nodes are stored (what their 0 and 1 option point to).
-  There is only memory for such good tree currently, if there are more nodes
-  (due to too long length codes), error 55 will happen
-  */
-  for(n = 0; n < tree->numcodes * 2; n++)
+  /*compute the size of the second level tables*/
+  for(i = 0; i < headsize; i++) maxlens[i] = 0;
+  for(i = 0; i < tree->numcodes; i++)
   {
-    tree->tree2d[n] = 32767; /*32767 here means the tree2d isn't filled there yet*/
+    unsigned l = tree->lengths[i];
+    unsigned index;
+    if(l <= FIRSTBITS) continue;
+    index = reverseBits(tree->tree1d[i] >> (l - FIRSTBITS), FIRSTBITS);
+    if(maxlens[index] < l) maxlens[index] = l;
+  }
+  size = headsize;
+  for(i = 0; i < headsize; i++)
+  {
+    if(maxlens[i] > FIRSTBITS) size += (1u << (maxlens[i] - FIRSTBITS));
   }
 
-  for(n = 0; n < tree->numcodes; n++) /*the codes*/
+  tree->table_len = (unsigned char*)lodepng_malloc(size * sizeof(*tree->table_len));
+  tree->table_value = (unsigned short*)lodepng_malloc(size * sizeof(*tree->table_value));
+  if(!tree->table_len || !tree->table_value)
+  {
+    lodepng_free(maxlens);
+    return 83; /*alloc fail*/
+  }
+  /*codes that are not in the tree: consume one bit, so that the caller can detect the end of the stream*/
+  for(i = 0; i < size; i++)
   {
-    for(i = 0; i < tree->lengths[n]; i++) /*the bits for this code*/
+    tree->table_len[i] = 1;
+    tree->table_value[i] = INVALIDSYMBOL;
+  }
+
+  pointer = headsize;
+  for(i = 0; i < headsize; i++)
+  {
+    unsigned l = maxlens[i];
+    if(l <= FIRSTBITS) continue;
+    tree->table_len[i] = l;
+    tree->table_value[i] = (unsigned short)pointer;
+    pointer += (1u << (l - FIRSTBITS));
+  }
+  lodepng_free(maxlens);
+
+  /*fill in the symbols, a code shorter than its table fills all entries that start with it*/
+  for(i = 0; i < tree->numcodes; i++)
+  {
+    unsigned l = tree->lengths[i];
+    unsigned reverse, j, num;
+    if(l == 0) continue;
+    reverse = reverseBits(tree->tree1d[i], l);
+    if(l <= FIRSTBITS)
     {
-      unsigned char bit = (unsigned char)((tree->tree1d[n] >> (tree->lengths[n] - i - 1)) & 1);
-      if(treepos > tree->numcodes - 2) return 55; /*oversubscribed, see comment in lodepng_error_text*/
-      if(tree->tree2d[2 * treepos + bit] == 32767) /*not yet filled in*/
+      num = 1u << (FIRSTBITS - l);
+      for(j = 0; j < num; j++)
       {
-        if(i + 1 == tree->lengths[n]) /*last bit*/
-        {
-          tree->tree2d[2 * treepos + bit] = n; /*put the current code in it*/
-          treepos = 0;
-        }
-        else
-        {
-          /*put address of the next step in here, first that address has to be found of course
-          (it's just nodefilled + 1)...*/
-          nodefilled++;
-          /*addresses encoded with numcodes added to it*/
-          tree->tree2d[2 * treepos + bit] = nodefilled + tree->numcodes;
-          treepos = nodefilled;
-        }
+        unsigned index = reverse | (j << l);
+        tree->table_len[index] = l;
+        tree->table_value[index] = (unsigned short)i;
+      }
+    }
+    else
+    {
+      unsigned index = reverse & mask;
+      unsigned maxlen = tree->table_len[index];
+      unsigned start = tree->table_value[index];
+      num = 1u << (maxlen - l);
+      for(j = 0; j < num; j++)
+      {
+        unsigned index2 = start + ((reverse >> FIRSTBITS) | (j << (l - FIRSTBITS)));
+        tree->table_len[index2] = l;
+        tree->table_value[index2] = (unsigned short)i;
       }
-      else treepos = tree->tree2d[2 * treepos + bit] - tree->numcodes;
     }
-  }
-
-  for(n = 0; n < tree->numcodes * 2; n++)
-  {
-    if(tree->tree2d[n] == 32767) tree->tree2d[n] = 0; /*remove possible remaining 32767's*/
   }
 
   return 0;
 }
+#endif /*LODEPNG_COMPILE_DECODER*/
 
 /*
 Second step for the ...makeFromLengths and ...makeFromFrequencies functions.
@@ -621,6 +785,7 @@ static unsigned HuffmanTree_makeFromLengths2(HuffmanTree* tree)
   {
     /*step 1: count number of instances of each code length*/
     for(bits = 0; bits < tree->numcodes; bits++) blcount.data[tree->lengths[bits]]++;
+    blcount.data[0] = 0; /*unused symbols take no room in the code space*/
     /*step 2: generate the nextcode values*/
     for(bits = 1; bits <= tree->maxbitlen; bits++)
     {
@@ -631,13 +796,17 @@ static unsigned HuffmanTree_makeFromLengths2(HuffmanTree* tree)
     {
       if(tree->lengths[n] != 0) tree->tree1d[n] = nextcode.data[tree->lengths[n]]++;
     }
+    /*there must not be more codes of a length than the shorter codes leave room for*/
+    for(bits = 1; bits <= tree->maxbitlen; bits++)
+    {
+      if(nextcode.data[bits] > (1u << bits)) error = 55; /*oversubscribed, see comment in lodepng_error_text*/
+    }
   }
 
   uivector_cleanup(&blcount);
   uivector_cleanup(&nextcode);
 
-  if(!error) return HuffmanTree_make2DTree(tree);
-  else return error;
+  return error;
 }
 
 /*
@@ -654,7 +823,15 @@ static unsigned HuffmanTree_makeFromLengths(HuffmanTree* tree, const unsigned* b
   for(i = 0; i < numcodes; i++) tree->lengths[i] = bitlen[i];
   tree->numcodes = (unsigned)numcodes; /*number of symbols*/
   tree->maxbitlen = maxbitlen;
+#ifdef LODEPNG_COMPILE_DECODER
+  {
+    unsigned error = HuffmanTree_makeFromLengths2(tree);
+    if(error) return error;
+    return HuffmanTree_makeTable(tree);
+  }
+#else /*LODEPNG_COMPILE_DECODER*/
   return HuffmanTree_makeFromLengths2(tree);
+#endif /*LODEPNG_COMPILE_DECODER*/
 }
 
 #ifdef LODEPNG_COMPILE_ENCODER
@@ -666,53 +843,20 @@ A coin can be multiple coins (when they're merged)
 */
 typedef struct Coin
 {
-  uivector symbols;
+  size_t symbols; /*index of the first symbol of this coin in the symbol array of its row*/
+  size_t numsymbols;
   float weight; /*the sum of all weights in this coin*/
 } Coin;
 
-static void coin_init(Coin* c)
-{
-  uivector_init(&c->symbols);
-}
-
-/*argument c is void* so that this dtor can be given as function pointer to the vector resize function*/
-static void coin_cleanup(void* c)
-{
-  uivector_cleanup(&((Coin*)c)->symbols);
-}
-
-static void coin_copy(Coin* c1, const Coin* c2)
-{
-  c1->weight = c2->weight;
-  uivector_copy(&c1->symbols, &c2->symbols);
-}
-
-static void add_coins(Coin* c1, const Coin* c2)
-{
-  size_t i;
-  for(i = 0; i < c2->symbols.size; i++) uivector_push_back(&c1->symbols, c2->symbols.data[i]);
-  c1->weight += c2->weight;
-}
-
-static void init_coins(Coin* coins, size_t num)
-{
-  size_t i;
-  for(i = 0; i < num; i++) coin_init(&coins[i]);
-}
-
-static void cleanup_coins(Coin* coins, size_t num)
-{
-  size_t i;
-  for(i = 0; i < num; i++) coin_cleanup(&coins[i]);
-}
-
 static int coin_compare(const void* a, const void* b) {
   float wa = ((const Coin*)a)->weight;
   float wb = ((const Coin*)b)->weight;
   return wa > wb ? 1 : wa < wb ? -1 : 0;
 }
 
-static unsigned append_symbol_coins(Coin* coins, const unsigned* frequencies, unsigned numcodes, size_t sum)
+/*the symbols of the new coins are appended to the symbol array of their row*/
+static void append_symbol_coins(Coin* coins, unsigned* symbols, size_t* numsymbols,
+                                const unsigned* frequencies, unsigned numcodes, size_t sum)
 {
   unsigned i;
   unsigned j = 0; /*index of present symbols*/
@@ -721,11 +865,24 @@ static unsigned append_symbol_coins(Coin* coins, const unsigned* frequencies, un
     if(frequencies[i] != 0) /*only include symbols that are present*/
     {
       coins[j].weight = frequencies[i] / (float)sum;
-      uivector_push_back(&coins[j].symbols, i);
+      coins[j].symbols = *numsymbols;
+      coins[j].numsymbols = 1;
+      symbols[(*numsymbols)++] = i;
       j++;
     }
   }
-  return 0;
+}
+
+/*merges c1 and c2 of the previous row into coin, copying their symbols to the end of its row*/
+static void merge_coins(Coin* coin, unsigned* symbols, size_t* numsymbols,
+                        const Coin* c1, const Coin* c2, const unsigned* prev_symbols)
+{
+  size_t i;
+  coin->symbols = *numsymbols;
+  coin->numsymbols = c1->numsymbols + c2->numsymbols;
+  coin->weight = c1->weight + c2->weight;
+  for(i = 0; i < c1->numsymbols; i++) symbols[(*numsymbols)++] = prev_symbols[c1->symbols + i];
+  for(i = 0; i < c2->numsymbols; i++) symbols[(*numsymbols)++] = prev_symbols[c2->symbols + i];
 }
 
 unsigned lodepng_huffman_code_lengths(unsigned* lengths, const unsigned* frequencies,
@@ -733,11 +890,12 @@ unsigned lodepng_huffman_code_lengths(unsigned* lengths, const unsigned* frequen
 {
   unsigned i, j;
   size_t sum = 0, numpresent = 0;
-  unsigned error = 0;
   Coin* coins; /*the coins of the currently calculated row*/
   Coin* prev_row; /*the previous row of coins*/
-  size_t numcoins;
-  size_t coinmem;
+  unsigned* symbols; /*the symbols of all coins of the current row*/
+  unsigned* prev_symbols; /*the symbols of all coins of the previous row*/
+  size_t numcoins, numsymbols;
+  size_t coinmem, symbolmem;
 
   if(numcodes == 0) return 80; /*error: a tree of 0 symbols is not supposed to be made*/
 
@@ -779,72 +937,69 @@ unsigned lodepng_huffman_code_lengths(unsigned* lengths, const unsigned* frequen
     For every symbol, maxbitlen coins will be created*/
 
     coinmem = numpresent * 2; /*max amount of coins needed with the current algo*/
-    coins = (Coin*)lodepng_malloc(sizeof(Coin) * coinmem);
-    prev_row = (Coin*)lodepng_malloc(sizeof(Coin) * coinmem);
-    if(!coins || !prev_row)
+    /*a row holds each symbol at most maxbitlen times, so the symbol arrays of both rows are allocated
+    once here and never grow*/
+    symbolmem = numpresent * maxbitlen;
+    coins = (Coin*)lodepng_malloc(sizeof(Coin) * coinmem * 2);
+    symbols = (unsigned*)lodepng_malloc(sizeof(unsigned) * symbolmem * 2);
+    if(!coins || !symbols)
     {
       lodepng_free(coins);
-      lodepng_free(prev_row);
+      lodepng_free(symbols);
       return 83; /*alloc fail*/
     }
-    init_coins(coins, coinmem);
-    init_coins(prev_row, coinmem);
+    prev_row = coins + coinmem;
+    prev_symbols = symbols + symbolmem;
 
     /*first row, lowest denominator*/
-    error = append_symbol_coins(coins, frequencies, numcodes, sum);
+    numsymbols = 0;
+    append_symbol_coins(coins, symbols, &numsymbols, frequencies, numcodes, sum);
     numcoins = numpresent;
     qsort(coins, numcoins, sizeof(Coin), coin_compare);
-    if(!error)
     {
-      unsigned numprev = 0;
-      for(j = 1; j <= maxbitlen && !error; j++) /*each of the remaining rows*/
+      size_t numprev = 0;
+      for(j = 1; j <= maxbitlen; j++) /*each of the remaining rows*/
       {
-        unsigned tempnum;
+        size_t tempnum;
         Coin* tempcoins;
-        /*swap prev_row and coins, and their amounts*/
+        unsigned* tempsymbols;
+        /*swap prev_row and coins, and their amounts and symbols*/
         tempcoins = prev_row; prev_row = coins; coins = tempcoins;
         tempnum = numprev; numprev = numcoins; numcoins = tempnum;
-
-        cleanup_coins(coins, numcoins);
-        init_coins(coins, numcoins);
+        tempsymbols = prev_symbols; prev_symbols = symbols; symbols = tempsymbols;
 
         numcoins = 0;
+        numsymbols = 0;
 
         /*fill in the merged coins of the previous row*/
         for(i = 0; i + 1 < numprev; i += 2)
         {
           /*merge prev_row[i] and prev_row[i + 1] into new coin*/
-          Coin* coin = &coins[numcoins++];
-          coin_copy(coin, &prev_row[i]);
-          add_coins(coin, &prev_row[i + 1]);
+          merge_coins(&coins[numcoins++], symbols, &numsymbols, &prev_row[i], &prev_row[i + 1], prev_symbols);
         }
         /*fill in all the original symbols again*/
         if(j < maxbitlen)
         {
-          error = append_symbol_coins(coins + numcoins, frequencies, numcodes, sum);
+          append_symbol_coins(coins + numcoins, symbols, &numsymbols, frequencies, numcodes, sum);
           numcoins += numpresent;
         }
         qsort(coins, numcoins, sizeof(Coin), coin_compare);
       }
     }
 
-    if(!error)
+    /*calculate the lenghts of each symbol, as the amount of times a coin of each symbol is used*/
+    for(i = 0; i < numpresent - 1; i++)
     {
-      /*calculate the lenghts of each symbol, as the amount of times a coin of each symbol is used*/
-      for(i = 0; i < numpresent - 1; i++)
-      {
-        Coin* coin = &coins[i];
-        for(j = 0; j < coin->symbols.size; j++) lengths[coin->symbols.data[j]]++;
-      }
+      Coin* coin = &coins[i];
+      for(j = 0; j < coin->numsymbols; j++) lengths[symbols[coin->symbols + j]]++;
     }
 
-    cleanup_coins(coins, coinmem);
-    lodepng_free(coins);
-    cleanup_coins(prev_row, coinmem);
-    lodepng_free(prev_row);
+    /*coins and symbols may point to the second half after the swaps, free the blocks by their start*/
+    lodepng_free(coins < prev_row ? coins : prev_row);
+    lodepng_free(symbols < prev_symbols ? symbols : prev_symbols);
   }
 
-  return error;
+  return 0;
 }
 
 /*Create the Huffman tree given the symbol frequencies*/
@@ -912,6 +1067,18 @@ static unsigned generateFixedDistanceTree(HuffmanTree* tree)
 
 #ifdef LODEPNG_COMPILE_DECODER
 
+/*reads nbits bits at bitpointer without advancing it, bits past the end of the input are 0*/
+static unsigned peekBitsFromStream(size_t bitpointer, const unsigned char* bitstream,
+                                   size_t inbitlength, size_t nbits)
+{
+  unsigned result = 0, i;
+  for(i = 0; i < nbits && bitpointer < inbitlength; i++, bitpointer++)
+  {
+    result += ((unsigned)READBIT(bitpointer, bitstream)) << i;
+  }
+  return result;
+}
+
 /*
 returns the code, or (unsigned)(-1) if error happened
 inbitlength is the length of the complete buffer, in bits (so its byte length times 8)
@@ -919,21 +1086,21 @@ inbitlength is the length of the complete buffer, in bits (so its byte length ti
 static unsigned huffmanDecodeSymbol(const unsigned char* in, size_t* bp,
                                     const HuffmanTree* codetree, size_t inbitlength)
 {
-  unsigned treepos = 0, ct;
-  for(;;)
+  unsigned index, len, value;
+  if(*bp >= inbitlength) return (unsigned)(-1); /*error: end of input memory reached without endcode*/
+  index = peekBitsFromStream(*bp, in, inbitlength, FIRSTBITS);
+  len = codetree->table_len[index];
+  value = codetree->table_value[index];
+  if(len > FIRSTBITS)
   {
-    if(*bp >= inbitlength) return (unsigned)(-1); /*error: end of input memory reached without endcode*/
-    /*
-    decode the symbol from the tree. The "readBitFromStream" code is inlined in
-    the expression below because this is the biggest bottleneck while decoding
-    */
-    ct = codetree->tree2d[(treepos << 1) + READBIT(*bp, in)];
-    (*bp)++;
-    if(ct < codetree->numcodes) return ct; /*the symbol is decoded, return it*/
-    else treepos = ct - codetree->numcodes; /*symbol not yet decoded, instead move tree position*/
-
-    if(treepos >= codetree->numcodes) return (unsigned)(-1); /*error: it appeared outside the codetree*/
+    index = value + peekBitsFromStream(*bp + FIRSTBITS, in, inbitlength, len - FIRSTBITS);
+    len = codetree->table_len[index];
+    value = codetree->table_value[index];
   }
+  if(value == INVALIDSYMBOL) return (unsigned)(-1); /*error: the code is not in the tree*/
+  (*bp) += len;
+  if(*bp > inbitlength) return (unsigned)(-1); /*error: the code goes past the end of the input*/
+  return value;
 }
 #endif /*LODEPNG_COMPILE_DECODER*/
 
@@ -944,11 +1111,11 @@ static unsigned huffmanDecodeSymbol(const unsigned char* in, size_t* bp,
 /* ////////////////////////////////////////////////////////////////////////// */
 
 /*get the tree of a deflated block with fixed tree, as specified in the deflate specification*/
-static void getTreeInflateFixed(HuffmanTree* tree_ll, HuffmanTree* tree_d)
+static unsigned getTreeInflateFixed(HuffmanTree* tree_ll, HuffmanTree* tree_d)
 {
-  /*TODO: check for out of memory errors*/
-  generateFixedLitLenTree(tree_ll);
-  generateFixedDistanceTree(tree_d);
+  unsigned error = generateFixedLitLenTree(tree_ll);
+  if(error) return error;
+  return generateFixedDistanceTree(tree_d);
 }
 
 /*get the tree of a deflated block with dynamic tree, the tree itself is also Huffman compressed with a known tree*/
@@ -967,7 +1134,7 @@ static unsigned getTreeInflateDynamic(HuffmanTree* tree_ll, HuffmanTree* tree_d,
   unsigned* bitlen_cl = 0;
   HuffmanTree tree_cl; /*the code tree for code length codes (the huffman tree for compressed huffman trees)*/
 
-  if((*bp) >> 3 >= inlength - 2) return 49; /*error: the bit pointer is or will go past the memory*/
+  if((*bp) + 14 > inlength * 8) return 49; /*error: the bit pointer is or will go past the memory*/
 
   /*number of literal/length codes + 257. Unlike the spec, the value 257 is added to it here already*/
   HLIT =  readBitsFromStream(bp, in, 5) + 257;
@@ -985,6 +1152,7 @@ static unsigned getTreeInflateDynamic(HuffmanTree* tree_ll, HuffmanTree* tree_d,
     bitlen_cl = (unsigned*)lodepng_malloc(NUM_CODE_LENGTH_CODES * sizeof(unsigned));
     if(!bitlen_cl) ERROR_BREAK(83 /*alloc fail*/);
 
+    if((*bp) + HCLEN * 3 > inbitlength) ERROR_BREAK(50); /*error: the bit pointer is or will go past the memory*/
     for(i = 0; i < NUM_CODE_LENGTH_CODES; i++)
     {
       if(i < HCLEN) bitlen_cl[CLCL_ORDER[i]] = readBitsFromStream(bp, in, 3);
@@ -1017,7 +1185,7 @@ static unsigned getTreeInflateDynamic(HuffmanTree* tree_ll, HuffmanTree* tree_d,
         unsigned replength = 3; /*read in the 2 bits that indicate repeat length (3-6)*/
         unsigned value; /*set value to the previous code*/
 
-        if(*bp >= inbitlength) ERROR_BREAK(50); /*error, bit pointer jumps past memory*/
+        if((*bp) + 2 > inbitlength) ERROR_BREAK(50); /*error, bit pointer jumps past memory*/
         if (i == 0) ERROR_BREAK(54); /*can't repeat previous if i is 0*/
 
         replength += readBitsFromStream(bp, in, 2);
@@ -1036,7 +1204,7 @@ static unsigned getTreeInflateDynamic(HuffmanTree* tree_ll, HuffmanTree* tree_d,
       else if(code == 17) /*repeat "0" 3-10 times*/
       {
         unsigned replength = 3; /*read in the bits that indicate repeat length*/
-        if(*bp >= inbitlength) ERROR_BREAK(50); /*error, bit pointer jumps past memory*/
+        if((*bp) + 3 > inbitlength) ERROR_BREAK(50); /*error, bit pointer jumps past memory*/
 
         replength += readBitsFromStream(bp, in, 3);
 
@@ -1053,7 +1221,7 @@ static unsigned getTreeInflateDynamic(HuffmanTree* tree_ll, HuffmanTree* tree_d,
       else if(code == 18) /*repeat "0" 11-138 times*/
       {
         unsigned replength = 11; /*read in the bits that indicate repeat length*/
-        if(*bp >= inbitlength) ERROR_BREAK(50); /*error, bit pointer jumps past memory*/
+        if((*bp) + 7 > inbitlength) ERROR_BREAK(50); /*error, bit pointer jumps past memory*/
 
         replength += readBitsFromStream(bp, in, 7);
 
@@ -1099,6 +1267,127 @@ static unsigned getTreeInflateDynamic(HuffmanTree* tree_ll, HuffmanTree* tree_d,
   return error;
 }
 
+/*
+Bit buffer for inflateHuffmanBlock. Holds as many bits of the input as fit in an unsigned long,
+the widest type C90 has: 64 bits on most 64-bit systems, where a complete length/distance pair
+(at most 48 bits) is decoded after a single refill instead of indexing the input for every bit.
+With a 32-bit unsigned long the decoder refills between the parts of the pair.
+Bytes past the end of the input read as 0, the caller checks with BitBuffer_overrun whether
+those were consumed.
+*/
+typedef unsigned long BitBufferWord;
+#define BITBUFFER_BITS (unsigned)(sizeof(BitBufferWord) * 8)
+
+typedef struct BitBuffer
+{
+  const unsigned char* data;
+  size_t size; /*size of data in bytes*/
+  size_t next; /*next byte of data that is not in the buffer yet*/
+  BitBufferWord bits; /*the bits that are available, first bit of the stream in the lsb*/
+  unsigned avail; /*number of valid bits in bits*/
+} BitBuffer;
+
+static BitBufferWord lodepng_readBitBufferWordLE(const unsigned char* buffer)
+{
+  BitBufferWord result = (BitBufferWord)buffer[0] | ((BitBufferWord)buffer[1] << 8)
+                       | ((BitBufferWord)buffer[2] << 16) | ((BitBufferWord)buffer[3] << 24);
+  if(BITBUFFER_BITS >= 64)
+  {
+    /*two shifts by 16 instead of one by 32, which is not valid for a 32-bit type*/
+    BitBufferWord high = (BitBufferWord)buffer[4] | ((BitBufferWord)buffer[5] << 8)
+                       | ((BitBufferWord)buffer[6] << 16) | ((BitBufferWord)buffer[7] << 24);
+    result |= (high << 16) << 16;
+  }
+  return result;
+}
+
+/*fills the buffer to at least BITBUFFER_BITS - 8 bits*/
+static void BitBuffer_refill(BitBuffer* b)
+{
+  if(b->next + sizeof(BitBufferWord) <= b->size)
+  {
+    /*the bits above avail are either 0 or already the same bits of the input, so or-ing
+    a whole word in is fine, only the complete bytes are counted*/
+    unsigned num = (BITBUFFER_BITS - 1 - b->avail) >> 3;
+    b->bits |= lodepng_readBitBufferWordLE(&b->data[b->next]) << b->avail;
+    b->next += num;
+    b->avail += num << 3;
+  }
+  else
+  {
+    while(b->avail <= BITBUFFER_BITS - 8)
+    {
+      if(b->next < b->size) b->bits |= (BitBufferWord)b->data[b->next] << b->avail;
+      b->next++;
+      b->avail += 8;
+    }
+  }
+}
+
+/*makes sure the buffer holds at least nbits bits, nbits <= BITBUFFER_BITS - 8*/
+static void BitBuffer_ensure(BitBuffer* b, unsigned nbits)
+{
+  if(b->avail < nbits) BitBuffer_refill(b);
+}
+
+static void BitBuffer_init(BitBuffer* b, const unsigned char* in, size_t inlength, size_t bp)
+{
+  b->data = in;
+  b->size = inlength;
+  b->next = bp >> 3;
+  b->bits = 0;
+  b->avail = 0;
+  BitBuffer_refill(b);
+  b->bits >>= (bp & 7);
+  b->avail -= (unsigned)(bp & 7);
+}
+
+/*bit position in the input of the first bit in the buffer*/
+static size_t BitBuffer_bitpointer(const BitBuffer* b)
+{
+  return b->next * 8 - b->avail;
+}
+
+/*whether bits past the end of the input were consumed*/
+static int BitBuffer_overrun(const BitBuffer* b)
+{
+  return b->next > b->size && BitBuffer_bitpointer(b) > b->size * 8;
+}
+
+static unsigned BitBuffer_read(BitBuffer* b, unsigned nbits)
+{
+  unsigned result = (unsigned)(b->bits & ((1u << nbits) - 1u));
+  b->bits >>= nbits;
+  b->avail -= nbits;
+  return result;
+}
+
+/*
+decodes a symbol with the decoding table of the tree, returns INVALIDSYMBOL if the code
+is not in the tree. The buffer must contain at least 15 bits.
+*/
+static unsigned BitBuffer_decodeSymbol(BitBuffer* b, const HuffmanTree* codetree)
+{
+  unsigned index = (unsigned)(b->bits & ((1u << FIRSTBITS) - 1u));
+  unsigned len = codetree->table_len[index];
+  unsigned value = codetree->table_value[index];
+  if(len <= FIRSTBITS)
+  {
+    b->bits >>= len;
+    b->avail -= len;
+    return value;
+  }
+  b->bits >>= FIRSTBITS;
+  b->avail -= FIRSTBITS;
+  index = value + (unsigned)(b->bits & ((1u << (len - FIRSTBITS)) - 1u));
+  value = codetree->table_value[index];
+  if(value == INVALIDSYMBOL) return value;
+  len = codetree->table_len[index] - FIRSTBITS;
+  b->bits >>= len;
+  b->avail -= len;
+  return value;
+}
+
 /*inflate a block with dynamic of fixed Huffman tree*/
 static unsigned inflateHuffmanBlock(ucvector* out, const unsigned char* in, size_t* bp,
                                     size_t* pos, size_t inlength, unsigned btype)
@@ -1106,18 +1395,29 @@ static unsigned inflateHuffmanBlock(ucvector* out, const unsigned char* in, size
   unsigned error = 0;
   HuffmanTree tree_ll; /*the huffman tree for literal and length codes*/
   HuffmanTree tree_d; /*the huffman tree for distance codes*/
-  size_t inbitlength = inlength * 8;
+  BitBuffer reader;
 
   HuffmanTree_init(&tree_ll);
   HuffmanTree_init(&tree_d);
 
-  if(btype == 1) getTreeInflateFixed(&tree_ll, &tree_d);
+  if(btype == 1) error = getTreeInflateFixed(&tree_ll, &tree_d);
   else if(btype == 2) error = getTreeInflateDynamic(&tree_ll, &tree_d, in, bp, inlength);
 
+  if(!error) BitBuffer_init(&reader, in, inlength, *bp);
+
   while(!error) /*decode all symbols until end reached, breaks at end code*/
   {
+    unsigned code_ll;
+    /*a literal/length code with its extra bits and a distance code with its extra bits take at most 48 bits,
+    with a 64-bit buffer this is the only refill for them*/
+    if(reader.avail < 48)
+    {
+      BitBuffer_refill(&reader);
+      if(BitBuffer_overrun(&reader)) ERROR_BREAK(10); /*error: end of input memory reached without endcode*/
+    }
+
     /*code_ll is literal, length or end code*/
-    unsigned code_ll = huffmanDecodeSymbol(in, bp, &tree_ll, inbitlength);
+    code_ll = BitBuffer_decodeSymbol(&reader, &tree_ll);
     if(code_ll <= 255) /*literal symbol*/
     {
       /*ucvector_push_back would do the same, but for some reason the two lines below run 10% faster*/
@@ -1136,19 +1436,15 @@ static unsigned inflateHuffmanBlock(ucvector* out, const unsigned char* in, size
 
       /*part 2: get extra bits and add the value of that to length*/
       numextrabits_l = LENGTHEXTRA[code_ll - FIRST_LENGTH_CODE_INDEX];
-      if(*bp >= inbitlength) ERROR_BREAK(51); /*error, bit pointer will jump past memory*/
-      length += readBitsFromStream(bp, in, numextrabits_l);
+      BitBuffer_ensure(&reader, numextrabits_l);
+      length += BitBuffer_read(&reader, numextrabits_l);
 
       /*part 3: get distance code*/
-      code_d = huffmanDecodeSymbol(in, bp, &tree_d, inbitlength);
+      BitBuffer_ensure(&reader, 15);
+      code_d = BitBuffer_decodeSymbol(&reader, &tree_d);
       if(code_d > 29)
       {
-        if(code_ll == (unsigned)(-1)) /*huffmanDecodeSymbol returns (unsigned)(-1) in case of error*/
-        {
-          /*return error code 10 or 11 depending on the situation that happened in huffmanDecodeSymbol
-          (10=no endcode, 11=wrong jump outside of tree)*/
-          error = (*bp) > inlength * 8 ? 10 : 11;
-        }
+        if(code_d == INVALIDSYMBOL) error = 11; /*error: the code is not in the tree*/
         else error = 18; /*error: invalid distance code (30-31 are never used)*/
         break;
       }
@@ -1156,9 +1452,9 @@ static unsigned inflateHuffmanBlock(ucvector* out, const unsigned char* in, size
 
       /*part 4: get extra bits from distance*/
       numextrabits_d = DISTANCEEXTRA[code_d];
-      if(*bp >= inbitlength) ERROR_BREAK(51); /*error, bit pointer will jump past memory*/
-
-      distance += readBitsFromStream(bp, in, numextrabits_d);
+      BitBuffer_ensure(&reader, numextrabits_d);
+      distance += BitBuffer_read(&reader, numextrabits_d);
+      if(BitBuffer_overrun(&reader)) ERROR_BREAK(51); /*error, bit pointer jumped past memory*/
 
       /*part 5: fill in all the out[n] values based on the length and dist*/
       start = (*pos);
@@ -1166,27 +1462,28 @@ static unsigned inflateHuffmanBlock(ucvector* out, const unsigned char* in, size
       backward = start - distance;
 
       if(!ucvector_resize(out, (*pos) + length)) ERROR_BREAK(83 /*alloc fail*/);
+      /*when distance < length the copy overlaps itself, copying per byte repeats the pattern*/
       for(forward = 0; forward < length; forward++)
       {
-        out->data[(*pos)] = out->data[backward];
-        (*pos)++;
-        backward++;
-        if(backward >= start) backward = start - distance;
+        out->data[(*pos)++] = out->data[backward++];
       }
     }
     else if(code_ll == 256)
     {
+      if(BitBuffer_overrun(&reader)) error = 10; /*error: the end code is past the end of the input*/
       break; /*end code, break the loop*/
     }
-    else /*if(code == (unsigned)(-1))*/ /*huffmanDecodeSymbol returns (unsigned)(-1) in case of error*/
+    else /*if(code_ll == INVALIDSYMBOL)*/
     {
-      /*return error code 10 or 11 depending on the situation that happened in huffmanDecodeSymbol
+      /*return error code 10 or 11 depending on the situation
       (10=no endcode, 11=wrong jump outside of tree)*/
-      error = (*bp) > inlength * 8 ? 10 : 11;
+      error = BitBuffer_overrun(&reader) ? 10 : 11;
       break;
     }
   }
 
+  if(!error) *bp = BitBuffer_bitpointer(&reader);
+
   HuffmanTree_cleanup(&tree_ll);
   HuffmanTree_cleanup(&tree_d);
 
@@ -1333,8 +1630,8 @@ static void addLengthDistance(uivector* values, size_t length, size_t distance)
   uivector_push_back(values, extra_distance);
 }
 
-/*3 bytes of data get encoded into two bytes. The hash cannot use more than 3
-bytes as input because 3 is the minimum match length for deflate*/
+/*4 bytes of data get hashed into two bytes. Matches of only 3 bytes are still found when
+they collide, they are rarely worth it anyway due to the cost of the distance*/
 static const unsigned HASH_NUM_VALUES = 65536;
 static const unsigned HASH_BIT_MASK = 65535; /*HASH_NUM_VALUES - 1, but C90 does not like that as initializer*/
 
@@ -1350,23 +1647,25 @@ typedef struct Hash
   int* headz; /*similar to head, but for chainz*/
   unsigned short* chainz; /*those with same amount of zeros*/
   unsigned short* zeros; /*length of zeros streak, used as a second hash chain*/
+
+  size_t memsize; /*size of the single block all of the above are in, it starts at head*/
 } Hash;
 
-static unsigned hash_init(Hash* hash, unsigned windowsize)
+/*scratch can be NULL, otherwise the tables are taken from it*/
+static unsigned hash_init(Hash* hash, unsigned windowsize, LodePNGScratch* scratch)
 {
   unsigned i;
-  hash->head = (int*)lodepng_malloc(sizeof(int) * HASH_NUM_VALUES);
-  hash->val = (int*)lodepng_malloc(sizeof(int) * windowsize);
-  hash->chain = (unsigned short*)lodepng_malloc(sizeof(unsigned short) * windowsize);
-
-  hash->zeros = (unsigned short*)lodepng_malloc(sizeof(unsigned short) * windowsize);
-  hash->headz = (int*)lodepng_malloc(sizeof(int) * (MAX_SUPPORTED_DEFLATE_LENGTH + 1));
-  hash->chainz = (unsigned short*)lodepng_malloc(sizeof(unsigned short) * windowsize);
-
-  if(!hash->head || !hash->chain || !hash->val  || !hash->headz|| !hash->chainz || !hash->zeros)
-  {
-    return 83; /*alloc fail*/
-  }
+  /*the int arrays go first, so that all arrays are aligned*/
+  size_t numints = HASH_NUM_VALUES + windowsize + MAX_SUPPORTED_DEFLATE_LENGTH + 1;
+  void* mem = scratch_get(scratch, sizeof(int) * numints + sizeof(unsigned short) * 3 * windowsize, &hash->memsize);
+  if(!mem) return 83; /*alloc fail*/
+
+  hash->head = (int*)mem;
+  hash->val = hash->head + HASH_NUM_VALUES;
+  hash->headz = hash->val + windowsize;
+  hash->chain = (unsigned short*)(hash->headz + MAX_SUPPORTED_DEFLATE_LENGTH + 1);
+  hash->zeros = hash->chain + windowsize;
+  hash->chainz = hash->zeros + windowsize;
 
   /*initialize hash table*/
   for(i = 0; i < HASH_NUM_VALUES; i++) hash->head[i] = -1;
@@ -1379,15 +1678,10 @@ static unsigned hash_init(Hash* hash, unsigned windowsize)
   return 0;
 }
 
-static void hash_cleanup(Hash* hash)
+/*scratch must be the one given to hash_init*/
+static void hash_cleanup(Hash* hash, LodePNGScratch* scratch)
 {
-  lodepng_free(hash->head);
-  lodepng_free(hash->val);
-  lodepng_free(hash->chain);
-
-  lodepng_free(hash->zeros);
-  lodepng_free(hash->headz);
-  lodepng_free(hash->chainz);
+  scratch_put(scratch, hash->head, hash->memsize);
 }
 
 
@@ -1395,15 +1689,14 @@ static void hash_cleanup(Hash* hash)
 static unsigned getHash(const unsigned char* data, size_t size, size_t pos)
 {
   unsigned result = 0;
-  if (pos + 2 < size)
-  {
-    /*A simple shift and xor hash is used. Since the data of PNGs is dominated
-    by zeroes due to the filters, a better hash does not have a significant
-    effect on speed in traversing the chain, and causes more time spend on
-    calculating the hash.*/
-    result ^= (unsigned)(data[pos + 0] << 0u);
-    result ^= (unsigned)(data[pos + 1] << 4u);
-    result ^= (unsigned)(data[pos + 2] << 8u);
+  if (pos + 3 < size)
+  {
+    /*Multiplicative hash of 4 bytes, the top 16 bits of the product depend on all input
+    bits, so the chains only hold positions that are likely to match. A run of zeroes
+    hashes to 0, which the zeros chain relies on.*/
+    unsigned value = data[pos] | ((unsigned)data[pos + 1] << 8u)
+                   | ((unsigned)data[pos + 2] << 16u) | ((unsigned)data[pos + 3] << 24u);
+    result = ((value * 2654435761u) & 0xffffffffu) >> 16u;
   } else {
     size_t amount, i;
     if(pos >= size) return 0;
@@ -1413,6 +1706,35 @@ static unsigned getHash(const unsigned char* data, size_t size, size_t pos)
   return result & HASH_BIT_MASK;
 }
 
+#ifdef LODEPNG_COMPILE_PNG
+/*puts the hash back in the state of hash_init after the positions 0..used-1 of data were added
+to it, by only resetting the entries they touched*/
+static void hash_reset(Hash* hash, const unsigned char* data, size_t used, unsigned windowsize)
+{
+  size_t i;
+  if(used >= HASH_NUM_VALUES)
+  {
+    for(i = 0; i < HASH_NUM_VALUES; i++) hash->head[i] = -1;
+    used = windowsize;
+  }
+  else if(used > windowsize)
+  {
+    /*the window wrapped around, val no longer has the hash of every position that set a head*/
+    for(i = 0; i < used; i++) hash->head[getHash(data, used, i)] = -1;
+    used = windowsize;
+  }
+  for(i = 0; i <= MAX_SUPPORTED_DEFLATE_LENGTH; i++) hash->headz[i] = -1;
+  for(i = 0; i < used; i++)
+  {
+    if(hash->val[i] != -1) hash->head[hash->val[i]] = -1;
+    hash->val[i] = -1;
+    hash->chain[i] = i;
+    hash->chainz[i] = i;
+    hash->zeros[i] = 0;
+  }
+}
+#endif /*LODEPNG_COMPILE_PNG*/
+
 static unsigned countZeros(const unsigned char* data, size_t size, size_t pos)
 {
   const unsigned char* start = data + pos;
@@ -1447,12 +1769,12 @@ this hash technique is one out of several ways to speed this up.
 */
 static unsigned encodeLZ77(uivector* out, Hash* hash,
                            const unsigned char* in, size_t inpos, size_t insize, unsigned windowsize,
-                           unsigned minmatch, unsigned nicematch, unsigned lazymatching)
+                           unsigned minmatch, unsigned nicematch, unsigned lazymatching, unsigned maxchain)
 {
   size_t pos;
   unsigned i, error = 0;
   /*for large window lengths, assume the user wants no compression loss. Otherwise, max hash chain length speedup.*/
-  unsigned maxchainlength = windowsize >= 8192 ? windowsize : windowsize / 8;
+  unsigned maxchainlength = maxchain ? maxchain : windowsize >= 8192 ? windowsize : windowsize / 8;
   unsigned maxlazymatch = windowsize >= 8192 ? MAX_SUPPORTED_DEFLATE_LENGTH : 64;
 
   unsigned usezeros = 1; /*not sure if setting it to false for windowsize < 8192 is better or worse*/
@@ -1594,6 +1916,21 @@ static unsigned encodeLZ77(uivector* out, Hash* hash,
       length of only 3 may be not worth it then*/
       if(!uivector_push_back(out, in[pos])) ERROR_BREAK(83 /*alloc fail*/);
     }
+    else if(!lazymatching && length >= nicematch)
+    {
+      /*greedy mode: the positions inside long matches are not added to the hash chains,
+      that is where most of the time goes for repetitive images. Their window slots are
+      invalidated so that stale chain links into them are never followed*/
+      addLengthDistance(out, length, offset);
+      for(i = 1; i < length; i++)
+      {
+        pos++;
+        wpos = pos & (windowsize - 1);
+        hash->val[wpos] = -1;
+        hash->zeros[wpos] = 0;
+      }
+      numzeros = 0; /*the zeros streak must be counted again at the next position*/
+    }
     else
     {
       addLengthDistance(out, length, offset);
@@ -1621,7 +1958,7 @@ static unsigned encodeLZ77(uivector* out, Hash* hash,
 
 /* /////////////////////////////////////////////////////////////////////////// */
 
-static unsigned deflateNoCompression(ucvector* out, const unsigned char* data, size_t datasize)
+static unsigned deflateNoCompression(ucvector* out, const unsigned char* data, size_t datasize, unsigned final)
 {
   /*non compressed deflate block data: 1 bit BFINAL,2 bits BTYPE,(5 bits): it jumps to start of next byte,
   2 bytes LEN, 2 bytes NLEN, LEN bytes literal DATA*/
@@ -1633,7 +1970,7 @@ static unsigned deflateNoCompression(ucvector* out, const unsigned char* data, s
     unsigned BFINAL, BTYPE, LEN, NLEN;
     unsigned char firstbyte;
 
-    BFINAL = (i == numdeflateblocks - 1);
+    BFINAL = final && (i == numdeflateblocks - 1);
     BTYPE = 0;
 
     firstbyte = (unsigned char)(BFINAL + ((BTYPE & 1) << 1) + ((BTYPE & 2) << 1));
@@ -1754,7 +2091,7 @@ static unsigned deflateDynamic(ucvector* out, size_t* bp, Hash* hash,
     if(settings->use_lz77)
     {
       error = encodeLZ77(&lz77_encoded, hash, data, datapos, dataend, settings->windowsize,
-                         settings->minmatch, settings->nicematch, settings->lazymatching);
+                         settings->minmatch, settings->nicematch, settings->lazymatching, settings->maxchain);
       if(error) break;
     }
     else
@@ -1964,7 +2301,7 @@ static unsigned deflateFixed(ucvector* out, size_t* bp, Hash* hash,
     uivector lz77_encoded;
     uivector_init(&lz77_encoded);
     error = encodeLZ77(&lz77_encoded, hash, data, datapos, dataend, settings->windowsize,
-                       settings->minmatch, settings->nicematch, settings->lazymatching);
+                       settings->minmatch, settings->nicematch, settings->lazymatching, settings->maxchain);
     if(!error) writeLZ77data(bp, out, &lz77_encoded, &tree_ll, &tree_d);
     uivector_cleanup(&lz77_encoded);
   }
@@ -1985,16 +2322,43 @@ static unsigned deflateFixed(ucvector* out, size_t* bp, Hash* hash,
   return error;
 }
 
-static unsigned lodepng_deflatev(ucvector* out, const unsigned char* in, size_t insize,
-                                 const LodePNGCompressSettings* settings)
+/*adds the positions in[start..end-1] to the hash chains without encoding them, so that
+the following data can refer back to them*/
+static void hashPrefill(Hash* hash, const unsigned char* in, size_t start, size_t end, size_t insize,
+                        unsigned windowsize)
+{
+  size_t pos;
+  unsigned numzeros = 0;
+  for(pos = start; pos < end; pos++)
+  {
+    unsigned hashval = getHash(in, insize, pos);
+    if(hashval == 0)
+    {
+      if (numzeros == 0) numzeros = countZeros(in, insize, pos);
+      else if (pos + numzeros > insize || in[pos + numzeros - 1] != 0) numzeros--;
+    }
+    else
+    {
+      numzeros = 0;
+    }
+    updateHashChain(hash, pos & (windowsize - 1), hashval, numzeros);
+  }
+}
+
+/*deflates in[dictsize..dictsize+insize-1], the bytes before it are the preset dictionary.
+If not final, the stream is ended with an empty stored block (a zlib sync flush), so that
+it ends on a byte boundary and more deflate data can be appended to it.*/
+static unsigned deflateSegment(ucvector* out, const unsigned char* in, size_t dictsize, size_t insize,
+                               unsigned final, const LodePNGCompressSettings* settings, LodePNGScratch* scratch)
 {
   unsigned error = 0;
   size_t i, blocksize, numdeflateblocks;
   size_t bp = 0; /*the bit pointer*/
+  size_t inend = dictsize + insize;
   Hash hash;
 
   if(settings->btype > 2) return 61;
-  else if(settings->btype == 0) return deflateNoCompression(out, in, insize);
+  else if(settings->btype == 0) return deflateNoCompression(out, in + dictsize, insize, final);
   else if(settings->btype == 1) blocksize = insize;
   else /*if(settings->btype == 2)*/
   {
@@ -2005,41 +2369,102 @@ static unsigned lodepng_deflatev(ucvector* out, const unsigned char* in, size_t
   numdeflateblocks = (insize + blocksize - 1) / blocksize;
   if(numdeflateblocks == 0) numdeflateblocks = 1;
 
-  error = hash_init(&hash, settings->windowsize);
+  error = hash_init(&hash, settings->windowsize, scratch);
   if(error) return error;
 
+  if(dictsize > 0 && settings->use_lz77)
+  {
+    size_t dictstart = dictsize > settings->windowsize ? dictsize - settings->windowsize : 0;
+    hashPrefill(&hash, in, dictstart, dictsize, inend, settings->windowsize);
+  }
+
   for(i = 0; i < numdeflateblocks && !error; i++)
   {
-    unsigned final = (i == numdeflateblocks - 1);
-    size_t start = i * blocksize;
+    unsigned lastblock = final && (i == numdeflateblocks - 1);
+    size_t start = dictsize + i * blocksize;
     size_t end = start + blocksize;
-    if(end > insize) end = insize;
+    if(end > inend) end = inend;
 
-    if(settings->btype == 1) error = deflateFixed(out, &bp, &hash, in, start, end, settings, final);
-    else if(settings->btype == 2) error = deflateDynamic(out, &bp, &hash, in, start, end, settings, final);
+    if(settings->btype == 1) error = deflateFixed(out, &bp, &hash, in, start, end, settings, lastblock);
+    else if(settings->btype == 2) error = deflateDynamic(out, &bp, &hash, in, start, end, settings, lastblock);
+  }
+
+  if(!error && !final)
+  {
+    /*empty stored block: BFINAL 0, BTYPE 00, padding to the byte boundary, LEN 0 and NLEN 65535*/
+    addBitsToStream(&bp, out, 0, 3);
+    ucvector_push_back(out, 0);
+    ucvector_push_back(out, 0);
+    ucvector_push_back(out, 255);
+    ucvector_push_back(out, 255);
   }
 
-  hash_cleanup(&hash);
+  hash_cleanup(&hash, scratch);
 
   return error;
 }
 
+static unsigned lodepng_deflatev(ucvector* out, const unsigned char* in, size_t insize,
+                                 const LodePNGCompressSettings* settings, LodePNGScratch* scratch)
+{
+  return deflateSegment(out, in, 0, insize, 1, settings, scratch);
+}
+
+#ifdef LODEPNG_COMPILE_PNG
+/*For LFS_BRUTE_FORCE: the size of the data deflated as a single block with the fixed tree. The hash
+must have been made with hash_init for the windowsize of the settings, it is reset to be used again*/
+static unsigned deflateFixedSize(size_t* size, Hash* hash, const unsigned char* data, size_t datasize,
+                                 const LodePNGCompressSettings* settings)
+{
+  unsigned error;
+  size_t bp = 0;
+  ucvector v;
+  ucvector_init(&v);
+  error = deflateFixed(&v, &bp, hash, data, 0, datasize, settings, 1);
+  *size = v.size;
+  ucvector_cleanup(&v);
+  hash_reset(hash, data, datasize, settings->windowsize);
+  return error;
+}
+#endif /*LODEPNG_COMPILE_PNG*/
+
+static unsigned deflateScratch(unsigned char** out, size_t* outsize,
+                               const unsigned char* in, size_t insize,
+                               const LodePNGCompressSettings* settings, LodePNGScratch* scratch)
+{
+  unsigned error;
+  ucvector v;
+  ucvector_init_buffer(&v, *out, *outsize);
+  error = lodepng_deflatev(&v, in, insize, settings, scratch);
+  *out = v.data;
+  *outsize = v.size;
+  return error;
+}
+
 unsigned lodepng_deflate(unsigned char** out, size_t* outsize,
                          const unsigned char* in, size_t insize,
                          const LodePNGCompressSettings* settings)
+{
+  return deflateScratch(out, outsize, in, insize, settings, 0);
+}
+
+unsigned lodepng_deflate_segment(unsigned char** out, size_t* outsize,
+                                 const unsigned char* in, size_t dictsize, size_t insize, unsigned final,
+                                 const LodePNGCompressSettings* settings)
 {
   unsigned error;
   ucvector v;
   ucvector_init_buffer(&v, *out, *outsize);
-  error = lodepng_deflatev(&v, in, insize, settings);
+  error = deflateSegment(&v, in, dictsize, insize, final, settings, 0);
   *out = v.data;
   *outsize = v.size;
   return error;
 }
 
+/*the scratch is only used by the built in deflate*/
 static unsigned deflate(unsigned char** out, size_t* outsize,
                         const unsigned char* in, size_t insize,
-                        const LodePNGCompressSettings* settings)
+                        const LodePNGCompressSettings* settings, LodePNGScratch* scratch)
 {
   if(settings->custom_deflate)
   {
@@ -2047,7 +2472,7 @@ static unsigned deflate(unsigned char** out, size_t* outsize,
   }
   else
   {
-    return lodepng_deflate(out, outsize, in, insize, settings);
+    return deflateScratch(out, outsize, in, insize, settings, scratch);
   }
 }
 
@@ -2057,7 +2482,7 @@ static unsigned deflate(unsigned char** out, size_t* outsize,
 /* / Adler32                                                                  */
 /* ////////////////////////////////////////////////////////////////////////// */
 
-static unsigned update_adler32(unsigned adler, const unsigned char* data, unsigned len)
+static unsigned update_adler32_scalar(unsigned adler, const unsigned char* data, unsigned len)
 {
    unsigned s1 = adler & 0xffff;
    unsigned s2 = (adler >> 16) & 0xffff;
@@ -2080,12 +2505,144 @@ static unsigned update_adler32(unsigned adler, const unsigned char* data, unsign
   return (s2 << 16) | s1;
 }
 
+#ifdef LODEPNG_X86_DISPATCH
+/*
+The SIMD versions handle blocks of 32 bytes: per block, s1 grows by the sum of the bytes
+and s2 by 32 * s1 plus the bytes weighted 32, 31, ..., 1. The weighted sums are done with
+maddubs, the plain sums with sad. At most 173 blocks (5536 bytes) fit before the modulo.
+*/
+#define ADLER32_SIMD_BLOCKS 173
+
+LODEPNG_TARGET("ssse3")
+static unsigned update_adler32_ssse3(unsigned adler, const unsigned char* data, unsigned len)
+{
+  const __m128i tap1 = _mm_setr_epi8(32, 31, 30, 29, 28, 27, 26, 25, 24, 23, 22, 21, 20, 19, 18, 17);
+  const __m128i tap2 = _mm_setr_epi8(16, 15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1);
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i ones = _mm_set1_epi16(1);
+  unsigned s1 = adler & 0xffff;
+  unsigned s2 = (adler >> 16) & 0xffff;
+  unsigned blocks = len / 32;
+  len -= blocks * 32;
+
+  while(blocks > 0)
+  {
+    unsigned n = blocks > ADLER32_SIMD_BLOCKS ? ADLER32_SIMD_BLOCKS : blocks;
+    __m128i v_ps = _mm_cvtsi32_si128((int)(s1 * n)); /*sum of s1 before each block*/
+    __m128i v_s1 = zero;
+    __m128i v_s2 = _mm_cvtsi32_si128((int)s2);
+    blocks -= n;
+    while(n > 0)
+    {
+      const __m128i bytes1 = _mm_loadu_si128((const __m128i*)data);
+      const __m128i bytes2 = _mm_loadu_si128((const __m128i*)(data + 16));
+      v_ps = _mm_add_epi32(v_ps, v_s1);
+      v_s1 = _mm_add_epi32(v_s1, _mm_add_epi32(_mm_sad_epu8(bytes1, zero), _mm_sad_epu8(bytes2, zero)));
+      v_s2 = _mm_add_epi32(v_s2, _mm_madd_epi16(_mm_maddubs_epi16(bytes1, tap1), ones));
+      v_s2 = _mm_add_epi32(v_s2, _mm_madd_epi16(_mm_maddubs_epi16(bytes2, tap2), ones));
+      data += 32;
+      n--;
+    }
+    v_s2 = _mm_add_epi32(v_s2, _mm_slli_epi32(v_ps, 5));
+    /*horizontal sums of the 4 lanes*/
+    v_s1 = _mm_add_epi32(v_s1, _mm_shuffle_epi32(v_s1, _MM_SHUFFLE(2, 3, 0, 1)));
+    v_s1 = _mm_add_epi32(v_s1, _mm_shuffle_epi32(v_s1, _MM_SHUFFLE(1, 0, 3, 2)));
+    v_s2 = _mm_add_epi32(v_s2, _mm_shuffle_epi32(v_s2, _MM_SHUFFLE(2, 3, 0, 1)));
+    v_s2 = _mm_add_epi32(v_s2, _mm_shuffle_epi32(v_s2, _MM_SHUFFLE(1, 0, 3, 2)));
+    s1 = (s1 + (unsigned)_mm_cvtsi128_si32(v_s1)) % 65521;
+    s2 = (unsigned)_mm_cvtsi128_si32(v_s2) % 65521;
+  }
+
+  return update_adler32_scalar((s2 << 16) | s1, data, len);
+}
+
+/*the AVX2 version handles two 32-byte halves per step, weighted 64..33 and 32..1*/
+LODEPNG_TARGET("avx2")
+static unsigned update_adler32_avx2(unsigned adler, const unsigned char* data, unsigned len)
+{
+  const __m256i tap1 = _mm256_setr_epi8(64, 63, 62, 61, 60, 59, 58, 57, 56, 55, 54, 53, 52, 51, 50, 49,
+                                        48, 47, 46, 45, 44, 43, 42, 41, 40, 39, 38, 37, 36, 35, 34, 33);
+  const __m256i tap2 = _mm256_setr_epi8(32, 31, 30, 29, 28, 27, 26, 25, 24, 23, 22, 21, 20, 19, 18, 17,
+                                        16, 15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1);
+  const __m256i zero = _mm256_setzero_si256();
+  const __m256i ones = _mm256_set1_epi16(1);
+  unsigned s1 = adler & 0xffff;
+  unsigned s2 = (adler >> 16) & 0xffff;
+  unsigned blocks = len / 64;
+  len -= blocks * 64;
+
+  while(blocks > 0)
+  {
+    unsigned n = blocks > ADLER32_SIMD_BLOCKS / 2 ? ADLER32_SIMD_BLOCKS / 2 : blocks;
+    __m256i v_ps = _mm256_setr_epi32((int)(s1 * n), 0, 0, 0, 0, 0, 0, 0); /*sum of s1 before each step*/
+    __m256i v_s1 = zero;
+    __m256i v_s2 = _mm256_setr_epi32((int)s2, 0, 0, 0, 0, 0, 0, 0);
+    __m128i h_s1, h_s2;
+    blocks -= n;
+    while(n > 0)
+    {
+      const __m256i bytes1 = _mm256_loadu_si256((const __m256i*)data);
+      const __m256i bytes2 = _mm256_loadu_si256((const __m256i*)(data + 32));
+      v_ps = _mm256_add_epi32(v_ps, v_s1);
+      v_s1 = _mm256_add_epi32(v_s1, _mm256_add_epi32(_mm256_sad_epu8(bytes1, zero), _mm256_sad_epu8(bytes2, zero)));
+      v_s2 = _mm256_add_epi32(v_s2, _mm256_madd_epi16(_mm256_maddubs_epi16(bytes1, tap1), ones));
+      v_s2 = _mm256_add_epi32(v_s2, _mm256_madd_epi16(_mm256_maddubs_epi16(bytes2, tap2), ones));
+      data += 64;
+      n--;
+    }
+    v_s2 = _mm256_add_epi32(v_s2, _mm256_slli_epi32(v_ps, 6));
+    /*horizontal sums of the 8 lanes*/
+    h_s1 = _mm_add_epi32(_mm256_castsi256_si128(v_s1), _mm256_extracti128_si256(v_s1, 1));
+    h_s2 = _mm_add_epi32(_mm256_castsi256_si128(v_s2), _mm256_extracti128_si256(v_s2, 1));
+    h_s1 = _mm_add_epi32(h_s1, _mm_shuffle_epi32(h_s1, _MM_SHUFFLE(2, 3, 0, 1)));
+    h_s1 = _mm_add_epi32(h_s1, _mm_shuffle_epi32(h_s1, _MM_SHUFFLE(1, 0, 3, 2)));
+    h_s2 = _mm_add_epi32(h_s2, _mm_shuffle_epi32(h_s2, _MM_SHUFFLE(2, 3, 0, 1)));
+    h_s2 = _mm_add_epi32(h_s2, _mm_shuffle_epi32(h_s2, _MM_SHUFFLE(1, 0, 3, 2)));
+    s1 = (s1 + (unsigned)_mm_cvtsi128_si32(h_s1)) % 65521;
+    s2 = (unsigned)_mm_cvtsi128_si32(h_s2) % 65521;
+  }
+
+  return update_adler32_ssse3((s2 << 16) | s1, data, len);
+}
+#endif /*LODEPNG_X86_DISPATCH*/
+
+static unsigned update_adler32(unsigned adler, const unsigned char* data, unsigned len)
+{
+#ifdef LODEPNG_X86_DISPATCH
+  if(len >= 64)
+  {
+    if(lodepng_cpu_has(LODEPNG_CPU_AVX2)) return update_adler32_avx2(adler, data, len);
+    if(lodepng_cpu_has(LODEPNG_CPU_SSSE3)) return update_adler32_ssse3(adler, data, len);
+  }
+#endif /*LODEPNG_X86_DISPATCH*/
+  return update_adler32_scalar(adler, data, len);
+}
+
 /*Return the adler32 of the bytes data[0..len-1]*/
 static unsigned adler32(const unsigned char* data, unsigned len)
 {
   return update_adler32(1L, data, len);
 }
 
+unsigned lodepng_adler32(const unsigned char* data, size_t len)
+{
+  return adler32(data, (unsigned)len);
+}
+
+/*the adler32 of two concatenated buffers, from the adler32 of each and the size of the second.
+s1 of the second part starts at s1 of the first part instead of 1, so it grows by (s1a - 1),
+and that also adds (s1a - 1) * len2 to its s2*/
+unsigned lodepng_adler32_combine(unsigned adler1, unsigned adler2, size_t len2)
+{
+  unsigned rem = (unsigned)(len2 % 65521);
+  unsigned s1a = adler1 & 0xffff, s2a = (adler1 >> 16) & 0xffff;
+  unsigned s1b = adler2 & 0xffff, s2b = (adler2 >> 16) & 0xffff;
+  unsigned s1 = (s1a + s1b + 65520) % 65521;
+  /*rem * s1a is below 65521 * 65521, the sum fits in 32 bits*/
+  unsigned s2 = (unsigned)(((unsigned long)rem * s1a + s2a + s2b + 65521 - rem) % 65521);
+  return (s2 << 16) | s1;
+}
+
 /* ////////////////////////////////////////////////////////////////////////// */
 /* / Zlib                                                                   / */
 /* ////////////////////////////////////////////////////////////////////////// */
@@ -2154,8 +2711,8 @@ static unsigned zlib_decompress(unsigned char** out, size_t* outsize, const unsi
 
 #ifdef LODEPNG_COMPILE_ENCODER
 
-unsigned lodepng_zlib_compress(unsigned char** out, size_t* outsize, const unsigned char* in,
-                               size_t insize, const LodePNGCompressSettings* settings)
+static unsigned zlibCompress(unsigned char** out, size_t* outsize, const unsigned char* in,
+                             size_t insize, const LodePNGCompressSettings* settings, LodePNGScratch* scratch)
 {
   /*initially, *out must be NULL and outsize 0, if you just give some random *out
   that's pointing to a non allocated buffer, this'll crash*/
@@ -2180,7 +2737,7 @@ unsigned lodepng_zlib_compress(unsigned char** out, size_t* outsize, const unsig
   ucvector_push_back(&outv, (unsigned char)(CMFFLG / 256));
   ucvector_push_back(&outv, (unsigned char)(CMFFLG % 256));
 
-  error = deflate(&deflatedata, &deflatesize, in, insize, settings);
+  error = deflate(&deflatedata, &deflatesize, in, insize, settings, scratch);
 
   if(!error)
   {
@@ -2196,9 +2753,15 @@ unsigned lodepng_zlib_compress(unsigned char** out, size_t* outsize, const unsig
   return error;
 }
 
-/* compress using the default or custom zlib function */
+unsigned lodepng_zlib_compress(unsigned char** out, size_t* outsize, const unsigned char* in,
+                               size_t insize, const LodePNGCompressSettings* settings)
+{
+  return zlibCompress(out, outsize, in, insize, settings, 0);
+}
+
+/* compress using the default or custom zlib function, scratch can be NULL and is only used by the default one */
 static unsigned zlib_compress(unsigned char** out, size_t* outsize, const unsigned char* in,
-                              size_t insize, const LodePNGCompressSettings* settings)
+                              size_t insize, const LodePNGCompressSettings* settings, LodePNGScratch* scratch)
 {
   if(settings->custom_zlib)
   {
@@ -2206,7 +2769,7 @@ static unsigned zlib_compress(unsigned char** out, size_t* outsize, const unsign
   }
   else
   {
-    return lodepng_zlib_compress(out, outsize, in, insize, settings);
+    return zlibCompress(out, outsize, in, insize, settings, scratch);
   }
 }
 
@@ -2224,8 +2787,9 @@ static unsigned zlib_decompress(unsigned char** out, size_t* outsize, const unsi
 #endif /*LODEPNG_COMPILE_DECODER*/
 #ifdef LODEPNG_COMPILE_ENCODER
 static unsigned zlib_compress(unsigned char** out, size_t* outsize, const unsigned char* in,
-                              size_t insize, const LodePNGCompressSettings* settings)
+                              size_t insize, const LodePNGCompressSettings* settings, LodePNGScratch* scratch)
 {
+  (void)scratch;
   if (!settings->custom_zlib) return 87; /*no custom zlib function provided */
   return settings->custom_zlib(out, outsize, in, insize, settings);
 }
@@ -2249,13 +2813,43 @@ void lodepng_compress_settings_init(LodePNGCompressSettings* settings)
   settings->minmatch = 3;
   settings->nicematch = 128;
   settings->lazymatching = 1;
+  settings->maxchain = 0;
 
   settings->custom_zlib = 0;
   settings->custom_deflate = 0;
   settings->custom_context = 0;
 }
 
-const LodePNGCompressSettings lodepng_default_compress_settings = {2, 1, DEFAULT_WINDOWSIZE, 3, 128, 1, 0, 0, 0};
+const LodePNGCompressSettings lodepng_default_compress_settings = {2, 1, DEFAULT_WINDOWSIZE, 3, 128, 1, 0, 0, 0, 0};
+
+void lodepng_compress_settings_level(LodePNGCompressSettings* settings, LodePNGCompressLevel level)
+{
+  settings->btype = 2;
+  settings->use_lz77 = 1;
+  settings->minmatch = 3;
+  switch(level)
+  {
+    case LCL_FAST:
+      /*take the first good match, filtered scanlines are mostly short repeats*/
+      settings->windowsize = 4096;
+      settings->nicematch = 32;
+      settings->lazymatching = 0;
+      settings->maxchain = 8;
+      break;
+    case LCL_MAX:
+      settings->windowsize = 32768;
+      settings->nicematch = 258;
+      settings->lazymatching = 1;
+      settings->maxchain = 4096;
+      break;
+    default:
+      settings->windowsize = DEFAULT_WINDOWSIZE;
+      settings->nicematch = 128;
+      settings->lazymatching = 1;
+      settings->maxchain = 0;
+      break;
+  }
+}
 
 
 #endif /*LODEPNG_COMPILE_ENCODER*/
@@ -2287,53 +2881,406 @@ const LodePNGDecompressSettings lodepng_default_decompress_settings = {0, 0, 0,
 /* / CRC32                                                                  / */
 /* ////////////////////////////////////////////////////////////////////////// */
 
-/* CRC polynomial: 0xedb88320 */
-static unsigned lodepng_crc32_table[256] = {
-           0u, 1996959894u, 3993919788u, 2567524794u,  124634137u, 1886057615u, 3915621685u, 2657392035u,
-   249268274u, 2044508324u, 3772115230u, 2547177864u,  162941995u, 2125561021u, 3887607047u, 2428444049u,
-   498536548u, 1789927666u, 4089016648u, 2227061214u,  450548861u, 1843258603u, 4107580753u, 2211677639u,
-   325883990u, 1684777152u, 4251122042u, 2321926636u,  335633487u, 1661365465u, 4195302755u, 2366115317u,
-   997073096u, 1281953886u, 3579855332u, 2724688242u, 1006888145u, 1258607687u, 3524101629u, 2768942443u,
-   901097722u, 1119000684u, 3686517206u, 2898065728u,  853044451u, 1172266101u, 3705015759u, 2882616665u,
-   651767980u, 1373503546u, 3369554304u, 3218104598u,  565507253u, 1454621731u, 3485111705u, 3099436303u,
-   671266974u, 1594198024u, 3322730930u, 2970347812u,  795835527u, 1483230225u, 3244367275u, 3060149565u,
-  1994146192u,   31158534u, 2563907772u, 4023717930u, 1907459465u,  112637215u, 2680153253u, 3904427059u,
-  2013776290u,  251722036u, 2517215374u, 3775830040u, 2137656763u,  141376813u, 2439277719u, 3865271297u,
-  1802195444u,  476864866u, 2238001368u, 4066508878u, 1812370925u,  453092731u, 2181625025u, 4111451223u,
-  1706088902u,  314042704u, 2344532202u, 4240017532u, 1658658271u,  366619977u, 2362670323u, 4224994405u,
-  1303535960u,  984961486u, 2747007092u, 3569037538u, 1256170817u, 1037604311u, 2765210733u, 3554079995u,
-  1131014506u,  879679996u, 2909243462u, 3663771856u, 1141124467u,  855842277u, 2852801631u, 3708648649u,
-  1342533948u,  654459306u, 3188396048u, 3373015174u, 1466479909u,  544179635u, 3110523913u, 3462522015u,
-  1591671054u,  702138776u, 2966460450u, 3352799412u, 1504918807u,  783551873u, 3082640443u, 3233442989u,
-  3988292384u, 2596254646u,   62317068u, 1957810842u, 3939845945u, 2647816111u,   81470997u, 1943803523u,
-  3814918930u, 2489596804u,  225274430u, 2053790376u, 3826175755u, 2466906013u,  167816743u, 2097651377u,
-  4027552580u, 2265490386u,  503444072u, 1762050814u, 4150417245u, 2154129355u,  426522225u, 1852507879u,
-  4275313526u, 2312317920u,  282753626u, 1742555852u, 4189708143u, 2394877945u,  397917763u, 1622183637u,
-  3604390888u, 2714866558u,  953729732u, 1340076626u, 3518719985u, 2797360999u, 1068828381u, 1219638859u,
-  3624741850u, 2936675148u,  906185462u, 1090812512u, 3747672003u, 2825379669u,  829329135u, 1181335161u,
-  3412177804u, 3160834842u,  628085408u, 1382605366u, 3423369109u, 3138078467u,  570562233u, 1426400815u,
-  3317316542u, 2998733608u,  733239954u, 1555261956u, 3268935591u, 3050360625u,  752459403u, 1541320221u,
-  2607071920u, 3965973030u, 1969922972u,   40735498u, 2617837225u, 3943577151u, 1913087877u,   83908371u,
-  2512341634u, 3803740692u, 2075208622u,  213261112u, 2463272603u, 3855990285u, 2094854071u,  198958881u,
-  2262029012u, 4057260610u, 1759359992u,  534414190u, 2176718541u, 4139329115u, 1873836001u,  414664567u,
-  2282248934u, 4279200368u, 1711684554u,  285281116u, 2405801727u, 4167216745u, 1634467795u,  376229701u,
-  2685067896u, 3608007406u, 1308918612u,  956543938u, 2808555105u, 3495958263u, 1231636301u, 1047427035u,
-  2932959818u, 3654703836u, 1088359270u,  936918000u, 2847714899u, 3736837829u, 1202900863u,  817233897u,
-  3183342108u, 3401237130u, 1404277552u,  615818150u, 3134207493u, 3453421203u, 1423857449u,  601450431u,
-  3009837614u, 3294710456u, 1567103746u,  711928724u, 3020668471u, 3272380065u, 1510334235u,  755167117u
+/*
+CRC polynomial: 0xedb88320. Table k gives the CRC of a byte followed by k zero bytes, so
+that 8 bytes can be processed at once with independent lookups (slicing-by-8).
+*/
+static const unsigned lodepng_crc32_table[8][256] = {
+  {
+             0u, 1996959894u, 3993919788u, 2567524794u,  124634137u, 1886057615u, 3915621685u, 2657392035u,
+     249268274u, 2044508324u, 3772115230u, 2547177864u,  162941995u, 2125561021u, 3887607047u, 2428444049u,
+     498536548u, 1789927666u, 4089016648u, 2227061214u,  450548861u, 1843258603u, 4107580753u, 2211677639u,
+     325883990u, 1684777152u, 4251122042u, 2321926636u,  335633487u, 1661365465u, 4195302755u, 2366115317u,
+     997073096u, 1281953886u, 3579855332u, 2724688242u, 1006888145u, 1258607687u, 3524101629u, 2768942443u,
+     901097722u, 1119000684u, 3686517206u, 2898065728u,  853044451u, 1172266101u, 3705015759u, 2882616665u,
+     651767980u, 1373503546u, 3369554304u, 3218104598u,  565507253u, 1454621731u, 3485111705u, 3099436303u,
+     671266974u, 1594198024u, 3322730930u, 2970347812u,  795835527u, 1483230225u, 3244367275u, 3060149565u,
+    1994146192u,   31158534u, 2563907772u, 4023717930u, 1907459465u,  112637215u, 2680153253u, 3904427059u,
+    2013776290u,  251722036u, 2517215374u, 3775830040u, 2137656763u,  141376813u, 2439277719u, 3865271297u,
+    1802195444u,  476864866u, 2238001368u, 4066508878u, 1812370925u,  453092731u, 2181625025u, 4111451223u,
+    1706088902u,  314042704u, 2344532202u, 4240017532u, 1658658271u,  366619977u, 2362670323u, 4224994405u,
+    1303535960u,  984961486u, 2747007092u, 3569037538u, 1256170817u, 1037604311u, 2765210733u, 3554079995u,
+    1131014506u,  879679996u, 2909243462u, 3663771856u, 1141124467u,  855842277u, 2852801631u, 3708648649u,
+    1342533948u,  654459306u, 3188396048u, 3373015174u, 1466479909u,  544179635u, 3110523913u, 3462522015u,
+    1591671054u,  702138776u, 2966460450u, 3352799412u, 1504918807u,  783551873u, 3082640443u, 3233442989u,
+    3988292384u, 2596254646u,   62317068u, 1957810842u, 3939845945u, 2647816111u,   81470997u, 1943803523u,
+    3814918930u, 2489596804u,  225274430u, 2053790376u, 3826175755u, 2466906013u,  167816743u, 2097651377u,
+    4027552580u, 2265490386u,  503444072u, 1762050814u, 4150417245u, 2154129355u,  426522225u, 1852507879u,
+    4275313526u, 2312317920u,  282753626u, 1742555852u, 4189708143u, 2394877945u,  397917763u, 1622183637u,
+    3604390888u, 2714866558u,  953729732u, 1340076626u, 3518719985u, 2797360999u, 1068828381u, 1219638859u,
+    3624741850u, 2936675148u,  906185462u, 1090812512u, 3747672003u, 2825379669u,  829329135u, 1181335161u,
+    3412177804u, 3160834842u,  628085408u, 1382605366u, 3423369109u, 3138078467u,  570562233u, 1426400815u,
+    3317316542u, 2998733608u,  733239954u, 1555261956u, 3268935591u, 3050360625u,  752459403u, 1541320221u,
+    2607071920u, 3965973030u, 1969922972u,   40735498u, 2617837225u, 3943577151u, 1913087877u,   83908371u,
+    2512341634u, 3803740692u, 2075208622u,  213261112u, 2463272603u, 3855990285u, 2094854071u,  198958881u,
+    2262029012u, 4057260610u, 1759359992u,  534414190u, 2176718541u, 4139329115u, 1873836001u,  414664567u,
+    2282248934u, 4279200368u, 1711684554u,  285281116u, 2405801727u, 4167216745u, 1634467795u,  376229701u,
+    2685067896u, 3608007406u, 1308918612u,  956543938u, 2808555105u, 3495958263u, 1231636301u, 1047427035u,
+    2932959818u, 3654703836u, 1088359270u,  936918000u, 2847714899u, 3736837829u, 1202900863u,  817233897u,
+    3183342108u, 3401237130u, 1404277552u,  615818150u, 3134207493u, 3453421203u, 1423857449u,  601450431u,
+    3009837614u, 3294710456u, 1567103746u,  711928724u, 3020668471u, 3272380065u, 1510334235u,  755167117u
+  },
+  {
+             0u,  421212481u,  842424962u,  724390851u, 1684849924u, 2105013317u, 1448781702u, 1329698503u,
+    3369699848u, 3519200073u, 4210026634u, 3824474571u, 2897563404u, 3048111693u, 2659397006u, 2274893007u,
+    1254232657u, 1406739216u, 2029285587u, 1643069842u,  783210325u,  934667796u,  479770071u,   92505238u,
+    2182846553u, 2600511768u, 2955803355u, 2838940570u, 3866582365u, 4285295644u, 3561045983u, 3445231262u,
+    2508465314u, 2359236067u, 2813478432u, 3198777185u, 4058571174u, 3908292839u, 3286139684u, 3670389349u,
+    1566420650u, 1145479147u, 1869335592u, 1987116393u,  959540142u,  539646703u,  185010476u,  303839341u,
+    3745920755u, 3327985586u, 3983561841u, 4100678960u, 3140154359u, 2721170102u, 2300350837u, 2416418868u,
+     396344571u,  243568058u,  631889529u, 1018359608u, 1945336319u, 1793607870u, 1103436669u, 1490954812u,
+    4034481925u, 3915546180u, 3259968903u, 3679722694u, 2484439553u, 2366552896u, 2787371139u, 3208174018u,
+     950060301u,  565965900u,  177645455u,  328046286u, 1556873225u, 1171730760u, 1861902987u, 2011255754u,
+    3132841300u, 2745199637u, 2290958294u, 2442530455u, 3738671184u, 3352078609u, 3974232786u, 4126854035u,
+    1919080284u, 1803150877u, 1079293406u, 1498383519u,  370020952u,  253043481u,  607678682u, 1025720731u,
+    1711106983u, 2095471334u, 1472923941u, 1322268772u,   26324643u,  411738082u,  866634785u,  717028704u,
+    2904875439u, 3024081134u, 2668790573u, 2248782444u, 3376948395u, 3495106026u, 4219356713u, 3798300520u,
+     792689142u,  908347575u,  487136116u,   68299317u, 1263779058u, 1380486579u, 2036719216u, 1618931505u,
+    3890672638u, 4278043327u, 3587215740u, 3435896893u, 2206873338u, 2593195963u, 2981909624u, 2829542713u,
+     998479947u,  580430090u,  162921161u,  279890824u, 1609522511u, 1190423566u, 1842954189u, 1958874764u,
+    4082766403u, 3930137346u, 3245109441u, 3631694208u, 2536953671u, 2385372678u, 2768287173u, 3155920004u,
+    1900120602u, 1750776667u, 1131931800u, 1517083097u,  355290910u,  204897887u,  656092572u, 1040194781u,
+    3113746450u, 2692952403u, 2343461520u, 2461357009u, 3723805974u, 3304059991u, 4022511508u, 4141455061u,
+    2919742697u, 3072101800u, 2620513899u, 2234183466u, 3396041197u, 3547351212u, 4166851439u, 3779471918u,
+    1725839073u, 2143618976u, 1424512099u, 1307796770u,   45282277u,  464110244u,  813994343u,  698327078u,
+    3838160568u, 4259225593u, 3606301754u, 3488152955u, 2158586812u, 2578602749u, 2996767038u, 2877569151u,
+     740041904u,  889656817u,  506086962u,  120682355u, 1215357364u, 1366020341u, 2051441462u, 1667084919u,
+    3422213966u, 3538019855u, 4190942668u, 3772220557u, 2945847882u, 3062702859u, 2644537544u, 2226864521u,
+      52649286u,  439905287u,  823476164u,  672009861u, 1733269570u, 2119477507u, 1434057408u, 1281543041u,
+    2167981343u, 2552493150u, 3004082077u, 2853541596u, 3847487515u, 4233048410u, 3613549209u, 3464057816u,
+    1239502615u, 1358593622u, 2077699477u, 1657543892u,  764250643u,  882293586u,  532408465u,  111204816u,
+    1585378284u, 1197851309u, 1816695150u, 1968414767u,  974272232u,  587794345u,  136598634u,  289367339u,
+    2527558116u, 2411481253u, 2760973158u, 3179948583u, 4073438432u, 3956313505u, 3237863010u, 3655790371u,
+     347922877u,  229101820u,  646611775u, 1066513022u, 1892689081u, 1774917112u, 1122387515u, 1543337850u,
+    3697634229u, 3313392372u, 3998419255u, 4148705398u, 3087642289u, 2702352368u, 2319436851u, 2468674930u
+  },
+  {
+             0u,   29518391u,   59036782u,   38190681u,  118073564u,  114017003u,   76381362u,   89069189u,
+     236147128u,  265370511u,  228034006u,  206958561u,  152762724u,  148411219u,  178138378u,  190596925u,
+     472294256u,  501532999u,  530741022u,  509615401u,  456068012u,  451764635u,  413917122u,  426358261u,
+     305525448u,  334993663u,  296822438u,  275991697u,  356276756u,  352202787u,  381193850u,  393929805u,
+     944588512u,  965684439u, 1003065998u,  973863097u, 1061482044u, 1049003019u, 1019230802u, 1023561829u,
+     912136024u,  933002607u,  903529270u,  874031361u,  827834244u,  815125939u,  852716522u,  856752605u,
+     611050896u,  631869351u,  669987326u,  640506825u,  593644876u,  580921211u,  551983394u,  556069653u,
+     712553512u,  733666847u,  704405574u,  675154545u,  762387700u,  749958851u,  787859610u,  792175277u,
+    1889177024u, 1901651959u, 1931368878u, 1927033753u, 2006131996u, 1985040171u, 1947726194u, 1976933189u,
+    2122964088u, 2135668303u, 2098006038u, 2093965857u, 2038461604u, 2017599123u, 2047123658u, 2076625661u,
+    1824272048u, 1836991623u, 1866005214u, 1861914857u, 1807058540u, 1786244187u, 1748062722u, 1777547317u,
+    1655668488u, 1668093247u, 1630251878u, 1625932113u, 1705433044u, 1684323811u, 1713505210u, 1742760333u,
+    1222101792u, 1226154263u, 1263738702u, 1251046777u, 1339974652u, 1310460363u, 1281013650u, 1301863845u,
+    1187289752u, 1191637167u, 1161842422u, 1149379777u, 1103966788u, 1074747507u, 1112139306u, 1133218845u,
+    1425107024u, 1429406311u, 1467333694u, 1454888457u, 1408811148u, 1379576507u, 1350309090u, 1371438805u,
+    1524775400u, 1528845279u, 1499917702u, 1487177649u, 1575719220u, 1546255107u, 1584350554u, 1605185389u,
+    3778354048u, 3774312887u, 3803303918u, 3816007129u, 3862737756u, 3892238699u, 3854067506u, 3833203973u,
+    4012263992u, 4007927823u, 3970080342u, 3982554209u, 3895452388u, 3924658387u, 3953866378u, 3932773565u,
+    4245928176u, 4241609415u, 4271336606u, 4283762345u, 4196012076u, 4225268251u, 4187931714u, 4166823541u,
+    4076923208u, 4072833919u, 4035198246u, 4047918865u, 4094247316u, 4123732899u, 4153251322u, 4132437965u,
+    3648544096u, 3636082519u, 3673983246u, 3678331705u, 3732010428u, 3753090955u, 3723829714u, 3694611429u,
+    3614117080u, 3601426159u, 3572488374u, 3576541825u, 3496125444u, 3516976691u, 3555094634u, 3525581405u,
+    3311336976u, 3298595879u, 3336186494u, 3340255305u, 3260503756u, 3281337595u, 3251864226u, 3222399125u,
+    3410866088u, 3398419871u, 3368647622u, 3372945905u, 3427010420u, 3448139075u, 3485520666u, 3456284973u,
+    2444203584u, 2423127159u, 2452308526u, 2481530905u, 2527477404u, 2539934891u, 2502093554u, 2497740997u,
+    2679949304u, 2659102159u, 2620920726u, 2650438049u, 2562027300u, 2574714131u, 2603727690u, 2599670141u,
+    2374579504u, 2353749767u, 2383274334u, 2412743529u, 2323684844u, 2336421851u, 2298759554u, 2294686645u,
+    2207933576u, 2186809023u, 2149495014u, 2178734801u, 2224278612u, 2236720739u, 2266437690u, 2262135309u,
+    2850214048u, 2820717207u, 2858812622u, 2879680249u, 2934667388u, 2938704459u, 2909776914u, 2897069605u,
+    2817622296u, 2788420399u, 2759153014u, 2780249921u, 2700618180u, 2704950259u, 2742877610u, 2730399645u,
+    3049550800u, 3020298727u, 3057690558u, 3078802825u, 2999835404u, 3004150075u, 2974355298u, 2961925461u,
+    3151438440u, 3121956959u, 3092510214u, 3113327665u, 3168701108u, 3172786307u, 3210370778u, 3197646061u
+  },
+  {
+             0u, 3099354981u, 2852767883u,  313896942u, 2405603159u,  937357362u,  627793884u, 2648127673u,
+    3316918511u, 2097696650u, 1874714724u, 3607201537u, 1255587768u, 4067088605u, 3772741427u, 1482887254u,
+    1343838111u, 3903140090u, 4195393300u, 1118632049u, 3749429448u, 1741137837u, 1970407491u, 3452858150u,
+    2511175536u,  756094997u, 1067759611u, 2266550430u,  449832999u, 2725482306u, 2965774508u,  142231497u,
+    2687676222u,  412010587u,  171665333u, 2995192016u,  793786473u, 2548850444u, 2237264098u, 1038456711u,
+    1703315409u, 3711623348u, 3482275674u, 1999841343u, 3940814982u, 1381529571u, 1089329165u, 4166106984u,
+    4029413537u, 1217896388u, 1512189994u, 3802027855u, 2135519222u, 3354724499u, 3577784189u, 1845280792u,
+     899665998u, 2367928107u, 2677414085u,  657096608u, 3137160985u,   37822588u,  284462994u, 2823350519u,
+    2601801789u,  598228824u,  824021174u, 2309093331u,  343330666u, 2898962447u, 3195996129u,  113467524u,
+    1587572946u, 3860600759u, 4104763481u, 1276501820u, 3519211397u, 1769898208u, 2076913422u, 3279374443u,
+    3406630818u, 1941006535u, 1627703081u, 3652755532u, 1148164341u, 4241751952u, 3999682686u, 1457141531u,
+     247015245u, 3053797416u, 2763059142u,  470583459u, 2178658330u,  963106687u,  735213713u, 2473467892u,
+     992409347u, 2207944806u, 2435792776u,  697522413u, 3024379988u,  217581361u,  508405983u, 2800865210u,
+    4271038444u, 1177467017u, 1419450215u, 3962007554u, 1911572667u, 3377213406u, 3690561584u, 1665525589u,
+    1799331996u, 3548628985u, 3241568279u, 2039091058u, 3831314379u, 1558270126u, 1314193216u, 4142438437u,
+    2928380019u,  372764438u,   75645176u, 3158189981u,  568925988u, 2572515393u, 2346768303u,  861712586u,
+    3982079547u, 1441124702u, 1196457648u, 4293663189u, 1648042348u, 3666298377u, 3358779879u, 1888390786u,
+     686661332u, 2421291441u, 2196002399u,  978858298u, 2811169155u,  523464422u,  226935048u, 3040519789u,
+    3175145892u,  100435649u,  390670639u, 2952089162u,  841119475u, 2325614998u, 2553003640u,  546822429u,
+    2029308235u, 3225988654u, 3539796416u, 1782671013u, 4153826844u, 1328167289u, 1570739863u, 3844338162u,
+    1298864389u, 4124540512u, 3882013070u, 1608431339u, 3255406162u, 2058742071u, 1744848601u, 3501990332u,
+    2296328682u,  811816591u,  584513889u, 2590678532u,  129869501u, 3204563416u, 2914283062u,  352848211u,
+     494030490u, 2781751807u, 3078325777u,  264757620u, 2450577869u,  715964072u,  941166918u, 2158327331u,
+    3636881013u, 1618608400u, 1926213374u, 3396585883u, 1470427426u, 4011365959u, 4255988137u, 1158766284u,
+    1984818694u, 3471935843u, 3695453837u, 1693991400u, 4180638033u, 1100160564u, 1395044826u, 3952793279u,
+    3019491049u,  189112716u,  435162722u, 2706139399u, 1016811966u, 2217162459u, 2526189877u,  774831696u,
+     643086745u, 2666061564u, 2354934034u,  887166583u, 2838900430u,  294275499u,   54519365u, 3145957664u,
+    3823145334u, 1532818963u, 1240029693u, 4048895640u, 1820460577u, 3560857924u, 3331051178u, 2117577167u,
+    3598663992u, 1858283101u, 2088143283u, 3301633750u, 1495127663u, 3785470218u, 4078182116u, 1269332353u,
+     332098007u, 2876706482u, 3116540252u,   25085497u, 2628386432u,  605395429u,  916469259u, 2384220526u,
+    2254837415u, 1054503362u,  745528876u, 2496903497u,  151290352u, 2981684885u, 2735556987u,  464596510u,
+    1137851976u, 4218313005u, 3923506883u, 1365741990u, 3434129695u, 1946996346u, 1723425172u, 3724871409u
+  },
+  {
+             0u, 1029712304u, 2059424608u, 1201699536u, 4118849216u, 3370159984u, 2403399072u, 2988497936u,
+     812665793u,  219177585u, 1253054625u, 2010132753u, 3320900865u, 4170237105u, 3207642721u, 2186319825u,
+    1625331586u, 1568718386u,  438355170u,  658566482u, 2506109250u, 2818578674u, 4020265506u, 3535817618u,
+    1351670851u, 1844508147u,  709922595u,  389064339u, 2769320579u, 2557498163u, 3754961379u, 3803185235u,
+    3250663172u, 4238411444u, 3137436772u, 2254525908u,  876710340u,  153198708u, 1317132964u, 1944187668u,
+    4054934725u, 3436268917u, 2339452837u, 3054575125u,   70369797u,  961670069u, 2129760613u, 1133623509u,
+    2703341702u, 2621542710u, 3689016294u, 3867263574u, 1419845190u, 1774270454u,  778128678u,  318858390u,
+    2438067015u, 2888948471u, 3952189479u, 3606153623u, 1691440519u, 1504803895u,  504432359u,  594620247u,
+    1492342857u, 1704161785u,  573770537u,  525542041u, 2910060169u, 2417219385u, 3618876905u, 3939730521u,
+    1753420680u, 1440954936u,  306397416u,  790849880u, 2634265928u, 2690882808u, 3888375336u, 3668168600u,
+     940822475u,   91481723u, 1121164459u, 2142483739u, 3448989963u, 4042473659u, 3075684971u, 2318603227u,
+     140739594u,  889433530u, 1923340138u, 1338244826u, 4259521226u, 3229813626u, 2267247018u, 3124975642u,
+    2570221389u, 2756861693u, 3824297005u, 3734113693u, 1823658381u, 1372780605u,  376603373u,  722643805u,
+    2839690380u, 2485261628u, 3548540908u, 4007806556u, 1556257356u, 1638052860u,  637716780u,  459464860u,
+    4191346895u, 3300051327u, 2199040943u, 3195181599u,  206718479u,  825388991u, 1989285231u, 1274166495u,
+    3382881038u, 4106388158u, 3009607790u, 2382549470u, 1008864718u,   21111934u, 1189240494u, 2072147742u,
+    2984685714u, 2357631266u, 3408323570u, 4131834434u, 1147541074u, 2030452706u, 1051084082u,   63335554u,
+    2174155603u, 3170292451u, 4216760371u, 3325460867u, 1947622803u, 1232499747u,  248909555u,  867575619u,
+    3506841360u, 3966111392u, 2881909872u, 2527485376u,  612794832u,  434546784u, 1581699760u, 1663499008u,
+    3782634705u, 3692447073u, 2612412337u, 2799048193u,  351717905u,  697754529u, 1849071985u, 1398190273u,
+    1881644950u, 1296545318u,  182963446u,  931652934u, 2242328918u, 3100053734u, 4284967478u, 3255255942u,
+    1079497815u, 2100821479u,  983009079u,  133672583u, 3050795671u, 2293717799u, 3474399735u, 4067887175u,
+     281479188u,  765927844u, 1778867060u, 1466397380u, 3846680276u, 3626469220u, 2676489652u, 2733102084u,
+     548881365u,  500656741u, 1517752501u, 1729575173u, 3577210133u, 3898068133u, 2952246901u, 2459410373u,
+    3910527195u, 3564487019u, 2480257979u, 2931134987u,  479546907u,  569730987u, 1716854139u, 1530213579u,
+    3647316762u, 3825568426u, 2745561210u, 2663766474u,  753206746u,  293940330u, 1445287610u, 1799716618u,
+    2314567513u, 3029685993u, 4080348217u, 3461678473u, 2088098201u, 1091956777u,  112560889u, 1003856713u,
+    3112514712u, 2229607720u, 3276105720u, 4263857736u, 1275433560u, 1902492648u,  918929720u,  195422344u,
+     685033439u,  364179055u, 1377080511u, 1869921551u, 3713294623u, 3761522863u, 2811507327u, 2599689167u,
+     413436958u,  633644462u, 1650777982u, 1594160846u, 3978570462u, 3494118254u, 2548332990u, 2860797966u,
+    1211387997u, 1968470509u,  854852413u,  261368461u, 3182753437u, 2161434413u, 3346310653u, 4195650637u,
+    2017729436u, 1160000044u,   42223868u, 1071931724u, 2378480988u, 2963576044u, 4144295484u, 3395602316u
+  },
+  {
+             0u, 3411858341u, 1304994059u, 2257875630u, 2609988118u, 1355649459u, 3596215069u,  486879416u,
+    3964895853u,  655315400u, 2711298918u, 1791488195u, 2009251963u, 3164476382u,  973758832u, 4048990933u,
+      64357019u, 3364540734u, 1310630800u, 2235723829u, 2554806413u, 1394316072u, 3582976390u,  517157411u,
+    4018503926u,  618222419u, 2722963965u, 1762783832u, 1947517664u, 3209171269u,  970744811u, 4068520014u,
+     128714038u, 3438335635u, 1248109629u, 2167961496u, 2621261600u, 1466012805u, 3522553387u,  447296910u,
+    3959392091u,  547575038u, 2788632144u, 1835791861u, 1886307661u, 3140622056u, 1034314822u, 4143626211u,
+      75106221u, 3475428360u, 1236444838u, 2196665603u, 2682996155u, 1421317662u, 3525567664u,  427767573u,
+    3895035328u,  594892389u, 2782995659u, 1857943406u, 1941489622u, 3101955187u, 1047553757u, 4113347960u,
+     257428076u, 3288652233u, 1116777319u, 2311878850u, 2496219258u, 1603640287u, 3640781169u,  308099796u,
+    3809183745u,  676813732u, 2932025610u, 1704983215u, 2023410199u, 3016104370u,  894593820u, 4262377657u,
+     210634999u, 3352484690u, 1095150076u, 2316991065u, 2535410401u, 1547934020u, 3671583722u,  294336591u,
+    3772615322u,  729897279u, 2903845777u, 1716123700u, 2068629644u, 2953845545u,  914647431u, 4258839074u,
+     150212442u, 3282623743u, 1161604689u, 2388688372u, 2472889676u, 1480171241u, 3735940167u,  368132066u,
+    3836185911u,  805002898u, 2842635324u, 1647574937u, 2134298401u, 3026852996u,  855535146u, 4188192143u,
+     186781121u, 3229539940u, 1189784778u, 2377547631u, 2427670487u, 1542429810u, 3715886812u,  371670393u,
+    3882979244u,  741170185u, 2864262823u, 1642462466u, 2095107514u, 3082559007u,  824732849u, 4201955092u,
+     514856152u, 3589064573u, 1400419795u, 2552522358u, 2233554638u, 1316849003u, 3370776517u,   62202976u,
+    4075001525u,  968836368u, 3207280574u, 1954014235u, 1769133219u, 2720925446u,  616199592u, 4024870413u,
+     493229635u, 3594175974u, 1353627464u, 2616354029u, 2264355925u, 1303087088u, 3409966430u,    6498043u,
+    4046820398u,  979978123u, 3170710821u, 2007099008u, 1789187640u, 2717386141u,  661419827u, 3962610838u,
+     421269998u, 3527459403u, 1423225061u, 2676515648u, 2190300152u, 1238466653u, 3477467891u,   68755798u,
+    4115633027u, 1041448998u, 3095868040u, 1943789869u, 1860096405u, 2776760880u,  588673182u, 3897205563u,
+     449450869u, 3516317904u, 1459794558u, 2623431131u, 2170245475u, 1242006214u, 3432247400u,  131015629u,
+    4137259288u, 1036337853u, 3142660115u, 1879958454u, 1829294862u, 2790523051u,  549483013u, 3952910752u,
+     300424884u, 3669282065u, 1545650111u, 2541513754u, 2323209378u, 1092980487u, 3350330793u,  216870412u,
+    4256931033u,  921128828u, 2960342482u, 2066738807u, 1714085583u, 2910195050u,  736264132u, 3770592353u,
+     306060335u, 3647131530u, 1610005796u, 2494197377u, 2309971513u, 1123257756u, 3295149874u,  255536279u,
+    4268596802u,  892423655u, 3013951305u, 2029645036u, 1711070292u, 2929725425u,  674528607u, 3815288570u,
+     373562242u, 3709388839u, 1535949449u, 2429577516u, 2379569556u, 1183418929u, 3223189663u,  188820282u,
+    4195850735u,  827017802u, 3084859620u, 2089020225u, 1636228089u, 2866415708u,  743340786u, 3876759895u,
+     361896217u, 3738094268u, 1482340370u, 2466671543u, 2382584591u, 1163888810u, 3284924932u,  144124321u,
+    4190215028u,  849168593u, 3020503679u, 2136336858u, 1649465698u, 2836138695u,  798521449u, 3838094284u
+  },
+  {
+             0u, 2792819636u, 2543784233u,  837294749u, 4098827283u, 1379413927u, 1674589498u, 3316072078u,
+     871321191u, 2509784531u, 2758827854u,   34034938u, 3349178996u, 1641505216u, 1346337629u, 4131942633u,
+    1742642382u, 3249117050u, 4030828007u, 1446413907u, 2475800797u,  904311657u,   68069876u, 2725880384u,
+    1412551337u, 4064729373u, 3283010432u, 1708771380u, 2692675258u,  101317902u,  937551763u, 2442587175u,
+    3485284764u, 1774858792u, 1478633653u, 4266992385u, 1005723023u, 2642744891u, 2892827814u,  169477906u,
+    4233263099u, 1512406095u, 1808623314u, 3451546982u,  136139752u, 2926205020u, 2676114113u,  972376437u,
+    2825102674u,  236236518u, 1073525883u, 2576072655u, 1546420545u, 4200303349u, 3417542760u, 1841601500u,
+    2609703733u, 1039917185u,  202635804u, 2858742184u, 1875103526u, 3384067218u, 4166835727u, 1579931067u,
+    1141601657u, 3799809741u, 3549717584u, 1977839588u, 2957267306u,  372464350u,  668680259u, 2175552503u,
+    2011446046u, 3516084394u, 3766168119u, 1175200131u, 2209029901u,  635180217u,  338955812u, 2990736784u,
+     601221559u, 2242044419u, 3024812190u,  306049834u, 3617246628u, 1911408144u, 1074125965u, 3866285881u,
+     272279504u, 3058543716u, 2275784441u,  567459149u, 3832906691u, 1107462263u, 1944752874u, 3583875422u,
+    2343980261u,  767641425u,  472473036u, 3126744696u, 2147051766u, 3649987394u, 3899029983u, 1309766251u,
+    3092841090u,  506333494u,  801510315u, 2310084639u, 1276520081u, 3932237093u, 3683203000u, 2113813516u,
+    3966292011u, 1243601823u, 2079834370u, 3716205238u,  405271608u, 3192979340u, 2411259153u,  701492901u,
+    3750207052u, 2045810168u, 1209569125u, 4000285905u,  734575199u, 2378150379u, 3159862134u,  438345922u,
+    2283203314u,  778166598u,  529136603u, 3120492655u, 2086260449u, 3660498261u, 3955679176u, 1303499900u,
+    3153699989u,  495890209u,  744928700u, 2316418568u, 1337360518u, 3921775410u, 3626602927u, 2120129051u,
+    4022892092u, 1237286280u, 2018993941u, 3726666913u,  461853231u, 3186645403u, 2350400262u,  711936178u,
+    3693557851u, 2052076527u, 1270360434u, 3989775046u,  677911624u, 2384402428u, 3220639073u,  427820757u,
+    1202443118u, 3789347034u, 3493118535u, 1984154099u, 3018127229u,  362020041u,  612099668u, 2181885408u,
+    1950653705u, 3526596285u, 3822816288u, 1168934804u, 2148251930u,  645706414u,  395618355u, 2984485767u,
+     544559008u, 2248295444u, 3085590153u,  295523645u, 3560598451u, 1917673479u, 1134918298u, 3855773998u,
+     328860103u, 3052210803u, 2214924526u,  577903450u, 3889505748u, 1101147744u, 1883911421u, 3594338121u,
+    3424493451u, 1785369663u, 1535282850u, 4260726038u,  944946072u, 2653270060u, 2949491377u,  163225861u,
+    4294103532u, 1501944408u, 1752023237u, 3457862513u,  196998655u, 2915761739u, 2619532502u,  978710370u,
+    2881684293u,  229902577u, 1012666988u, 2586515928u, 1603020630u, 4193987810u, 3356702335u, 1852063179u,
+    2553040162u, 1046169238u,  263412747u, 2848217023u, 1818454321u, 3390333573u, 4227627032u, 1569420204u,
+      60859927u, 2782375331u, 2487203646u,  843627658u, 4159668740u, 1368951216u, 1617990445u, 3322386585u,
+     810543216u, 2520310724u, 2815490393u,   27783917u, 3288386659u, 1652017111u, 1402985802u, 4125677310u,
+    1685994201u, 3255382381u, 4091620336u, 1435902020u, 2419138250u,  910562686u,  128847843u, 2715354199u,
+    1469150398u, 4058414858u, 3222168983u, 1719234083u, 2749255853u,   94984985u,  876691844u, 2453031472u
+  },
+  {
+             0u, 3433693342u, 1109723005u, 2391738339u, 2219446010u, 1222643300u, 3329165703u,  180685081u,
+    3555007413u,  525277995u, 2445286600u, 1567235158u, 1471092047u, 2600801745u,  361370162u, 3642757804u,
+    2092642603u, 2953916853u, 1050555990u, 4063508168u, 4176560081u,  878395215u, 3134470316u, 1987983410u,
+    2942184094u, 1676945920u, 3984272867u,  567356797u,  722740324u, 3887998202u, 1764827929u, 2778407815u,
+    4185285206u,  903635656u, 3142804779u, 2012833205u, 2101111980u, 2979425330u, 1058630609u, 4088621903u,
+     714308067u, 3862526333u, 1756790430u, 2753330688u, 2933487385u, 1651734407u, 3975966820u,  542535930u,
+    2244825981u, 1231508451u, 3353891840u,  188896414u,   25648519u, 3442302233u, 1134713594u, 2399689316u,
+    1445480648u, 2592229462u,  336416693u, 3634843435u, 3529655858u,  516441772u, 2420588879u, 1559052753u,
+     698204909u, 3845636723u, 1807271312u, 2803025166u, 2916600855u, 1635634313u, 4025666410u,  593021940u,
+    4202223960u,  919787974u, 3093159461u, 1962401467u, 2117261218u, 2996361020u, 1008193759u, 4038971457u,
+    1428616134u, 2576151384u,  386135227u, 3685348389u, 3513580860u,  499580322u, 2471098945u, 1608776415u,
+    2260985971u, 1248454893u, 3303468814u,  139259792u,   42591881u, 3458459159u, 1085071860u, 2349261162u,
+    3505103035u,  474062885u, 2463016902u, 1583654744u, 1419882049u, 2550902495u,  377792828u, 3660491170u,
+      51297038u, 3483679632u, 1093385331u, 2374089965u, 2269427188u, 1273935210u, 3311514249u,  164344343u,
+    2890961296u, 1627033870u, 4000683757u,  585078387u,  672833386u, 3836780532u, 1782552599u, 2794821769u,
+    2142603813u, 3005188795u, 1032883544u, 4047146438u, 4227826911u,  928351297u, 3118105506u, 1970307900u,
+    1396409818u, 2677114180u,  287212199u, 3719594553u, 3614542624u,  467372990u, 2505346141u, 1509854403u,
+    2162073199u, 1282711281u, 3271268626u,  240228748u,   76845205u, 3359543307u, 1186043880u, 2317064054u,
+     796964081u, 3811226735u, 1839575948u, 2702160658u, 2882189835u, 1734392469u, 3924802934u,  625327592u,
+    4234522436u,  818917338u, 3191908409u, 1927981223u, 2016387518u, 3028656416u,  973776579u, 4137723485u,
+    2857232268u, 1726474002u, 3899187441u,  616751215u,  772270454u, 3803048424u, 1814228491u, 2693328533u,
+    2041117753u, 3036871847u,  999160644u, 4146592730u, 4259508931u,  826864221u, 3217552830u, 1936586016u,
+    3606501031u,  442291769u, 2496909786u, 1484378436u, 1388107869u, 2652297411u,  278519584u, 3694387134u,
+      85183762u, 3384397196u, 1194773103u, 2342308593u, 2170143720u, 1307820918u, 3279733909u,  265733131u,
+    2057717559u, 3054258089u,  948125770u, 4096344276u, 4276898253u,  843467091u, 3167309488u, 1885556270u,
+    2839764098u, 1709792284u, 3949353983u,  667704161u,  755585656u, 3785577190u, 1865176325u, 2743489947u,
+     102594076u, 3401021058u, 1144549729u, 2291298815u, 2186770662u, 1325234296u, 3228729243u,  215514885u,
+    3589828009u,  424832311u, 2547870420u, 1534552650u, 1370645331u, 2635621325u,  328688686u, 3745342640u,
+    2211456353u, 1333405183u, 3254067740u,  224338562u,  127544219u, 3408931589u, 1170156774u, 2299866232u,
+    1345666772u, 2627681866u,  303053225u, 3736746295u, 3565105198u,  416624816u, 2522494803u, 1525692365u,
+    4285207626u,  868291796u, 3176010551u, 1910772649u, 2065767088u, 3079346734u,  956571085u, 4121828691u,
+     747507711u, 3760459617u, 1856702594u, 2717976604u, 2831417605u, 1684930971u, 3940615800u,  642451174u
+  }
 };
 
+/*updates the unfinalized CRC c with the bytes buf[0..len-1]*/
+static unsigned lodepng_crc32_slice8(unsigned c, const unsigned char* buf, size_t len)
+{
+  while(len >= 8)
+  {
+    c ^= buf[0] | ((unsigned)buf[1] << 8) | ((unsigned)buf[2] << 16) | ((unsigned)buf[3] << 24);
+    c = lodepng_crc32_table[7][c & 0xff] ^ lodepng_crc32_table[6][(c >> 8) & 0xff]
+      ^ lodepng_crc32_table[5][(c >> 16) & 0xff] ^ lodepng_crc32_table[4][(c >> 24) & 0xff]
+      ^ lodepng_crc32_table[3][buf[4]] ^ lodepng_crc32_table[2][buf[5]]
+      ^ lodepng_crc32_table[1][buf[6]] ^ lodepng_crc32_table[0][buf[7]];
+    buf += 8;
+    len -= 8;
+  }
+  while(len > 0)
+  {
+    c = lodepng_crc32_table[0][(c ^ *buf) & 0xff] ^ (c >> 8);
+    buf++;
+    len--;
+  }
+  return c;
+}
+
+#ifdef LODEPNG_X86_DISPATCH
+/*
+Folds 64 bytes at a time with carry-less multiplication, then reduces to 32 bits with
+Barrett reduction, see Intel's "Fast CRC Computation for Generic Polynomials Using
+PCLMULQDQ Instruction". len must be at least 64 and a multiple of 16.
+*/
+LODEPNG_TARGET("pclmul,sse4.1")
+static unsigned lodepng_crc32_pclmul(unsigned c, const unsigned char* buf, size_t len)
+{
+  /*the bit-reflected fold constants x^(4*128+32), x^(4*128-32), x^(128+32), x^(128-32) and x^64 mod P*/
+  /*given as 32-bit halves, C90 has no 64-bit constants*/
+  const __m128i k1k2 = _mm_set_epi32(0x1, (int)0xc6e41596u, 0x1, 0x54442bd4);
+  const __m128i k3k4 = _mm_set_epi32(0x0, (int)0xccaa009eu, 0x1, 0x751997d0);
+  const __m128i k5 = _mm_set_epi32(0, 0, 0x1, 0x63cd6124);
+  /*P and mu = floor(x^64 / P), bit-reflected*/
+  const __m128i poly = _mm_set_epi32(0x1, (int)0xf7011641u, 0x1, (int)0xdb710641u);
+  const __m128i mask32 = _mm_setr_epi32(-1, 0, -1, 0);
+  __m128i x0, x1, x2, x3, x4, t1, t2, t3, t4;
+
+  x1 = _mm_loadu_si128((const __m128i*)(buf + 0));
+  x2 = _mm_loadu_si128((const __m128i*)(buf + 16));
+  x3 = _mm_loadu_si128((const __m128i*)(buf + 32));
+  x4 = _mm_loadu_si128((const __m128i*)(buf + 48));
+  x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128((int)c));
+  buf += 64;
+  len -= 64;
+
+  /*fold 4 lanes of 128 bits in parallel*/
+  while(len >= 64)
+  {
+    t1 = _mm_clmulepi64_si128(x1, k1k2, 0x00);
+    t2 = _mm_clmulepi64_si128(x2, k1k2, 0x00);
+    t3 = _mm_clmulepi64_si128(x3, k1k2, 0x00);
+    t4 = _mm_clmulepi64_si128(x4, k1k2, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, k1k2, 0x11);
+    x2 = _mm_clmulepi64_si128(x2, k1k2, 0x11);
+    x3 = _mm_clmulepi64_si128(x3, k1k2, 0x11);
+    x4 = _mm_clmulepi64_si128(x4, k1k2, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, t1), _mm_loadu_si128((const __m128i*)(buf + 0)));
+    x2 = _mm_xor_si128(_mm_xor_si128(x2, t2), _mm_loadu_si128((const __m128i*)(buf + 16)));
+    x3 = _mm_xor_si128(_mm_xor_si128(x3, t3), _mm_loadu_si128((const __m128i*)(buf + 32)));
+    x4 = _mm_xor_si128(_mm_xor_si128(x4, t4), _mm_loadu_si128((const __m128i*)(buf + 48)));
+    buf += 64;
+    len -= 64;
+  }
+
+  /*fold the 4 lanes into one*/
+  t1 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+  x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+  x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), t1);
+  t1 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+  x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+  x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), t1);
+  t1 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+  x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+  x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), t1);
+
+  /*fold the remaining blocks of 16 bytes*/
+  while(len >= 16)
+  {
+    t1 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, _mm_loadu_si128((const __m128i*)buf)), t1);
+    buf += 16;
+    len -= 16;
+  }
+
+  /*fold 128 bits to 64 bits*/
+  x2 = _mm_clmulepi64_si128(x1, k3k4, 0x10);
+  x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), x2);
+  x2 = _mm_srli_si128(x1, 4);
+  x1 = _mm_and_si128(x1, mask32);
+  x1 = _mm_xor_si128(_mm_clmulepi64_si128(x1, k5, 0x00), x2);
+
+  /*Barrett reduction to 32 bits*/
+  x0 = _mm_and_si128(x1, mask32);
+  x0 = _mm_clmulepi64_si128(x0, poly, 0x10);
+  x0 = _mm_and_si128(x0, mask32);
+  x0 = _mm_clmulepi64_si128(x0, poly, 0x00);
+  x1 = _mm_xor_si128(x1, x0);
+  return (unsigned)_mm_extract_epi32(x1, 1);
+}
+#endif /*LODEPNG_X86_DISPATCH*/
+
 /*Return the CRC of the bytes buf[0..len-1].*/
 unsigned lodepng_crc32(const unsigned char* buf, size_t len)
 {
-  unsigned c = 0xffffffffL;
-  size_t n;
-
-  for(n = 0; n < len; n++)
+  unsigned c = 0xffffffffu;
+#ifdef LODEPNG_X86_DISPATCH
+  /*below 64 bytes (most chunks other than IDAT) the setup of the folding doesn't pay off*/
+  if(len >= 64 && lodepng_cpu_has(LODEPNG_CPU_PCLMUL))
   {
-    c = lodepng_crc32_table[(c ^ buf[n]) & 0xff] ^ (c >> 8);
+    size_t n = len & ~(size_t)15;
+    c = lodepng_crc32_pclmul(c, buf, n);
+    buf += n;
+    len -= n;
   }
-  return c ^ 0xffffffffL;
+#endif /*LODEPNG_X86_DISPATCH*/
+  return lodepng_crc32_slice8(c, buf, len) ^ 0xffffffffu;
 }
 
 /* ////////////////////////////////////////////////////////////////////////// */
@@ -2940,6 +3887,7 @@ static void addColorBits(unsigned char* out, size_t index, unsigned bits, unsign
   else out[index * bits / 8] |= in;
 }
 
+#ifdef LODEPNG_COMPILE_ENCODER
 typedef struct ColorTree ColorTree;
 
 /*
@@ -2987,12 +3935,10 @@ static int color_tree_get(ColorTree* tree, unsigned char r, unsigned char g, uns
   return tree ? tree->index : -1;
 }
 
-#ifdef LODEPNG_COMPILE_ENCODER
 static int color_tree_has(ColorTree* tree, unsigned char r, unsigned char g, unsigned char b, unsigned char a)
 {
   return color_tree_get(tree, r, g, b, a) >= 0;
 }
-#endif /*LODEPNG_COMPILE_ENCODER*/
 
 /*color is not allowed to already exist.
 Index should be >= 0 (it's signed to be compatible with using -1 for "doesn't exist")*/
@@ -3012,10 +3958,58 @@ static void color_tree_add(ColorTree* tree,
   }
   tree->index = (int)index;
 }
+#endif /*LODEPNG_COMPILE_ENCODER*/
+
+#define PALETTE_HASH_BITS 9
+#define PALETTE_HASH_SIZE (1u << PALETTE_HASH_BITS)
+
+/*
+Palette index lookup for converting to LCT_PALETTE, an open addressing hash table
+keyed by the RGBA color packed in an unsigned. It has room for twice the largest
+palette, so most lookups are a single probe instead of an 8-level color tree walk.
+*/
+typedef struct PaletteHash
+{
+  unsigned color[PALETTE_HASH_SIZE];
+  short index[PALETTE_HASH_SIZE]; /*-1 if the slot is empty*/
+} PaletteHash;
+
+static unsigned palette_hash_slot(unsigned color)
+{
+  return ((color * 2654435761u) & 0xffffffffu) >> (32 - PALETTE_HASH_BITS);
+}
+
+/*like with the color tree, a color that appears twice in the palette gets its last index*/
+static void palette_hash_init(PaletteHash* hash, const unsigned char* palette, size_t palettesize)
+{
+  size_t i;
+  for(i = 0; i < PALETTE_HASH_SIZE; i++) hash->index[i] = -1;
+  for(i = 0; i < palettesize; i++)
+  {
+    const unsigned char* p = &palette[i * 4];
+    unsigned color = ((unsigned)p[0] << 24) | ((unsigned)p[1] << 16) | ((unsigned)p[2] << 8) | p[3];
+    unsigned slot = palette_hash_slot(color);
+    while(hash->index[slot] >= 0 && hash->color[slot] != color) slot = (slot + 1) & (PALETTE_HASH_SIZE - 1);
+    hash->color[slot] = color;
+    hash->index[slot] = (short)i;
+  }
+}
+
+/*returns -1 if color not present, its index otherwise*/
+static int palette_hash_get(const PaletteHash* hash, unsigned color)
+{
+  unsigned slot = palette_hash_slot(color);
+  while(hash->index[slot] >= 0)
+  {
+    if(hash->color[slot] == color) return hash->index[slot];
+    slot = (slot + 1) & (PALETTE_HASH_SIZE - 1);
+  }
+  return -1;
+}
 
 /*put a pixel, given its RGBA color, into image of any color type*/
 static unsigned rgba8ToPixel(unsigned char* out, size_t i,
-                             const LodePNGColorMode* mode, ColorTree* tree /*for palette*/,
+                             const LodePNGColorMode* mode, const PaletteHash* hash /*for palette*/,
                              unsigned char r, unsigned char g, unsigned char b, unsigned char a)
 {
   if(mode->colortype == LCT_GREY)
@@ -3047,7 +4041,7 @@ static unsigned rgba8ToPixel(unsigned char* out, size_t i,
   }
   else if(mode->colortype == LCT_PALETTE)
   {
-    int index = color_tree_get(tree, r, g, b, a);
+    int index = palette_hash_get(hash, ((unsigned)r << 24) | ((unsigned)g << 16) | ((unsigned)b << 8) | a);
     if(index < 0) return 82; /*color not in palette*/
     if(mode->bitdepth == 8) out[i] = index;
     else addColorBits(out, i, mode->bitdepth, (unsigned)index);
@@ -3234,6 +4228,82 @@ static void getPixelColorRGBA8(unsigned char* r, unsigned char* g,
   }
 }
 
+/*Converts pixels of at most 8 bits each to RGBA or RGB through a table holding the
+RGBA color of every possible value, as used for palette and low bit depth grey input.*/
+static void getPixelColorsFromTable(unsigned char* buffer, size_t numpixels, unsigned has_alpha,
+                                    const unsigned char* in, unsigned bitdepth, const unsigned char* table)
+{
+  size_t i;
+  if(bitdepth == 8 && has_alpha)
+  {
+    for(i = 0; i < numpixels; i++, buffer += 4)
+    {
+      const unsigned char* p = &table[in[i] * 4];
+      buffer[0] = p[0];
+      buffer[1] = p[1];
+      buffer[2] = p[2];
+      buffer[3] = p[3];
+    }
+  }
+  else if(bitdepth == 8)
+  {
+    for(i = 0; i < numpixels; i++, buffer += 3)
+    {
+      const unsigned char* p = &table[in[i] * 4];
+      buffer[0] = p[0];
+      buffer[1] = p[1];
+      buffer[2] = p[2];
+    }
+  }
+  else
+  {
+    unsigned num_channels = has_alpha ? 4 : 3;
+    unsigned mask = (1u << bitdepth) - 1u;
+    for(i = 0; i < numpixels; i++, buffer += num_channels)
+    {
+      size_t bitpos = i * bitdepth;
+      const unsigned char* p = &table[((in[bitpos >> 3] >> (8 - bitdepth - (bitpos & 7))) & mask) * 4];
+      buffer[0] = p[0];
+      buffer[1] = p[1];
+      buffer[2] = p[2];
+      if(has_alpha) buffer[3] = p[3];
+    }
+  }
+}
+
+#ifdef LODEPNG_X86_DISPATCH
+/*RGB to opaque RGBA, 4 pixels per shuffle. Returns how many pixels were done, the
+scalar loop does the rest. 16 bytes are loaded per 12 used, so it stops 2 pixels early.*/
+LODEPNG_TARGET("ssse3")
+static size_t rgb8ToRGBA8SSSE3(unsigned char* out, const unsigned char* in, size_t numpixels)
+{
+  __m128i shuffle = _mm_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1);
+  __m128i alpha = _mm_set1_epi32((int)0xff000000u);
+  size_t i;
+  for(i = 0; i + 6 <= numpixels; i += 4)
+  {
+    __m128i v = _mm_loadu_si128((const __m128i*)(in + i * 3));
+    _mm_storeu_si128((__m128i*)(out + i * 4), _mm_or_si128(_mm_shuffle_epi8(v, shuffle), alpha));
+  }
+  return i;
+}
+
+/*RGBA to RGB, dropping alpha. Each 16 byte store has 4 bytes of garbage that the next
+store overwrites, so like above it stops 2 pixels early.*/
+LODEPNG_TARGET("ssse3")
+static size_t rgba8ToRGB8SSSE3(unsigned char* out, const unsigned char* in, size_t numpixels)
+{
+  __m128i shuffle = _mm_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+  size_t i;
+  for(i = 0; i + 6 <= numpixels; i += 4)
+  {
+    __m128i v = _mm_loadu_si128((const __m128i*)(in + i * 4));
+    _mm_storeu_si128((__m128i*)(out + i * 3), _mm_shuffle_epi8(v, shuffle));
+  }
+  return i;
+}
+#endif /*LODEPNG_X86_DISPATCH*/
+
 /*Similar to getPixelColorRGBA8, but with all the for loops inside of the color
 mode test cases, optimized to convert the colors much faster, when converting
 to RGBA or RGB with 8 bit per cannel. buffer must be RGBA or RGB output with
@@ -3247,12 +4317,12 @@ static void getPixelColorsRGBA8(unsigned char* buffer, size_t numpixels,
   size_t i;
   if(mode->colortype == LCT_GREY)
   {
-    if(mode->bitdepth == 8)
+    if(mode->bitdepth == 8 && has_alpha && !mode->key_defined)
     {
-      for(i = 0; i < numpixels; i++, buffer += num_channels)
+      for(i = 0; i < numpixels; i++, buffer += 4)
       {
         buffer[0] = buffer[1] = buffer[2] = in[i];
-        if(has_alpha) buffer[3] = mode->key_defined && in[i] == mode->key_r ? 0 : 255;
+        buffer[3] = 255;
       }
     }
     else if(mode->bitdepth == 16)
@@ -3265,19 +4335,34 @@ static void getPixelColorsRGBA8(unsigned char* buffer, size_t numpixels,
     }
     else
     {
+      unsigned char table[256 * 4];
       unsigned highest = ((1U << mode->bitdepth) - 1U); /*highest possible value for this bit depth*/
-      size_t j = 0;
-      for(i = 0; i < numpixels; i++, buffer += num_channels)
+      unsigned value;
+      for(value = 0; value <= highest; value++)
       {
-        unsigned value = readBitsFromReversedStream(&j, in, mode->bitdepth);
-        buffer[0] = buffer[1] = buffer[2] = (value * 255) / highest;
-        if(has_alpha) buffer[3] = mode->key_defined && value == mode->key_r ? 0 : 255;
+        table[value * 4 + 0] = table[value * 4 + 1] = table[value * 4 + 2] = (value * 255) / highest;
+        table[value * 4 + 3] = mode->key_defined && value == mode->key_r ? 0 : 255;
       }
+      getPixelColorsFromTable(buffer, numpixels, has_alpha, in, mode->bitdepth, table);
     }
   }
   else if(mode->colortype == LCT_RGB)
   {
-    if(mode->bitdepth == 8)
+    if(mode->bitdepth == 8 && has_alpha && !mode->key_defined)
+    {
+      i = 0;
+#ifdef LODEPNG_X86_DISPATCH
+      if(lodepng_cpu_has(LODEPNG_CPU_SSSE3)) i = rgb8ToRGBA8SSSE3(buffer, in, numpixels);
+#endif /*LODEPNG_X86_DISPATCH*/
+      for(buffer += i * 4; i < numpixels; i++, buffer += 4)
+      {
+        buffer[0] = in[i * 3 + 0];
+        buffer[1] = in[i * 3 + 1];
+        buffer[2] = in[i * 3 + 2];
+        buffer[3] = 255;
+      }
+    }
+    else if(mode->bitdepth == 8)
     {
       for(i = 0; i < numpixels; i++, buffer += num_channels)
       {
@@ -3304,28 +4389,27 @@ static void getPixelColorsRGBA8(unsigned char* buffer, size_t numpixels,
   }
   else if(mode->colortype == LCT_PALETTE)
   {
+    unsigned char table[256 * 4];
+    unsigned numvalues = 1u << mode->bitdepth;
     unsigned index;
-    size_t j = 0;
-    for(i = 0; i < numpixels; i++, buffer += num_channels)
+    for(index = 0; index < numvalues; index++)
     {
-      if(mode->bitdepth == 8) index = in[i];
-      else index = readBitsFromReversedStream(&j, in, mode->bitdepth);
-
       if(index >= mode->palettesize)
       {
         /*This is an error according to the PNG spec, but most PNG decoders make it black instead.
         Done here too, slightly faster due to no error handling needed.*/
-        buffer[0] = buffer[1] = buffer[2] = 0;
-        if(has_alpha) buffer[3] = 255;
+        table[index * 4 + 0] = table[index * 4 + 1] = table[index * 4 + 2] = 0;
+        table[index * 4 + 3] = 255;
       }
       else
       {
-        buffer[0] = mode->palette[index * 4 + 0];
-        buffer[1] = mode->palette[index * 4 + 1];
-        buffer[2] = mode->palette[index * 4 + 2];
-        if(has_alpha) buffer[3] = mode->palette[index * 4 + 3];
+        table[index * 4 + 0] = mode->palette[index * 4 + 0];
+        table[index * 4 + 1] = mode->palette[index * 4 + 1];
+        table[index * 4 + 2] = mode->palette[index * 4 + 2];
+        table[index * 4 + 3] = mode->palette[index * 4 + 3];
       }
     }
+    getPixelColorsFromTable(buffer, numpixels, has_alpha, in, mode->bitdepth, table);
   }
   else if(mode->colortype == LCT_GREY_ALPHA)
   {
@@ -3345,17 +4429,30 @@ static void getPixelColorsRGBA8(unsigned char* buffer, size_t numpixels,
         if(has_alpha) buffer[3] = in[i * 4 + 2];
       }
     }
-  }
-  else if(mode->colortype == LCT_RGBA)
-  {
-    if(mode->bitdepth == 8)
+  }
+  else if(mode->colortype == LCT_RGBA)
+  {
+    if(mode->bitdepth == 8 && !has_alpha)
+    {
+      i = 0;
+#ifdef LODEPNG_X86_DISPATCH
+      if(lodepng_cpu_has(LODEPNG_CPU_SSSE3)) i = rgba8ToRGB8SSSE3(buffer, in, numpixels);
+#endif /*LODEPNG_X86_DISPATCH*/
+      for(buffer += i * 3; i < numpixels; i++, buffer += 3)
+      {
+        buffer[0] = in[i * 4 + 0];
+        buffer[1] = in[i * 4 + 1];
+        buffer[2] = in[i * 4 + 2];
+      }
+    }
+    else if(mode->bitdepth == 8)
     {
-      for(i = 0; i < numpixels; i++, buffer += num_channels)
+      for(i = 0; i < numpixels; i++, buffer += 4)
       {
         buffer[0] = in[i * 4 + 0];
         buffer[1] = in[i * 4 + 1];
         buffer[2] = in[i * 4 + 2];
-        if(has_alpha) buffer[3] = in[i * 4 + 3];
+        buffer[3] = in[i * 4 + 3];
       }
     }
     else
@@ -3411,7 +4508,7 @@ unsigned lodepng_convert(unsigned char* out, const unsigned char* in,
                          unsigned w, unsigned h)
 {
   size_t i;
-  ColorTree tree;
+  PaletteHash hash;
   size_t numpixels = w * h;
 
   if(lodepng_color_mode_equal(mode_out, mode_in))
@@ -3425,12 +4522,7 @@ unsigned lodepng_convert(unsigned char* out, const unsigned char* in,
   {
     size_t palsize = 1u << mode_out->bitdepth;
     if(mode_out->palettesize < palsize) palsize = mode_out->palettesize;
-    color_tree_init(&tree);
-    for(i = 0; i < palsize; i++)
-    {
-      unsigned char* p = &mode_out->palette[i * 4];
-      color_tree_add(&tree, p[0], p[1], p[2], p[3], i);
-    }
+    palette_hash_init(&hash, mode_out->palette, palsize);
   }
 
   if(mode_in->bitdepth == 16 && mode_out->bitdepth == 16)
@@ -3450,21 +4542,34 @@ unsigned lodepng_convert(unsigned char* out, const unsigned char* in,
   {
     getPixelColorsRGBA8(out, numpixels, 0, in, mode_in);
   }
+  else if(mode_out->bitdepth == 8 && mode_out->colortype == LCT_PALETTE
+          && mode_in->bitdepth == 8 && mode_in->colortype == LCT_RGBA)
+  {
+    /*the encoder's case after auto_convert chose a palette; runs of equal pixels skip the lookup*/
+    unsigned prev = 0;
+    int index = -1;
+    for(i = 0; i < numpixels; i++)
+    {
+      const unsigned char* p = &in[i * 4];
+      unsigned color = ((unsigned)p[0] << 24) | ((unsigned)p[1] << 16) | ((unsigned)p[2] << 8) | p[3];
+      if(i == 0 || color != prev)
+      {
+        index = palette_hash_get(&hash, color);
+        prev = color;
+      }
+      if(index >= 0) out[i] = (unsigned char)index; /*else color not in palette, as in rgba8ToPixel*/
+    }
+  }
   else
   {
     unsigned char r = 0, g = 0, b = 0, a = 0;
     for(i = 0; i < numpixels; i++)
     {
       getPixelColorRGBA8(&r, &g, &b, &a, in, i, mode_in);
-      rgba8ToPixel(out, i, mode_out, &tree, r, g, b, a);
+      rgba8ToPixel(out, i, mode_out, &hash, r, g, b, a);
     }
   }
 
-  if(mode_out->colortype == LCT_PALETTE)
-  {
-    color_tree_cleanup(&tree);
-  }
-
   return 0; /*no error (this function currently never has one, but maybe OOM detection added later.)*/
 }
 
@@ -3745,6 +4850,25 @@ static unsigned char paethPredictor(short a, short b, short c)
   else return (unsigned char)a;
 }
 
+#ifdef LODEPNG_SSE2
+/*the paeth predictor of 8 bytes widened to 16 bits, given pa = |b - c|, pb = |a - c| and
+pc = |a + b - 2c|. It breaks ties the same way as paethPredictor*/
+static __m128i paethSelect16(__m128i a, __m128i b, __m128i c, __m128i pa, __m128i pb, __m128i pc)
+{
+  __m128i smallest = _mm_min_epi16(pc, _mm_min_epi16(pa, pb));
+  __m128i usea = _mm_cmpeq_epi16(smallest, pa);
+  __m128i useb = _mm_cmpeq_epi16(smallest, pb);
+  __m128i borc = _mm_or_si128(_mm_and_si128(useb, b), _mm_andnot_si128(useb, c));
+  return _mm_or_si128(_mm_and_si128(usea, a), _mm_andnot_si128(usea, borc));
+}
+
+/*SSE2 has no absolute value instruction for 16 bit lanes, SSSE3 does*/
+static __m128i abs16(__m128i x)
+{
+  return _mm_max_epi16(x, _mm_sub_epi16(_mm_setzero_si128(), x));
+}
+#endif /*LODEPNG_SSE2*/
+
 /*shared values used by multiple Adam7 related functions*/
 
 static const unsigned ADAM7_IX[7] = { 0, 4, 0, 2, 0, 1, 0 }; /*x start values*/
@@ -3859,6 +4983,142 @@ unsigned lodepng_inspect(unsigned* w, unsigned* h, LodePNGState* state,
   return state->error;
 }
 
+#ifdef LODEPNG_SSE2
+/*Unfiltering Sub, Average and Paeth depends on the pixel to the left, so these go one pixel
+at a time, with all bytes of the pixel in one vector. Only for pixels of 3 or 4 bytes.*/
+static __m128i loadPixel(const unsigned char* p, size_t bytewidth)
+{
+  unsigned v;
+  /*3 bytes are combined in a register: a 3 byte memcpy followed by a 4 byte read of it stalls*/
+  if(bytewidth == 4) memcpy(&v, p, 4);
+  else v = p[0] | ((unsigned)p[1] << 8u) | ((unsigned)p[2] << 16u);
+  return _mm_cvtsi32_si128((int)v);
+}
+
+static void storePixel(unsigned char* p, __m128i v, size_t bytewidth)
+{
+  unsigned t = (unsigned)_mm_cvtsi128_si32(v);
+  if(bytewidth == 4)
+  {
+    memcpy(p, &t, 4);
+  }
+  else
+  {
+    p[0] = (unsigned char)t;
+    p[1] = (unsigned char)(t >> 8u);
+    p[2] = (unsigned char)(t >> 16u);
+  }
+}
+
+static void unfilterSubSSE2(unsigned char* recon, const unsigned char* scanline, size_t bytewidth, size_t length)
+{
+  __m128i a = _mm_setzero_si128(); /*the pixel to the left, in the low bytes*/
+  size_t i = 0;
+  if(bytewidth == 4)
+  {
+    /*four pixels at once: a prefix sum within the vector, plus the pixel before them*/
+    for(; i + 16 <= length; i += 16)
+    {
+      __m128i x = _mm_loadu_si128((const __m128i*)(scanline + i));
+      x = _mm_add_epi8(x, _mm_slli_si128(x, 4));
+      x = _mm_add_epi8(x, _mm_slli_si128(x, 8));
+      x = _mm_add_epi8(x, a);
+      _mm_storeu_si128((__m128i*)(recon + i), x);
+      a = _mm_shuffle_epi32(x, 0xff);
+    }
+  }
+  for(; i + bytewidth <= length; i += bytewidth)
+  {
+    a = _mm_add_epi8(a, loadPixel(scanline + i, bytewidth));
+    storePixel(recon + i, a, bytewidth);
+  }
+}
+
+static void unfilterUpSSE2(unsigned char* recon, const unsigned char* scanline, const unsigned char* precon,
+                           size_t length)
+{
+  size_t i = 0;
+  for(; i + 16 <= length; i += 16)
+  {
+    __m128i x = _mm_loadu_si128((const __m128i*)(scanline + i));
+    __m128i b = _mm_loadu_si128((const __m128i*)(precon + i));
+    _mm_storeu_si128((__m128i*)(recon + i), _mm_add_epi8(x, b));
+  }
+  for(; i < length; i++) recon[i] = scanline[i] + precon[i];
+}
+
+LODEPNG_TARGET("avx2")
+static void unfilterUpAVX2(unsigned char* recon, const unsigned char* scanline, const unsigned char* precon,
+                           size_t length)
+{
+  size_t i = 0;
+  for(; i + 32 <= length; i += 32)
+  {
+    __m256i x = _mm256_loadu_si256((const __m256i*)(scanline + i));
+    __m256i b = _mm256_loadu_si256((const __m256i*)(precon + i));
+    _mm256_storeu_si256((__m256i*)(recon + i), _mm256_add_epi8(x, b));
+  }
+  for(; i < length; i++) recon[i] = scanline[i] + precon[i];
+}
+
+static void unfilterAverageSSE2(unsigned char* recon, const unsigned char* scanline, const unsigned char* precon,
+                                size_t bytewidth, size_t length)
+{
+  __m128i ones = _mm_set1_epi8(1);
+  __m128i a = _mm_setzero_si128();
+  size_t i;
+  for(i = 0; i + bytewidth <= length; i += bytewidth)
+  {
+    __m128i b = loadPixel(precon + i, bytewidth);
+    /*pavgb rounds up, the filter rounds down*/
+    __m128i avg = _mm_sub_epi8(_mm_avg_epu8(a, b), _mm_and_si128(_mm_xor_si128(a, b), ones));
+    a = _mm_add_epi8(loadPixel(scanline + i, bytewidth), avg);
+    storePixel(recon + i, a, bytewidth);
+  }
+}
+
+static void unfilterPaethSSE2(unsigned char* recon, const unsigned char* scanline, const unsigned char* precon,
+                              size_t bytewidth, size_t length)
+{
+  __m128i zero = _mm_setzero_si128();
+  __m128i a = zero, c = zero; /*the left and upper left pixel, 16 bits per byte*/
+  size_t i;
+  for(i = 0; i + bytewidth <= length; i += bytewidth)
+  {
+    __m128i b = _mm_unpacklo_epi8(loadPixel(precon + i, bytewidth), zero);
+    __m128i pa = _mm_sub_epi16(b, c);
+    __m128i pb = _mm_sub_epi16(a, c);
+    __m128i pc = _mm_add_epi16(pa, pb);
+    __m128i predictor = paethSelect16(a, b, c, abs16(pa), abs16(pb), abs16(pc));
+    __m128i x = _mm_add_epi8(loadPixel(scanline + i, bytewidth), _mm_packus_epi16(predictor, zero));
+    storePixel(recon + i, x, bytewidth);
+    a = _mm_unpacklo_epi8(x, zero);
+    c = b;
+  }
+}
+
+LODEPNG_TARGET("ssse3")
+static void unfilterPaethSSSE3(unsigned char* recon, const unsigned char* scanline, const unsigned char* precon,
+                               size_t bytewidth, size_t length)
+{
+  __m128i zero = _mm_setzero_si128();
+  __m128i a = zero, c = zero;
+  size_t i;
+  for(i = 0; i + bytewidth <= length; i += bytewidth)
+  {
+    __m128i b = _mm_unpacklo_epi8(loadPixel(precon + i, bytewidth), zero);
+    __m128i pa = _mm_sub_epi16(b, c);
+    __m128i pb = _mm_sub_epi16(a, c);
+    __m128i pc = _mm_add_epi16(pa, pb);
+    __m128i predictor = paethSelect16(a, b, c, _mm_abs_epi16(pa), _mm_abs_epi16(pb), _mm_abs_epi16(pc));
+    __m128i x = _mm_add_epi8(loadPixel(scanline + i, bytewidth), _mm_packus_epi16(predictor, zero));
+    storePixel(recon + i, x, bytewidth);
+    a = _mm_unpacklo_epi8(x, zero);
+    c = b;
+  }
+}
+#endif /*LODEPNG_SSE2*/
+
 static unsigned unfilterScanline(unsigned char* recon, const unsigned char* scanline, const unsigned char* precon,
                                  size_t bytewidth, unsigned char filterType, size_t length)
 {
@@ -3872,6 +5132,32 @@ static unsigned unfilterScanline(unsigned char* recon, const unsigned char* scan
   */
 
   size_t i;
+#ifdef LODEPNG_SSE2
+  /*SIMD versions for RGB and RGBA with 8 bit channels*/
+  int simd = bytewidth == 3 || bytewidth == 4;
+  if(filterType == 2 && precon)
+  {
+    if(lodepng_cpu_has(LODEPNG_CPU_AVX2)) unfilterUpAVX2(recon, scanline, precon, length);
+    else unfilterUpSSE2(recon, scanline, precon, length);
+    return 0;
+  }
+  if(simd && filterType == 1)
+  {
+    unfilterSubSSE2(recon, scanline, bytewidth, length);
+    return 0;
+  }
+  if(simd && filterType == 3 && precon)
+  {
+    unfilterAverageSSE2(recon, scanline, precon, bytewidth, length);
+    return 0;
+  }
+  if(simd && filterType == 4 && precon)
+  {
+    if(lodepng_cpu_has(LODEPNG_CPU_SSSE3)) unfilterPaethSSSE3(recon, scanline, precon, bytewidth, length);
+    else unfilterPaethSSE2(recon, scanline, precon, bytewidth, length);
+    return 0;
+  }
+#endif /*LODEPNG_SSE2*/
   switch(filterType)
   {
     case 0:
@@ -4421,7 +5707,7 @@ static void decodeGeneric(unsigned char** out, unsigned* w, unsigned* h,
   size_t i;
   ucvector idat; /*the data from idat chunks*/
   ucvector scanlines;
-  size_t predict;
+  size_t predict, outsize;
 
   /*for unknown chunk order*/
   unsigned unknown = 0;
@@ -4435,7 +5721,14 @@ static void decodeGeneric(unsigned char** out, unsigned* w, unsigned* h,
   state->error = lodepng_inspect(w, h, state, in, insize); /*reads header and resets other parameters in state->info_png*/
   if(state->error) return;
 
-  ucvector_init(&idat);
+  /*the IDAT data is never larger than the PNG, so this buffer does not have to grow*/
+  idat.data = (unsigned char*)scratch_get(state->scratch, insize, &idat.allocsize);
+  idat.size = 0;
+  if(!idat.data)
+  {
+    state->error = 83; /*alloc fail*/
+    return;
+  }
   chunk = &in[33]; /*first byte of the first chunk after the header*/
 
   /*loop through the chunks, ignoring unknown chunks and stopping at IEND chunk.
@@ -4563,24 +5856,37 @@ static void decodeGeneric(unsigned char** out, unsigned* w, unsigned* h,
   /*predict output size, to allocate exact size for output buffer to avoid more dynamic allocation.
   The prediction is currently not correct for interlaced PNG images.*/
   predict = lodepng_get_raw_size_idat(*w, *h, &state->info_png.color) + *h;
-  if(!state->error && !ucvector_reserve(&scanlines, predict)) state->error = 83; /*alloc fail*/
   if(!state->error)
   {
-    state->error = zlib_decompress(&scanlines.data, &scanlines.size, idat.data,
-                                   idat.size, &state->decoder.zlibsettings);
+    scanlines.data = (unsigned char*)scratch_get(state->scratch, predict, &scanlines.allocsize);
+    if(!scanlines.data) state->error = 83; /*alloc fail*/
+  }
+  if(!state->error)
+  {
+    const LodePNGDecompressSettings* zlibsettings = &state->decoder.zlibsettings;
+    /*The built in inflate writes its output from the start of the buffer it is given, so it gets
+    the whole buffer as its size, to fill it without reallocating. Custom ones get it empty.*/
+    int builtin = !zlibsettings->custom_zlib && !zlibsettings->custom_inflate;
+    scanlines.size = builtin ? scanlines.allocsize : 0;
+    state->error = zlib_decompress(&scanlines.data, &scanlines.size, idat.data, idat.size, zlibsettings);
+    /*the built in inflate only reallocates to grow, custom ones may have shrunk the buffer*/
+    if(!builtin || scanlines.size > scanlines.allocsize) scanlines.allocsize = scanlines.size;
   }
-  ucvector_cleanup(&idat);
+  scratch_put(state->scratch, idat.data, idat.allocsize);
 
+  outsize = lodepng_get_raw_size(*w, *h, &state->info_png.color);
+  if(!state->error)
+  {
+    /*when the colors are converted after this, lodepng_decode gives this buffer back to the scratch*/
+    *out = (unsigned char*)scratch_get(state->scratch, outsize, 0);
+    if(!*out) state->error = 83; /*alloc fail*/
+  }
   if(!state->error)
   {
-    ucvector outv;
-    ucvector_init(&outv);
-    if(!ucvector_resizev(&outv,
-        lodepng_get_raw_size(*w, *h, &state->info_png.color), 0)) state->error = 83; /*alloc fail*/
-    if(!state->error) state->error = postProcessScanlines(outv.data, scanlines.data, *w, *h, &state->info_png);
-    *out = outv.data;
+    for(i = 0; i < outsize; i++) (*out)[i] = 0;
+    state->error = postProcessScanlines(*out, scanlines.data, *w, *h, &state->info_png);
   }
-  ucvector_cleanup(&scanlines);
+  scratch_put(state->scratch, scanlines.data, scanlines.allocsize);
 }
 
 unsigned lodepng_decode(unsigned char** out, unsigned* w, unsigned* h,
@@ -4623,7 +5929,7 @@ unsigned lodepng_decode(unsigned char** out, unsigned* w, unsigned* h,
     }
     else state->error = lodepng_convert(*out, data, &state->info_raw,
                                         &state->info_png.color, *w, *h);
-    lodepng_free(data);
+    scratch_put(state->scratch, data, lodepng_get_raw_size(*w, *h, &state->info_png.color));
   }
   return state->error;
 }
@@ -4701,6 +6007,7 @@ void lodepng_state_init(LodePNGState* state)
   lodepng_color_mode_init(&state->info_raw);
   lodepng_info_init(&state->info_png);
   state->error = 1;
+  state->scratch = 0;
 }
 
 void lodepng_state_cleanup(LodePNGState* state)
@@ -4832,14 +6139,14 @@ static unsigned addChunk_tRNS(ucvector* out, const LodePNGColorMode* info)
 }
 
 static unsigned addChunk_IDAT(ucvector* out, const unsigned char* data, size_t datasize,
-                              LodePNGCompressSettings* zlibsettings)
+                              LodePNGCompressSettings* zlibsettings, LodePNGScratch* scratch)
 {
   ucvector zlibdata;
   unsigned error = 0;
 
   /*compress with the Zlib compressor*/
   ucvector_init(&zlibdata);
-  error = zlib_compress(&zlibdata.data, &zlibdata.size, data, datasize, zlibsettings);
+  error = zlib_compress(&zlibdata.data, &zlibdata.size, data, datasize, zlibsettings, scratch);
   if(!error) error = addChunk(out, "IDAT", zlibdata.data, zlibdata.size);
   ucvector_cleanup(&zlibdata);
 
@@ -4886,7 +6193,7 @@ static unsigned addChunk_zTXt(ucvector* out, const char* keyword, const char* te
   ucvector_push_back(&data, 0); /*compression method: 0*/
 
   error = zlib_compress(&compressed.data, &compressed.size,
-                        (unsigned char*)textstring, textsize, zlibsettings);
+                        (unsigned char*)textstring, textsize, zlibsettings, 0);
   if(!error)
   {
     for(i = 0; i < compressed.size; i++) ucvector_push_back(&data, compressed.data[i]);
@@ -4922,7 +6229,7 @@ static unsigned addChunk_iTXt(ucvector* out, unsigned compressed, const char* ke
     ucvector compressed_data;
     ucvector_init(&compressed_data);
     error = zlib_compress(&compressed_data.data, &compressed_data.size,
-                          (unsigned char*)textstring, textsize, zlibsettings);
+                          (unsigned char*)textstring, textsize, zlibsettings, 0);
     if(!error)
     {
       for(i = 0; i < compressed_data.size; i++) ucvector_push_back(&data, compressed_data.data[i]);
@@ -5004,6 +6311,80 @@ static unsigned addChunk_pHYs(ucvector* out, const LodePNGInfo* info)
 
 #endif /*LODEPNG_COMPILE_ANCILLARY_CHUNKS*/
 
+#ifdef LODEPNG_SSE2
+/*Filtering only reads the unfiltered bytes, so unlike unfiltering any pixel size can be done 16
+bytes at a time. These do out[i] for i from bytewidth up to the last multiple of 16 before length,
+and return where the scalar code has to continue.*/
+static size_t filterSubSSE2(unsigned char* out, const unsigned char* scanline, size_t bytewidth, size_t length)
+{
+  size_t i = bytewidth;
+  for(; i + 16 <= length; i += 16)
+  {
+    __m128i x = _mm_loadu_si128((const __m128i*)(scanline + i));
+    __m128i a = _mm_loadu_si128((const __m128i*)(scanline + i - bytewidth));
+    _mm_storeu_si128((__m128i*)(out + i), _mm_sub_epi8(x, a));
+  }
+  return i;
+}
+
+static size_t filterUpSSE2(unsigned char* out, const unsigned char* scanline, const unsigned char* prevline,
+                           size_t length)
+{
+  size_t i = 0;
+  for(; i + 16 <= length; i += 16)
+  {
+    __m128i x = _mm_loadu_si128((const __m128i*)(scanline + i));
+    __m128i b = _mm_loadu_si128((const __m128i*)(prevline + i));
+    _mm_storeu_si128((__m128i*)(out + i), _mm_sub_epi8(x, b));
+  }
+  return i;
+}
+
+static size_t filterAverageSSE2(unsigned char* out, const unsigned char* scanline, const unsigned char* prevline,
+                                size_t bytewidth, size_t length)
+{
+  __m128i ones = _mm_set1_epi8(1);
+  size_t i = bytewidth;
+  for(; i + 16 <= length; i += 16)
+  {
+    __m128i x = _mm_loadu_si128((const __m128i*)(scanline + i));
+    __m128i a = _mm_loadu_si128((const __m128i*)(scanline + i - bytewidth));
+    __m128i b = _mm_loadu_si128((const __m128i*)(prevline + i));
+    /*pavgb rounds up, the filter rounds down*/
+    __m128i avg = _mm_sub_epi8(_mm_avg_epu8(a, b), _mm_and_si128(_mm_xor_si128(a, b), ones));
+    _mm_storeu_si128((__m128i*)(out + i), _mm_sub_epi8(x, avg));
+  }
+  return i;
+}
+
+/*the paeth predictor of 8 bytes, given as 16 bit lanes*/
+static __m128i filterPaeth8(__m128i a, __m128i b, __m128i c)
+{
+  __m128i pa = _mm_sub_epi16(b, c);
+  __m128i pb = _mm_sub_epi16(a, c);
+  __m128i pc = _mm_add_epi16(pa, pb);
+  return paethSelect16(a, b, c, abs16(pa), abs16(pb), abs16(pc));
+}
+
+static size_t filterPaethSSE2(unsigned char* out, const unsigned char* scanline, const unsigned char* prevline,
+                              size_t bytewidth, size_t length)
+{
+  __m128i zero = _mm_setzero_si128();
+  size_t i = bytewidth;
+  for(; i + 16 <= length; i += 16)
+  {
+    __m128i x = _mm_loadu_si128((const __m128i*)(scanline + i));
+    __m128i a = _mm_loadu_si128((const __m128i*)(scanline + i - bytewidth));
+    __m128i b = _mm_loadu_si128((const __m128i*)(prevline + i));
+    __m128i c = _mm_loadu_si128((const __m128i*)(prevline + i - bytewidth));
+    __m128i lo = filterPaeth8(_mm_unpacklo_epi8(a, zero), _mm_unpacklo_epi8(b, zero), _mm_unpacklo_epi8(c, zero));
+    __m128i hi = filterPaeth8(_mm_unpackhi_epi8(a, zero), _mm_unpackhi_epi8(b, zero), _mm_unpackhi_epi8(c, zero));
+    _mm_storeu_si128((__m128i*)(out + i), _mm_sub_epi8(x, _mm_packus_epi16(lo, hi)));
+  }
+  return i;
+}
+#endif /*LODEPNG_SSE2*/
+
 static void filterScanline(unsigned char* out, const unsigned char* scanline, const unsigned char* prevline,
                            size_t length, size_t bytewidth, unsigned char filterType)
 {
@@ -5014,21 +6395,20 @@ static void filterScanline(unsigned char* out, const unsigned char* scanline, co
       for(i = 0; i < length; i++) out[i] = scanline[i];
       break;
     case 1: /*Sub*/
-      if(prevline)
-      {
-        for(i = 0; i < bytewidth; i++) out[i] = scanline[i];
-        for(i = bytewidth; i < length; i++) out[i] = scanline[i] - scanline[i - bytewidth];
-      }
-      else
-      {
-        for(i = 0; i < bytewidth; i++) out[i] = scanline[i];
-        for(i = bytewidth; i < length; i++) out[i] = scanline[i] - scanline[i - bytewidth];
-      }
+      for(i = 0; i < bytewidth; i++) out[i] = scanline[i];
+#ifdef LODEPNG_SSE2
+      i = filterSubSSE2(out, scanline, bytewidth, length);
+#endif /*LODEPNG_SSE2*/
+      for(; i < length; i++) out[i] = scanline[i] - scanline[i - bytewidth];
       break;
     case 2: /*Up*/
       if(prevline)
       {
-        for(i = 0; i < length; i++) out[i] = scanline[i] - prevline[i];
+        i = 0;
+#ifdef LODEPNG_SSE2
+        i = filterUpSSE2(out, scanline, prevline, length);
+#endif /*LODEPNG_SSE2*/
+        for(; i < length; i++) out[i] = scanline[i] - prevline[i];
       }
       else
       {
@@ -5039,7 +6419,10 @@ static void filterScanline(unsigned char* out, const unsigned char* scanline, co
       if(prevline)
       {
         for(i = 0; i < bytewidth; i++) out[i] = scanline[i] - prevline[i] / 2;
-        for(i = bytewidth; i < length; i++) out[i] = scanline[i] - ((scanline[i - bytewidth] + prevline[i]) / 2);
+#ifdef LODEPNG_SSE2
+        i = filterAverageSSE2(out, scanline, prevline, bytewidth, length);
+#endif /*LODEPNG_SSE2*/
+        for(; i < length; i++) out[i] = scanline[i] - ((scanline[i - bytewidth] + prevline[i]) / 2);
       }
       else
       {
@@ -5052,7 +6435,10 @@ static void filterScanline(unsigned char* out, const unsigned char* scanline, co
       {
         /*paethPredictor(0, prevline[i], 0) is always prevline[i]*/
         for(i = 0; i < bytewidth; i++) out[i] = (scanline[i] - prevline[i]);
-        for(i = bytewidth; i < length; i++)
+#ifdef LODEPNG_SSE2
+        i = filterPaethSSE2(out, scanline, prevline, bytewidth, length);
+#endif /*LODEPNG_SSE2*/
+        for(; i < length; i++)
         {
           out[i] = (scanline[i] - paethPredictor(scanline[i - bytewidth], prevline[i], prevline[i - bytewidth]));
         }
@@ -5077,6 +6463,172 @@ static float flog2(float f)
   return result + 1.442695f * (f * f * f / 3 - 3 * f * f / 2 + 3 * f - 1.83333f);
 }
 
+/*The sum of a filtered scanline for LFS_MINSUM. For the difference filters each byte is treated as
+signed, values above 127 are negative. Filtertype 0 isn't a difference though, so use unsigned there.
+This means filtertype 0 is almost never chosen, but that is justified.*/
+static size_t filterSum(const unsigned char* data, size_t length, unsigned char filterType)
+{
+  size_t i = 0, sum = 0;
+#ifdef LODEPNG_SSE2
+  __m128i zero = _mm_setzero_si128();
+  __m128i acc = zero;
+  for(; i + 16 <= length; i += 16)
+  {
+    __m128i v = _mm_loadu_si128((const __m128i*)(data + i));
+    /*s < 128 ? s : 255 - s, the same as flipping all bits of the negative values*/
+    if(filterType != 0) v = _mm_xor_si128(v, _mm_cmplt_epi8(v, zero));
+    acc = _mm_add_epi64(acc, _mm_sad_epu8(v, zero));
+  }
+  sum = (size_t)_mm_cvtsi128_si32(acc) + (size_t)_mm_cvtsi128_si32(_mm_srli_si128(acc, 8));
+#endif /*LODEPNG_SSE2*/
+  if(filterType == 0)
+  {
+    for(; i < length; i++) sum += data[i];
+  }
+  else
+  {
+    for(; i < length; i++) sum += data[i] < 128 ? data[i] : (255U - data[i]);
+  }
+  return sum;
+}
+
+/*The Shannon entropy of a filtered scanline for LFS_ENTROPY, the filter type byte included*/
+static float filterEntropy(const unsigned char* data, size_t length, unsigned char filterType)
+{
+  /*two histograms, so that runs of the same byte don't wait on their own increments*/
+  unsigned count[2][256];
+  size_t i;
+  float sum = 0;
+  memset(count, 0, sizeof(count));
+  for(i = 0; i + 2 <= length; i += 2)
+  {
+    count[0][data[i]]++;
+    count[1][data[i + 1]]++;
+  }
+  if(i < length) count[0][data[i]]++;
+  count[0][filterType]++; /*the filter type itself is part of the scanline*/
+  for(i = 0; i < 256; i++)
+  {
+    unsigned c = count[0][i] + count[1][i];
+    if(c != 0)
+    {
+      float p = c / (float)(length + 1);
+      sum += flog2(1 / p) * p;
+    }
+  }
+  return sum;
+}
+
+/*what the adaptive filter strategies need to filter a range of scanlines*/
+typedef struct FilterRows
+{
+  unsigned char* out;
+  const unsigned char* in;
+  size_t linebytes;
+  size_t bytewidth;
+  LodePNGFilterStrategy strategy;
+  const LodePNGEncoderSettings* settings;
+} FilterRows;
+
+/*filters the scanlines begin..end-1 with the adaptive strategy. Every scanline only depends on
+itself and the unfiltered scanline above it, so ranges can be done concurrently*/
+static unsigned filterRows(void* context, unsigned begin, unsigned end)
+{
+  const FilterRows* rows = (const FilterRows*)context;
+  size_t linebytes = rows->linebytes;
+  const unsigned char* in = rows->in;
+  unsigned char* out = rows->out;
+  ucvector attempt[5]; /*five filtering attempts, one for each filter type*/
+  unsigned char type, bestType = 0;
+  unsigned y, error = 0;
+#ifdef LODEPNG_COMPILE_ZLIB
+  /*one hash table for all deflate attempts, making it anew for every short scanline is slow*/
+  Hash hash;
+  /*the attempts only have to rank the filter types, greedy matching on short hash chains does that
+  nearly as well as the settings used for the whole image, in a fraction of the time*/
+  LodePNGCompressSettings zlibsettings = rows->settings->zlibsettings;
+  zlibsettings.lazymatching = 0;
+  zlibsettings.nicematch = 32;
+  zlibsettings.maxchain = 8;
+
+  if(rows->strategy == LFS_BRUTE_FORCE)
+  {
+    /*filterRows can run on several threads at once, so the hash does not come from a scratch*/
+    error = hash_init(&hash, zlibsettings.windowsize, 0);
+    if(error) return error;
+  }
+#else /*no LODEPNG_COMPILE_ZLIB*/
+  if(rows->strategy == LFS_BRUTE_FORCE) return 87; /*the attempts need the built in deflate*/
+#endif /*LODEPNG_COMPILE_ZLIB*/
+
+  for(type = 0; type < 5; type++)
+  {
+    ucvector_init(&attempt[type]);
+    if(!ucvector_resize(&attempt[type], linebytes)) error = 83; /*alloc fail*/
+  }
+
+  for(y = begin; y < end && !error; y++)
+  {
+    const unsigned char* prevline = y == 0 ? 0 : &in[(y - 1) * linebytes];
+    size_t size, smallest = 0;
+    float sum, smallestsum = 0;
+
+    /*try the 5 filter types*/
+    for(type = 0; type < 5; type++)
+    {
+      filterScanline(attempt[type].data, &in[y * linebytes], prevline, linebytes, rows->bytewidth, type);
+
+      if(rows->strategy == LFS_ENTROPY)
+      {
+        sum = filterEntropy(attempt[type].data, linebytes, type);
+        /*check if this is smallest sum (or if type == 0 it's the first case so always store the values)*/
+        if(type == 0 || sum < smallestsum)
+        {
+          bestType = type;
+          smallestsum = sum;
+        }
+        continue;
+      }
+
+#ifdef LODEPNG_COMPILE_ZLIB
+      if(rows->strategy == LFS_BRUTE_FORCE)
+      {
+        /*deflate the scanline after every filter attempt to see which one deflates best.
+        This is very slow and gives only slightly smaller, sometimes even larger, result.
+        The fixed tree is used on the attempts so that the tree is not adapted to the filtertype
+        on purpose, to simulate the true case where the tree is the same for the whole image.
+        Sometimes it gives better result with dynamic tree anyway. Using the fixed tree sometimes
+        gives worse, but in rare cases better compression. It does make this a bit less slow.*/
+        error = deflateFixedSize(&size, &hash, attempt[type].data, linebytes, &zlibsettings);
+        if(error) break;
+      }
+      else
+#endif /*LODEPNG_COMPILE_ZLIB*/
+      {
+        size = filterSum(attempt[type].data, linebytes, type); /*LFS_MINSUM*/
+      }
+
+      /*check if this is smallest size (or if type == 0 it's the first case so always store the values)*/
+      if(type == 0 || size < smallest)
+      {
+        bestType = type;
+        smallest = size;
+      }
+    }
+
+    /*now fill the out values*/
+    out[y * (linebytes + 1)] = bestType; /*the first byte of a scanline will be the filter type*/
+    memcpy(&out[y * (linebytes + 1) + 1], attempt[bestType].data, linebytes);
+  }
+
+  for(type = 0; type < 5; type++) ucvector_cleanup(&attempt[type]);
+#ifdef LODEPNG_COMPILE_ZLIB
+  if(rows->strategy == LFS_BRUTE_FORCE) hash_cleanup(&hash, 0);
+#endif /*LODEPNG_COMPILE_ZLIB*/
+
+  return error;
+}
+
 static unsigned filter(unsigned char* out, const unsigned char* in, unsigned w, unsigned h,
                        const LodePNGColorMode* info, const LodePNGEncoderSettings* settings)
 {
@@ -5092,7 +6644,7 @@ static unsigned filter(unsigned char* out, const unsigned char* in, unsigned w,
   /*bytewidth is used for filtering, is 1 when bpp < 8, number of bytes per pixel otherwise*/
   size_t bytewidth = (bpp + 7) / 8;
   const unsigned char* prevline = 0;
-  unsigned x, y;
+  unsigned y;
   unsigned error = 0;
   LodePNGFilterStrategy strategy = settings->filter_strategy;
 
@@ -5125,110 +6677,18 @@ static unsigned filter(unsigned char* out, const unsigned char* in, unsigned w,
       prevline = &in[inindex];
     }
   }
-  else if(strategy == LFS_MINSUM)
+  else if(strategy == LFS_MINSUM || strategy == LFS_ENTROPY || strategy == LFS_BRUTE_FORCE)
   {
     /*adaptive filtering*/
-    size_t sum[5];
-    ucvector attempt[5]; /*five filtering attempts, one for each filter type*/
-    size_t smallest = 0;
-    unsigned char type, bestType = 0;
-
-    for(type = 0; type < 5; type++)
-    {
-      ucvector_init(&attempt[type]);
-      if(!ucvector_resize(&attempt[type], linebytes)) return 83; /*alloc fail*/
-    }
-
-    if(!error)
-    {
-      for(y = 0; y < h; y++)
-      {
-        /*try the 5 filter types*/
-        for(type = 0; type < 5; type++)
-        {
-          filterScanline(attempt[type].data, &in[y * linebytes], prevline, linebytes, bytewidth, type);
-
-          /*calculate the sum of the result*/
-          sum[type] = 0;
-          if(type == 0)
-          {
-            for(x = 0; x < linebytes; x++) sum[type] += (unsigned char)(attempt[type].data[x]);
-          }
-          else
-          {
-            for(x = 0; x < linebytes; x++)
-            {
-              /*For differences, each byte should be treated as signed, values above 127 are negative
-              (converted to signed char). Filtertype 0 isn't a difference though, so use unsigned there.
-              This means filtertype 0 is almost never chosen, but that is justified.*/
-              unsigned char s = attempt[type].data[x];
-              sum[type] += s < 128 ? s : (255U - s);
-            }
-          }
-
-          /*check if this is smallest sum (or if type == 0 it's the first case so always store the values)*/
-          if(type == 0 || sum[type] < smallest)
-          {
-            bestType = type;
-            smallest = sum[type];
-          }
-        }
-
-        prevline = &in[y * linebytes];
-
-        /*now fill the out values*/
-        out[y * (linebytes + 1)] = bestType; /*the first byte of a scanline will be the filter type*/
-        for(x = 0; x < linebytes; x++) out[y * (linebytes + 1) + 1 + x] = attempt[bestType].data[x];
-      }
-    }
-
-    for(type = 0; type < 5; type++) ucvector_cleanup(&attempt[type]);
-  }
-  else if(strategy == LFS_ENTROPY)
-  {
-    float sum[5];
-    ucvector attempt[5]; /*five filtering attempts, one for each filter type*/
-    float smallest = 0;
-    unsigned type, bestType = 0;
-    unsigned count[256];
-
-    for(type = 0; type < 5; type++)
-    {
-      ucvector_init(&attempt[type]);
-      if(!ucvector_resize(&attempt[type], linebytes)) return 83; /*alloc fail*/
-    }
-
-    for(y = 0; y < h; y++)
-    {
-      /*try the 5 filter types*/
-      for(type = 0; type < 5; type++)
-      {
-        filterScanline(attempt[type].data, &in[y * linebytes], prevline, linebytes, bytewidth, type);
-        for(x = 0; x < 256; x++) count[x] = 0;
-        for(x = 0; x < linebytes; x++) count[attempt[type].data[x]]++;
-        count[type]++; /*the filter type itself is part of the scanline*/
-        sum[type] = 0;
-        for(x = 0; x < 256; x++)
-        {
-          float p = count[x] / (float)(linebytes + 1);
-          sum[type] += count[x] == 0 ? 0 : flog2(1 / p) * p;
-        }
-        /*check if this is smallest sum (or if type == 0 it's the first case so always store the values)*/
-        if(type == 0 || sum[type] < smallest)
-        {
-          bestType = type;
-          smallest = sum[type];
-        }
-      }
-
-      prevline = &in[y * linebytes];
-
-      /*now fill the out values*/
-      out[y * (linebytes + 1)] = bestType; /*the first byte of a scanline will be the filter type*/
-      for(x = 0; x < linebytes; x++) out[y * (linebytes + 1) + 1 + x] = attempt[bestType].data[x];
-    }
-
-    for(type = 0; type < 5; type++) ucvector_cleanup(&attempt[type]);
+    FilterRows rows;
+    rows.out = out;
+    rows.in = in;
+    rows.linebytes = linebytes;
+    rows.bytewidth = bytewidth;
+    rows.strategy = strategy;
+    rows.settings = settings;
+    if(settings->custom_filter_rows) error = settings->custom_filter_rows(filterRows, &rows, h, settings);
+    else error = filterRows(&rows, 0, h);
   }
   else if(strategy == LFS_PREDEFINED)
   {
@@ -5242,56 +6702,6 @@ static unsigned filter(unsigned char* out, const unsigned char* in, unsigned w,
       prevline = &in[inindex];
     }
   }
-  else if(strategy == LFS_BRUTE_FORCE)
-  {
-    /*brute force filter chooser.
-    deflate the scanline after every filter attempt to see which one deflates best.
-    This is very slow and gives only slightly smaller, sometimes even larger, result*/
-    size_t size[5];
-    ucvector attempt[5]; /*five filtering attempts, one for each filter type*/
-    size_t smallest = 0;
-    unsigned type = 0, bestType = 0;
-    unsigned char* dummy;
-    LodePNGCompressSettings zlibsettings = settings->zlibsettings;
-    /*use fixed tree on the attempts so that the tree is not adapted to the filtertype on purpose,
-    to simulate the true case where the tree is the same for the whole image. Sometimes it gives
-    better result with dynamic tree anyway. Using the fixed tree sometimes gives worse, but in rare
-    cases better compression. It does make this a bit less slow, so it's worth doing this.*/
-    zlibsettings.btype = 1;
-    /*a custom encoder likely doesn't read the btype setting and is optimized for complete PNG
-    images only, so disable it*/
-    zlibsettings.custom_zlib = 0;
-    zlibsettings.custom_deflate = 0;
-    for(type = 0; type < 5; type++)
-    {
-      ucvector_init(&attempt[type]);
-      ucvector_resize(&attempt[type], linebytes); /*todo: give error if resize failed*/
-    }
-    for(y = 0; y < h; y++) /*try the 5 filter types*/
-    {
-      for(type = 0; type < 5; type++)
-      {
-        unsigned testsize = attempt[type].size;
-        /*if(testsize > 8) testsize /= 8;*/ /*it already works good enough by testing a part of the row*/
-
-        filterScanline(attempt[type].data, &in[y * linebytes], prevline, linebytes, bytewidth, type);
-        size[type] = 0;
-        dummy = 0;
-        zlib_compress(&dummy, &size[type], attempt[type].data, testsize, &zlibsettings);
-        lodepng_free(dummy);
-        /*check if this is smallest size (or if type == 0 it's the first case so always store the values)*/
-        if(type == 0 || size[type] < smallest)
-        {
-          bestType = type;
-          smallest = size[type];
-        }
-      }
-      prevline = &in[y * linebytes];
-      out[y * (linebytes + 1)] = bestType; /*the first byte of a scanline will be the filter type*/
-      for(x = 0; x < linebytes; x++) out[y * (linebytes + 1) + 1 + x] = attempt[bestType].data[x];
-    }
-    for(type = 0; type < 5; type++) ucvector_cleanup(&attempt[type]);
-  }
   else return 88; /* unknown filter strategy */
 
   return error;
@@ -5381,9 +6791,11 @@ static void Adam7_interlace(unsigned char* out, const unsigned char* in, unsigne
 
 /*out must be buffer big enough to contain uncompressed IDAT chunk data, and in must contain the full image.
 return value is error**/
+/*out is taken from scratch if not NULL, it can be given back with scratch_put of outsize bytes*/
 static unsigned preProcessScanlines(unsigned char** out, size_t* outsize, const unsigned char* in,
                                     unsigned w, unsigned h,
-                                    const LodePNGInfo* info_png, const LodePNGEncoderSettings* settings)
+                                    const LodePNGInfo* info_png, const LodePNGEncoderSettings* settings,
+                                    LodePNGScratch* scratch)
 {
   /*
   This function converts the pure 2D image with the PNG's colortype, into filtered-padded-interlaced data. Steps:
@@ -5396,7 +6808,7 @@ static unsigned preProcessScanlines(unsigned char** out, size_t* outsize, const
   if(info_png->interlace_method == 0)
   {
     *outsize = h + (h * ((w * bpp + 7) / 8)); /*image size plus an extra byte per scanline + possible padding bits*/
-    *out = (unsigned char*)lodepng_malloc(*outsize);
+    *out = (unsigned char*)scratch_get(scratch, *outsize, 0);
     if(!(*out) && (*outsize)) error = 83; /*alloc fail*/
 
     if(!error)
@@ -5429,7 +6841,7 @@ static unsigned preProcessScanlines(unsigned char** out, size_t* outsize, const
     Adam7_getpassvalues(passw, passh, filter_passstart, padded_passstart, passstart, w, h, bpp);
 
     *outsize = filter_passstart[7]; /*image size plus an extra byte per scanline + possible padding bits*/
-    *out = (unsigned char*)lodepng_malloc(*outsize);
+    *out = (unsigned char*)scratch_get(scratch, *outsize, 0);
     if(!(*out)) error = 83; /*alloc fail*/
 
     adam7 = (unsigned char*)lodepng_malloc(passstart[7]);
@@ -5555,18 +6967,18 @@ unsigned lodepng_encode(unsigned char** out, size_t* outsize,
   if(!lodepng_color_mode_equal(&state->info_raw, &info.color))
   {
     unsigned char* converted;
-    size_t size = (w * h * lodepng_get_bpp(&info.color) + 7) / 8;
+    size_t size = (w * h * lodepng_get_bpp(&info.color) + 7) / 8, allocsize;
 
-    converted = (unsigned char*)lodepng_malloc(size);
+    converted = (unsigned char*)scratch_get(state->scratch, size, &allocsize);
     if(!converted && size) state->error = 83; /*alloc fail*/
     if(!state->error)
     {
       state->error = lodepng_convert(converted, image, &info.color, &state->info_raw, w, h);
     }
-    if(!state->error) preProcessScanlines(&data, &datasize, converted, w, h, &info, &state->encoder);
-    lodepng_free(converted);
+    if(!state->error) preProcessScanlines(&data, &datasize, converted, w, h, &info, &state->encoder, state->scratch);
+    scratch_put(state->scratch, converted, allocsize);
   }
-  else preProcessScanlines(&data, &datasize, image, w, h, &info, &state->encoder);
+  else preProcessScanlines(&data, &datasize, image, w, h, &info, &state->encoder, state->scratch);
 
   ucvector_init(&outv);
   while(!state->error) /*while only executed once, to break on error*/
@@ -5618,7 +7030,7 @@ unsigned lodepng_encode(unsigned char** out, size_t* outsize,
     }
 #endif /*LODEPNG_COMPILE_ANCILLARY_CHUNKS*/
     /*IDAT (multiple IDAT chunks must be consecutive)*/
-    state->error = addChunk_IDAT(&outv, data, datasize, &state->encoder.zlibsettings);
+    state->error = addChunk_IDAT(&outv, data, datasize, &state->encoder.zlibsettings, state->scratch);
     if(state->error) break;
 #ifdef LODEPNG_COMPILE_ANCILLARY_CHUNKS
     /*tIME*/
@@ -5693,7 +7105,7 @@ unsigned lodepng_encode(unsigned char** out, size_t* outsize,
   }
 
   lodepng_info_cleanup(&info);
-  lodepng_free(data);
+  scratch_put(state->scratch, data, datasize);
   /*instead of cleaning the vector up, give it to the output*/
   *out = outv.data;
   *outsize = outv.size;
@@ -5758,6 +7170,7 @@ void lodepng_encoder_settings_init(LodePNGEncoderSettings* settings)
   settings->auto_convert = 1;
   settings->force_palette = 0;
   settings->predefined_filters = 0;
+  settings->custom_filter_rows = 0;
 #ifdef LODEPNG_COMPILE_ANCILLARY_CHUNKS
   settings->add_id = 0;
   settings->text_compression = 1;
@@ -5933,7 +7346,7 @@ unsigned compress(std::vector<unsigned char>& out, const unsigned char* in, size
 {
   unsigned char* buffer = 0;
   size_t buffersize = 0;
-  unsigned error = zlib_compress(&buffer, &buffersize, in, insize, &settings);
+  unsigned error = zlib_compress(&buffer, &buffersize, in, insize, &settings, 0);
   if(buffer)
   {
     out.insert(out.end(), &buffer[0], &buffer[buffersize]);
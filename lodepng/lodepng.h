@@ -75,6 +75,11 @@ source files with custom allocators.*/
 #ifndef LODEPNG_NO_COMPILE_ALLOCATORS
 #define LODEPNG_COMPILE_ALLOCATORS
 #endif
+/*use instruction set extensions (such as PCLMULQDQ for the CRC) where the CPU supports
+them, detected at runtime. Only has effect with gcc or clang on x86.*/
+#ifndef LODEPNG_NO_COMPILE_CPU_DISPATCH
+#define LODEPNG_COMPILE_CPU_DISPATCH
+#endif
 /*compile the C++ version (you can disable the C++ wrapper here even when compiling for C++)*/
 #ifdef __cplusplus
 #ifndef LODEPNG_NO_COMPILE_CPP
@@ -246,6 +251,27 @@ unsigned encode(const std::string& filename,
 const char* lodepng_error_text(unsigned code);
 #endif /*LODEPNG_COMPILE_ERROR_TEXT*/
 
+#if defined(LODEPNG_COMPILE_DECODER) || defined(LODEPNG_COMPILE_ENCODER)
+#define LODEPNG_SCRATCH_BLOCKS 8
+
+/*
+Memory that is kept between encodes and decodes instead of being freed, for the large
+temporary buffers such as the LZ77 hash tables, the filtered scanlines and the IDAT data.
+When many small images are handled in a row, the same blocks are reused instead of being
+allocated again each time. Attach it to LodePNGState with the scratch pointer. It is not
+thread safe: a scratch can be used by only one encode or decode at a time.
+*/
+typedef struct LodePNGScratch
+{
+  void* blocks[LODEPNG_SCRATCH_BLOCKS]; /*kept blocks, allocated with lodepng_malloc, or NULL*/
+  size_t sizes[LODEPNG_SCRATCH_BLOCKS]; /*size in bytes of each kept block*/
+} LodePNGScratch;
+
+void lodepng_scratch_init(LodePNGScratch* scratch);
+/*frees all kept blocks, the scratch can be used again afterwards*/
+void lodepng_scratch_cleanup(LodePNGScratch* scratch);
+#endif /* defined(LODEPNG_COMPILE_DECODER) || defined(LODEPNG_COMPILE_ENCODER) */
+
 #ifdef LODEPNG_COMPILE_DECODER
 /*Settings for zlib decompression*/
 typedef struct LodePNGDecompressSettings LodePNGDecompressSettings;
@@ -286,6 +312,9 @@ struct LodePNGCompressSettings /*deflate = compress*/
   unsigned minmatch; /*mininum lz77 length. 3 is normally best, 6 can be better for some PNGs. Default: 0*/
   unsigned nicematch; /*stop searching if >= this length found. Set to 258 for best compression. Default: 128*/
   unsigned lazymatching; /*use lazy matching: better compression but a bit slower. Default: true*/
+  /*maximum number of earlier positions tried per match. 0 to try windowsize / 8, or all of them
+  if windowsize >= 8192. Default: 0*/
+  unsigned maxchain;
 
   /*use custom zlib encoder instead of built in one (default: null)*/
   unsigned (*custom_zlib)(unsigned char**, size_t*,
@@ -301,8 +330,21 @@ struct LodePNGCompressSettings /*deflate = compress*/
   const void* custom_context; /*optional custom settings for custom functions*/
 };
 
+/*presets for the LZ77 settings, from fastest to smallest output*/
+typedef enum LodePNGCompressLevel
+{
+  /*greedy matching with short hash chains, for images that are encoded often*/
+  LCL_FAST = 0,
+  /*the values set by lodepng_compress_settings_init*/
+  LCL_DEFAULT = 1,
+  /*full window, lazy matching and long hash chains*/
+  LCL_MAX = 2
+} LodePNGCompressLevel;
+
 extern const LodePNGCompressSettings lodepng_default_compress_settings;
 void lodepng_compress_settings_init(LodePNGCompressSettings* settings);
+/*sets the LZ77 settings to one of the presets, leaves the other fields alone*/
+void lodepng_compress_settings_level(LodePNGCompressSettings* settings, LodePNGCompressLevel level);
 #endif /*LODEPNG_COMPILE_ENCODER*/
 
 #ifdef LODEPNG_COMPILE_PNG
@@ -542,8 +584,8 @@ typedef enum LodePNGFilterStrategy
   on the image, this is better or worse than minsum.*/
   LFS_ENTROPY,
   /*
-  Brute-force-search PNG filters by compressing each filter for each scanline.
-  Experimental, very slow, and only rarely gives better compression than MINSUM.
+  Brute-force-search PNG filters by compressing each filter for each scanline, with greedy
+  matching and the fixed tree. Slow, and only rarely gives better compression than MINSUM.
   */
   LFS_BRUTE_FORCE,
   /*use predefined_filters buffer: you specify the filter type for each scanline*/
@@ -597,6 +639,12 @@ typedef struct LodePNGEncoderSettings
   have to cleanup this buffer, LodePNG will never free it. Don't forget that filter_palette_zero
   must be set to 0 to ensure this is also used on palette or low bitdepth images.*/
   const unsigned char* predefined_filters;
+  /*use custom function to run the adaptive filter strategies (LFS_MINSUM, LFS_ENTROPY and
+  LFS_BRUTE_FORCE) on several threads (default: null). It must call filter_rows(rows, begin, end)
+  for disjoint ranges of scanlines that together cover 0 to h - 1, possibly concurrently, and
+  return the first nonzero error returned by it, or 0 when all succeeded.*/
+  unsigned (*custom_filter_rows)(unsigned (*filter_rows)(void* rows, unsigned begin, unsigned end),
+                                 void* rows, unsigned h, const struct LodePNGEncoderSettings* settings);
 
   /*force creating a PLTE chunk if colortype is 2 or 6 (= a suggested palette).
   If colortype is 3, PLTE is _always_ created.*/
@@ -626,6 +674,9 @@ typedef struct LodePNGState
   LodePNGColorMode info_raw; /*specifies the format in which you would like to get the raw pixel buffer*/
   LodePNGInfo info_png; /*info of the PNG image obtained after decoding*/
   unsigned error;
+  /*memory reused between calls with this state (default: null, allocate per call). Not owned by
+  the state: it is not freed by lodepng_state_cleanup and lodepng_state_copy shares it*/
+  LodePNGScratch* scratch;
 #ifdef LODEPNG_COMPILE_CPP
   //For the lodepng::State subclass.
   virtual ~LodePNGState(){}
@@ -779,7 +830,23 @@ unsigned lodepng_deflate(unsigned char** out, size_t* outsize,
                          const unsigned char* in, size_t insize,
                          const LodePNGCompressSettings* settings);
 
+/*
+Compresses in[dictsize .. dictsize+insize-1] with deflate, matches may refer back into
+in[0 .. dictsize-1] like into a preset dictionary. If final is 0, the output ends with
+an empty stored block (a sync flush) instead of a final block, so the deflate data of
+the next segment can be appended to it. This allows compressing the segments of one
+zlib stream in parallel. Reallocates the out buffer and appends the data.
+*/
+unsigned lodepng_deflate_segment(unsigned char** out, size_t* outsize,
+                                 const unsigned char* in, size_t dictsize, size_t insize, unsigned final,
+                                 const LodePNGCompressSettings* settings);
+
 #endif /*LODEPNG_COMPILE_ENCODER*/
+
+/*Return the adler32 checksum of the bytes data[0..len-1], as used in the zlib trailer*/
+unsigned lodepng_adler32(const unsigned char* data, size_t len);
+/*Return the adler32 of two concatenated buffers, given the checksum of each and the length of the second*/
+unsigned lodepng_adler32_combine(unsigned adler1, unsigned adler2, size_t len2);
 #endif /*LODEPNG_COMPILE_ZLIB*/
 
 #ifdef LODEPNG_COMPILE_DISK
@@ -1161,6 +1228,10 @@ can encode the colors of all pixels without information loss.
    true for proper compression.
 *) windowsize: the window size used by the LZ77 encoder (1 - 32768). Has value
    2048 by default, but can be set to 32768 for better, but slow, compression.
+*) maxchain: how many earlier positions with the same hash the LZ77 encoder tries
+   for each match. 0 by default, which derives it from the windowsize.
+   lodepng_compress_settings_level sets windowsize, maxchain and the other LZ77
+   settings to a fast, default or maximum compression preset.
 *) force_palette: if colortype is 2 or 6, you can make the encoder write a PLTE
    chunk if force_palette is true. This can used as suggested palette to convert
    to by viewers that don't support more than 256 colors (if those still exist)
@@ -0,0 +1,364 @@
+/*
+Tests for the zlib and PNG code of lodepng.c, run by make check.
+
+The zlib streams below were made with the reference zlib, the other tests encode with
+lodepng itself and check that decoding gives back the input. The checksums are compared
+with plain bytewise implementations, the compression level presets must round-trip and
+the slower ones must not compress worse. make check also builds the test with
+LODEPNG_NO_COMPILE_CPU_DISPATCH, so that both the SIMD and the scalar code are tested.
+*/
+
+#include "lodepng.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static int failed = 0;
+
+#define CHECK(cond) do { if(!(cond)) { \
+  fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); failed++; } } while(0)
+
+static unsigned random_state = 1;
+
+static unsigned random_next(void)
+{
+  random_state = random_state * 1103515245u + 12345u;
+  return (random_state >> 16) & 0x7fff;
+}
+
+/*letters where each one is half as likely as the one before, that is 'a' + number of trailing ones*/
+static void make_skewed(unsigned char* buf, size_t size, unsigned seed)
+{
+  size_t i;
+  random_state = seed;
+  for(i = 0; i < size; i++)
+  {
+    unsigned r = random_next(), s = 0;
+    while((r & 1) && s < 14) { s++; r >>= 1; }
+    buf[i] = (unsigned char)('a' + s);
+  }
+}
+
+/*letters with Fibonacci frequencies in random order, their Huffman codes are as long as possible*/
+static size_t make_fibonacci(unsigned char* buf, unsigned letters)
+{
+  size_t a = 1, b = 1, size = 0, i;
+  unsigned k;
+  for(k = 0; k < letters; k++)
+  {
+    size_t c = a + b;
+    for(i = 0; i < a; i++) buf[size++] = (unsigned char)('a' + k);
+    a = b;
+    b = c;
+  }
+  random_state = 1;
+  for(i = size - 1; i > 0; i--)
+  {
+    size_t j = ((size_t)random_next() << 15 | random_next()) % (i + 1);
+    unsigned char t = buf[i];
+    buf[i] = buf[j];
+    buf[j] = t;
+  }
+  return size;
+}
+
+/*a stored, a fixed Huffman and a dynamic Huffman block made by zlib*/
+static const unsigned char zlib_stored[] = {
+  120, 1, 1, 12, 0, 243, 255, 115, 116, 111, 114, 101, 100, 32, 98, 108,
+  111, 99, 107, 31, 128, 4, 189
+};
+
+static const unsigned char zlib_fixed[] = {
+  120, 218, 203, 72, 205, 201, 201, 87, 200, 64, 39, 1, 104, 3, 8, 177
+};
+
+/*make_skewed(512, 1) compressed with Z_HUFFMAN_ONLY*/
+static const unsigned char zlib_dynamic[] = {
+  120, 1, 5, 193, 129, 97, 28, 65, 16, 4, 161, 88, 169, 158, 189, 151,
+  243, 79, 192, 64, 219, 140, 62, 186, 126, 225, 221, 185, 16, 155, 66, 239,
+  52, 98, 248, 234, 125, 63, 166, 0, 202, 63, 177, 151, 148, 101, 50, 249,
+  196, 36, 8, 229, 157, 130, 56, 173, 60, 93, 123, 43, 85, 91, 60, 160,
+  45, 110, 104, 191, 156, 165, 46, 121, 52, 159, 98, 240, 142, 48, 187, 24,
+  114, 221, 97, 195, 172, 48, 45, 114, 53, 50, 210, 58, 122, 15, 149, 155,
+  188, 160, 201, 206, 45, 163, 138, 251, 165, 230, 91, 226, 147, 93, 195, 16,
+  33, 53, 189, 33, 44, 22, 144, 18, 251, 172, 109, 10, 177, 94, 84, 79,
+  181, 173, 239, 167, 90, 61, 193, 31, 23, 197, 111, 142, 166, 142, 160, 70,
+  208, 208, 42, 103, 142, 250, 15, 138, 10, 196, 16
+};
+
+static void check_decompress(const unsigned char* in, size_t insize, const unsigned char* expected, size_t size)
+{
+  unsigned char* out = 0;
+  size_t outsize = 0;
+  unsigned error = lodepng_zlib_decompress(&out, &outsize, in, insize, &lodepng_default_decompress_settings);
+  CHECK(!error);
+  CHECK(outsize == size);
+  CHECK(!error && outsize == size && (!size || !memcmp(out, expected, size)));
+  free(out);
+}
+
+static void test_inflate_zlib(void)
+{
+  unsigned char skewed[512];
+  const char* hello = "hello hello hello hello";
+  make_skewed(skewed, sizeof(skewed), 1);
+  check_decompress(zlib_stored, sizeof(zlib_stored), (const unsigned char*)"stored block", 12);
+  check_decompress(zlib_fixed, sizeof(zlib_fixed), (const unsigned char*)hello, strlen(hello));
+  check_decompress(zlib_dynamic, sizeof(zlib_dynamic), skewed, sizeof(skewed));
+}
+
+static void check_roundtrip(const unsigned char* in, size_t insize, const LodePNGCompressSettings* settings)
+{
+  unsigned char* compressed = 0;
+  size_t compressedsize = 0;
+  unsigned error = lodepng_zlib_compress(&compressed, &compressedsize, in, insize, settings);
+  CHECK(!error);
+  if(!error) check_decompress(compressed, compressedsize, in, insize);
+  free(compressed);
+}
+
+static void test_inflate_roundtrip(void)
+{
+  static const size_t sizes[] = {1, 100, 5000, 70000};
+  unsigned char* buf = (unsigned char*)malloc(70000);
+  LodePNGCompressSettings settings;
+  size_t i, j, size;
+  unsigned lengths[15], frequencies[15];
+  unsigned btype;
+
+  for(btype = 0; btype < 3; btype++)
+  {
+    lodepng_compress_settings_init(&settings);
+    settings.btype = btype;
+    for(i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+    {
+      make_skewed(buf, sizes[i], 7);
+      check_roundtrip(buf, sizes[i], &settings);
+      for(j = 0; j < sizes[i]; j++) buf[j] = (unsigned char)random_next();
+      check_roundtrip(buf, sizes[i], &settings);
+      memset(buf, 'x', sizes[i]);
+      check_roundtrip(buf, sizes[i], &settings);
+    }
+  }
+  lodepng_compress_settings_init(&settings);
+  check_roundtrip(buf, 0, &settings);
+
+  /*codes longer than the first level of the decoding table, without LZ77 all of them are used*/
+  size = make_fibonacci(buf, 15);
+  for(i = 0; i < 15; i++) frequencies[i] = 0;
+  for(i = 0; i < size; i++) frequencies[buf[i] - 'a']++;
+  CHECK(!lodepng_huffman_code_lengths(lengths, frequencies, 15, 15));
+  CHECK(lengths[0] > 10);
+  lodepng_compress_settings_init(&settings);
+  settings.use_lz77 = 0;
+  check_roundtrip(buf, size, &settings);
+  free(buf);
+}
+
+/*broken streams must give an error, and not read or write outside of the buffers*/
+static void test_inflate_corrupt(void)
+{
+  unsigned char in[sizeof(zlib_dynamic)];
+  unsigned char* out;
+  size_t outsize, i;
+
+  for(i = 2; i < sizeof(zlib_dynamic) - 4; i++)
+  {
+    out = 0;
+    outsize = 0;
+    CHECK(lodepng_zlib_decompress(&out, &outsize, zlib_dynamic, i, &lodepng_default_decompress_settings));
+    free(out);
+  }
+
+  memcpy(in, zlib_dynamic, sizeof(in));
+  in[sizeof(in) - 1] ^= 1;
+  out = 0;
+  outsize = 0;
+  CHECK(lodepng_zlib_decompress(&out, &outsize, in, sizeof(in), &lodepng_default_decompress_settings) == 58);
+  free(out);
+
+  for(i = 2; i < 40; i++)
+  {
+    memcpy(in, zlib_dynamic, sizeof(in));
+    in[i] ^= 0x55;
+    out = 0;
+    outsize = 0;
+    lodepng_zlib_decompress(&out, &outsize, in, sizeof(in), &lodepng_default_decompress_settings);
+    free(out);
+  }
+}
+
+/*a 160x160 identicon: 5x5 cells of two colors, mirrored like the ones made for buddies without photo*/
+static void make_identicon(unsigned char* image, unsigned w, unsigned h)
+{
+  unsigned x, y, cells = 0;
+  random_state = 9;
+  for(x = 0; x < 15; x++) cells |= (random_next() & 1u) << x;
+  for(y = 0; y < h; y++)
+  {
+    for(x = 0; x < w; x++)
+    {
+      unsigned cx = x * 5 / w, cy = y * 5 / h;
+      unsigned on = (cells >> ((cx < 3 ? cx : 4 - cx) * 5 + cy)) & 1u;
+      unsigned char* p = image + 4 * (y * w + x);
+      p[0] = on ? 40 : 240;
+      p[1] = on ? 160 : 240;
+      p[2] = on ? 90 : 240;
+      p[3] = 255;
+    }
+  }
+}
+
+static size_t encode_png(const unsigned char* image, unsigned w, unsigned h, LodePNGCompressLevel level)
+{
+  LodePNGState state;
+  unsigned char* png = 0;
+  unsigned char* decoded = 0;
+  size_t pngsize = 0;
+  unsigned dw = 0, dh = 0;
+  unsigned error;
+
+  lodepng_state_init(&state);
+  lodepng_compress_settings_level(&state.encoder.zlibsettings, level);
+  error = lodepng_encode(&png, &pngsize, image, w, h, &state);
+  CHECK(!error);
+  lodepng_state_cleanup(&state);
+  if(error) return 0;
+
+  error = lodepng_decode32(&decoded, &dw, &dh, png, pngsize);
+  CHECK(!error && dw == w && dh == h && !memcmp(decoded, image, (size_t)w * h * 4));
+  free(decoded);
+  free(png);
+  return pngsize;
+}
+
+static void test_levels(void)
+{
+  static const unsigned w = 160, h = 160;
+  unsigned char* image = (unsigned char*)malloc(w * h * 4);
+  unsigned char* buf = (unsigned char*)malloc(70000);
+  LodePNGCompressSettings settings;
+  size_t size[3];
+  unsigned level, i;
+
+  for(level = LCL_FAST; level <= LCL_MAX; level++)
+  {
+    lodepng_compress_settings_init(&settings);
+    lodepng_compress_settings_level(&settings, (LodePNGCompressLevel)level);
+    make_skewed(buf, 70000, 11);
+    check_roundtrip(buf, 70000, &settings);
+    for(i = 0; i < 70000; i++) buf[i] = (unsigned char)("abcabcabd"[i % 9] + (i % 1000 == 0));
+    check_roundtrip(buf, 70000, &settings);
+  }
+
+  /*the slower presets must compress better than LCL_FAST. Longer matches do not always give
+  shorter Huffman codes, so LCL_MAX only has to be about as good as LCL_DEFAULT*/
+  make_identicon(image, w, h);
+  for(level = LCL_FAST; level <= LCL_MAX; level++) size[level] = encode_png(image, w, h, (LodePNGCompressLevel)level);
+  CHECK(size[LCL_DEFAULT] <= size[LCL_FAST]);
+  CHECK(size[LCL_MAX] <= size[LCL_DEFAULT] + size[LCL_DEFAULT] / 100);
+
+  for(i = 0; i < w * h * 4; i++) image[i] = (unsigned char)(i % 4 == 3 ? 255 : (i / 4 % w + i / 4 / w * 3 + i % 4 * 50));
+  for(level = LCL_FAST; level <= LCL_MAX; level++) size[level] = encode_png(image, w, h, (LodePNGCompressLevel)level);
+  CHECK(size[LCL_DEFAULT] <= size[LCL_FAST]);
+  CHECK(size[LCL_MAX] <= size[LCL_DEFAULT] + size[LCL_DEFAULT] / 100);
+
+  free(buf);
+  free(image);
+}
+
+static unsigned reference_adler32(const unsigned char* data, size_t len)
+{
+  unsigned s1 = 1, s2 = 0;
+  size_t i;
+  for(i = 0; i < len; i++)
+  {
+    s1 = (s1 + data[i]) % 65521u;
+    s2 = (s2 + s1) % 65521u;
+  }
+  return (s2 << 16) | s1;
+}
+
+static unsigned reference_crc32(const unsigned char* data, size_t len)
+{
+  unsigned crc = 0xffffffffu;
+  size_t i;
+  int k;
+  for(i = 0; i < len; i++)
+  {
+    crc ^= data[i];
+    for(k = 0; k < 8; k++) crc = (crc >> 1) ^ (0xedb88320u & (0u - (crc & 1u)));
+  }
+  return crc ^ 0xffffffffu;
+}
+
+/*lengths around the SIMD block sizes and the 5552 byte limit before the sums must be reduced*/
+static const size_t checksum_sizes[] = {0, 1, 15, 16, 17, 31, 32, 33, 63, 64, 65, 100, 1000,
+                                        5551, 5552, 5553, 65536, 300000};
+
+static void test_adler32(void)
+{
+  size_t size = 300000 + 64, i, j, offset;
+  unsigned char* buf = (unsigned char*)malloc(size);
+  random_state = 3;
+  for(i = 0; i < size; i++) buf[i] = (unsigned char)random_next();
+
+  CHECK(lodepng_adler32((const unsigned char*)"Wikipedia", 9) == 0x11e60398u);
+  for(i = 0; i < sizeof(checksum_sizes) / sizeof(checksum_sizes[0]); i++)
+  {
+    for(offset = 0; offset < 64; offset += 7)
+    {
+      CHECK(lodepng_adler32(buf + offset, checksum_sizes[i]) == reference_adler32(buf + offset, checksum_sizes[i]));
+    }
+  }
+
+  /*largest possible sums*/
+  memset(buf, 255, size);
+  CHECK(lodepng_adler32(buf, 300000) == reference_adler32(buf, 300000));
+
+  random_state = 4;
+  for(i = 0; i < size; i++) buf[i] = (unsigned char)random_next();
+  for(i = 0; i < sizeof(checksum_sizes) / sizeof(checksum_sizes[0]); i++)
+  {
+    j = checksum_sizes[i] / 3;
+    CHECK(lodepng_adler32_combine(lodepng_adler32(buf, j), lodepng_adler32(buf + j, checksum_sizes[i] - j),
+                                  checksum_sizes[i] - j) == lodepng_adler32(buf, checksum_sizes[i]));
+  }
+  free(buf);
+}
+
+static void test_crc32(void)
+{
+  size_t size = 300000 + 64, i, offset;
+  unsigned char* buf = (unsigned char*)malloc(size);
+  random_state = 5;
+  for(i = 0; i < size; i++) buf[i] = (unsigned char)random_next();
+
+  CHECK(lodepng_crc32((const unsigned char*)"123456789", 9) == 0xcbf43926u);
+  for(i = 0; i < sizeof(checksum_sizes) / sizeof(checksum_sizes[0]); i++)
+  {
+    for(offset = 0; offset < 64; offset += 7)
+    {
+      CHECK(lodepng_crc32(buf + offset, checksum_sizes[i]) == reference_crc32(buf + offset, checksum_sizes[i]));
+    }
+  }
+  free(buf);
+}
+
+int main(void)
+{
+  test_inflate_zlib();
+  test_inflate_roundtrip();
+  test_inflate_corrupt();
+  test_adler32();
+  test_crc32();
+  test_levels();
+  if(failed)
+  {
+    fprintf(stderr, "lodepng_test: %d checks failed\n", failed);
+    return 1;
+  }
+  printf("lodepng_test: ok\n");
+  return 0;
+}
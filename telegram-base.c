@@ -34,10 +34,12 @@
 #include <openssl/sha.h>
 
 #include "telegram-purple.h"
+#include "telegram-base.h"
 #include "msglog.h"
 #include "tgp-2prpl.h"
 #include "tgp-structs.h"
 #include "lodepng/lodepng.h"
+#include "tgp-png.h"
 
 
 #define DC_SERIALIZED_MAGIC 0x868aa81d
@@ -45,9 +47,32 @@
 #define SECRET_CHAT_FILE_MAGIC 0x37a1988a
 
 
-void read_state_file (struct tgl_state *TLS) {
+/*
+ * Keys, update state and secret chats are only valid for the servers they
+ * were created with, so test mode and a custom server each get their own
+ * set of files next to the regular ones.
+ */
+static char *server_file_name (struct tgl_state *TLS, const char *file) {
+  const char *server = purple_account_get_string (tg_get_acc (TLS), "server", "");
   char *name = 0;
-  if (asprintf (&name, "%s/%s", TLS->base_path, "state") < 0) {
+  int r;
+  if (server && *server) {
+    char *s = g_strdelimit (g_strdup (server), "/", '_');
+    r = asprintf (&name, "%s/%s-%s-%d", TLS->base_path, file, s,
+        purple_account_get_int (tg_get_acc (TLS), "server-port", 443));
+    g_free (s);
+  } else if (TLS->test_mode) {
+    r = asprintf (&name, "%s/%s-test", TLS->base_path, file);
+  } else {
+    r = asprintf (&name, "%s/%s", TLS->base_path, file);
+  }
+  return r < 0 ? 0 : name;
+}
+
+
+void read_state_file (struct tgl_state *TLS) {
+  char *name = server_file_name (TLS, "state");
+  if (!name) {
     return;
   }
 
@@ -84,8 +109,8 @@ void write_state_file (struct tgl_state *TLS) {
   int wdate;
   wseq = TLS->seq; wpts = TLS->pts; wqts = TLS->qts; wdate = TLS->date;
   
-  char *name = 0;
-  if (asprintf (&name, "%s/%s", TLS->base_path, "state") < 0) {
+  char *name = server_file_name (TLS, "state");
+  if (!name) {
     return;
   }
 
@@ -128,8 +153,8 @@ void write_dc (struct tgl_dc *DC, void *extra) {
 }
 
 void write_auth_file (struct tgl_state *TLS) {
-  char *name = 0;
-  if (asprintf (&name, "%s/%s", TLS->base_path, "auth") < 0) {
+  char *name = server_file_name (TLS, "auth");
+  if (!name) {
     return;
   }
   int auth_file_fd = open (name, O_CREAT | O_RDWR, 0600);
@@ -177,7 +202,13 @@ int error_if_val_false (struct tgl_state *TLS, int val, const char *msg) {
 }
 
 void empty_auth_file (struct tgl_state *TLS) {
-  if (TLS->test_mode) {
+  const char *server = purple_account_get_string (tg_get_acc (TLS), "server", "");
+  if (server && *server) {
+    // single local server, e.g. a stand-in for load and latency testing
+    int port = purple_account_get_int (tg_get_acc (TLS), "server-port", 443);
+    bl_do_dc_option (TLS, 1, 0, "", strlen (server), server, port);
+    bl_do_set_working_dc (TLS, 1);
+  } else if (TLS->test_mode) {
     bl_do_dc_option (TLS, 1, 0, "", strlen (TG_SERVER_TEST_1), TG_SERVER_TEST_1, 443);
     bl_do_dc_option (TLS, 2, 0, "", strlen (TG_SERVER_TEST_2), TG_SERVER_TEST_2, 443);
     bl_do_dc_option (TLS, 3, 0, "", strlen (TG_SERVER_TEST_3), TG_SERVER_TEST_3, 443);
@@ -193,8 +224,8 @@ void empty_auth_file (struct tgl_state *TLS) {
 }
 
 void read_auth_file (struct tgl_state *TLS) {
-  char *name = 0;
-  if (asprintf (&name, "%s/%s", TLS->base_path, "auth") < 0) {
+  char *name = server_file_name (TLS, "auth");
+  if (!name) {
     return;
   }
   int auth_file_fd = open (name, O_CREAT | O_RDWR, 0600);
@@ -267,8 +298,8 @@ void write_secret_chat (tgl_peer_t *_P, void *extra) {
 }
 
 void write_secret_chat_file (struct tgl_state *TLS) {
-  char *name = 0;
-  if (asprintf (&name, "%s/%s", TLS->base_path, "secret") < 0) {
+  char *name = server_file_name (TLS, "secret");
+  if (!name) {
     return;
   }
   int secret_chat_fd = open (name, O_CREAT | O_RDWR, 0600);
@@ -342,8 +373,8 @@ void read_secret_chat (struct tgl_state *TLS, int fd, int v) {
 }
 
 void read_secret_chat_file (struct tgl_state *TLS) {
-  char *name = 0;
-  if (asprintf (&name, "%s/%s", TLS->base_path, "secret") < 0) {
+  char *name = server_file_name (TLS, "secret");
+  if (!name) {
     return;
   }
   
@@ -367,22 +398,157 @@ void read_secret_chat_file (struct tgl_state *TLS) {
 }
 
 void telegram_export_authorization (struct tgl_state *TLS);
+
+struct export_auth_join {
+  int pending;
+  int failed;
+  double start;
+};
+
 void export_auth_callback (struct tgl_state *TLS, void *extra, int success) {
-  if (!error_if_val_false(TLS, success, "Authentication Export failed.")) {
+  struct export_auth_join *J = extra;
+  if (!success) {
+    J->failed = 1;
+  }
+  if (-- J->pending > 0) {
+    return;
+  }
+  int failed = J->failed;
+  debug ("login: exported authorization in %.3f seconds\n", tglt_get_double_time () - J->start);
+  free (J);
+  if (!error_if_val_false(TLS, !failed, "Authentication Export failed.")) {
     telegram_export_authorization (TLS);
   }
 }
 
+static int lazy_dcs (struct tgl_state *TLS) {
+  return purple_account_get_bool (tg_get_acc (TLS), "lazy-dc", FALSE);
+}
+
 void telegram_export_authorization (struct tgl_state *TLS) {
+  struct export_auth_join *J = NULL;
   int i;
   for (i = 0; i <= TLS->max_dc_num; i++) if (TLS->DC_list[i] && !tgl_signed_dc (TLS, TLS->DC_list[i])) {
-    tgl_do_export_auth (TLS, i, export_auth_callback, (void*)(long)TLS->DC_list[i]);    
+    if (lazy_dcs (TLS) && TLS->DC_list[i] != TLS->DC_working) {
+      // exported by telegram_load_photo when needed
+      continue;
+    }
+    if (!J) {
+      // export to all DCs at once, the extra reference is held until all queries are sent
+      J = malloc (sizeof (*J));
+      J->pending = 1;
+      J->failed = 0;
+      J->start = tglt_get_double_time ();
+    }
+    J->pending ++;
+    tgl_do_export_auth (TLS, i, export_auth_callback, J);
+  }
+  if (J) {
+    export_auth_callback (TLS, J, 1);
     return;
   }
+  connection_data *conn = TLS->ev_base;
+  debug ("login: authorization exported after %.3f seconds\n", tglt_get_double_time () - conn->login_start);
   write_auth_file (TLS);
   on_ready (TLS);
 }
 
+// only the file locations are copied, enough to load the photo later
+void telegram_photo_copy (struct tgl_photo *to, const struct tgl_photo *from) {
+  *to = *from;
+  to->caption = NULL;
+  to->sizes = g_memdup (from->sizes, sizeof (*from->sizes) * from->sizes_num);
+  int i;
+  for (i = 0; i < from->sizes_num; i++) {
+    to->sizes[i].type = NULL;
+    to->sizes[i].data = NULL;
+  }
+}
+
+void telegram_photo_copy_free (struct tgl_photo *photo) {
+  g_free (photo->sizes);
+}
+
+struct dc_waiting {
+  int dc;
+  // a copy, the message or peer holding the photo can go away while the export runs
+  struct tgl_photo photo;
+  void (*callback) (struct tgl_state *TLS, void *extra, int success, char *filename);
+  void *extra;
+};
+
+static void dc_waiting_free (struct dc_waiting *W) {
+  telegram_photo_copy_free (&W->photo);
+  g_free (W);
+}
+
+// drops the photos that still wait for an export when the account is closed, without running
+// their callbacks, the downloads they belong to are freed by tgp_downloads_free
+void telegram_dc_waiting_free (struct tgl_state *TLS) {
+  connection_data *conn = TLS->ev_base;
+  g_queue_free_full (conn->dc_waiting, (GDestroyNotify) dc_waiting_free);
+  conn->dc_waiting = NULL;
+}
+
+static void lazy_export_callback (struct tgl_state *TLS, void *extra, int success) {
+  connection_data *conn = TLS->ev_base;
+  int dc = GPOINTER_TO_INT(extra);
+  debug ("lazy_export_callback(dc=%d, success=%d)\n", dc, success);
+  if (success) {
+    write_auth_file (TLS);
+  }
+
+  GList *l = conn->dc_waiting->head;
+  while (l) {
+    struct dc_waiting *W = l->data;
+    GList *next = l->next;
+    if (W->dc == dc) {
+      g_queue_delete_link (conn->dc_waiting, l);
+      if (success) {
+        telegram_load_photo (TLS, &W->photo, W->callback, W->extra);
+      } else {
+        W->callback (TLS, W->extra, 0, NULL);
+      }
+      dc_waiting_free (W);
+    }
+    l = next;
+  }
+}
+
+void telegram_load_photo (struct tgl_state *TLS, struct tgl_photo *photo,
+    void (*callback) (struct tgl_state *TLS, void *extra, int success, char *filename), void *extra) {
+  connection_data *conn = TLS->ev_base;
+  int i;
+  for (i = 0; i < photo->sizes_num; i++) {
+    int dc = photo->sizes[i].loc.dc;
+    if (dc < 0 || dc > TLS->max_dc_num || !TLS->DC_list[dc] || tgl_signed_dc (TLS, TLS->DC_list[dc])) {
+      continue;
+    }
+
+    // only export once, no matter how many downloads are waiting for the same DC
+    int exporting = 0;
+    GList *l;
+    for (l = conn->dc_waiting->head; l; l = l->next) {
+      if (((struct dc_waiting *)l->data)->dc == dc) {
+        exporting = 1;
+        break;
+      }
+    }
+    struct dc_waiting *W = g_new0 (struct dc_waiting, 1);
+    W->dc = dc;
+    telegram_photo_copy (&W->photo, photo);
+    W->callback = callback;
+    W->extra = extra;
+    g_queue_push_tail (conn->dc_waiting, W);
+    if (!exporting) {
+      debug ("exporting authorization to dc %d on demand\n", dc);
+      tgl_do_export_auth (TLS, dc, lazy_export_callback, GINT_TO_POINTER(dc));
+    }
+    return;
+  }
+  tgl_do_load_photo (TLS, photo, callback, extra);
+}
+
 static void request_code (struct tgl_state *TLS);
 static void request_name_and_code (struct tgl_state *TLS);
 static void code_receive_result (struct tgl_state *TLS, void *extra, int success, struct tgl_user *U) {
@@ -497,16 +663,20 @@ static void sign_in_callback (struct tgl_state *TLS, void *extra, int success, i
 }
 
 static void telegram_send_sms (struct tgl_state *TLS) {
+  connection_data *conn = TLS->ev_base;
   if (tgl_signed_dc (TLS, TLS->DC_working)) {
     telegram_export_authorization (TLS);
     return;
   }
-  connection_data *conn = TLS->ev_base;
+  debug ("login: requesting code after %.3f seconds\n", tglt_get_double_time () - conn->login_start);
   char const *username = purple_account_get_username(conn->pa);
   tgl_do_send_code (TLS, username, sign_in_callback, 0);
 }
 
 static int all_authorized (struct tgl_state *TLS) {
+  if (lazy_dcs (TLS)) {
+    return TLS->DC_working && tgl_authorized_dc (TLS, TLS->DC_working);
+  }
   int i;
   for (i = 0; i <= TLS->max_dc_num; i++) if (TLS->DC_list[i]) {
     if (!tgl_authorized_dc (TLS, TLS->DC_list[i])) {
@@ -516,17 +686,29 @@ static int all_authorized (struct tgl_state *TLS) {
   return 1;
 }
 
-static int check_all_authorized (gpointer arg) {
+static int login_authorized (gpointer arg) {
   struct tgl_state *TLS = arg;
-  if (all_authorized (TLS)) {
-    telegram_send_sms (TLS);    
-    return FALSE;
-  } else {
-    return TRUE;
+  connection_data *conn = TLS->ev_base;
+  conn->login_ev = 0;
+  telegram_send_sms (TLS);
+  return FALSE;
+}
+
+static void check_all_authorized (struct tgl_state *TLS) {
+  connection_data *conn = TLS->ev_base;
+  if (!all_authorized (TLS)) {
+    return;
   }
+  conn->on_rpc_read = NULL;
+  debug ("login: all DCs authorized after %.3f seconds\n", tglt_get_double_time () - conn->login_start);
+
+  // leave the frame handler of libtgl before sending the first query
+  conn->login_ev = purple_timeout_add (0, login_authorized, TLS);
 }
     
 void telegram_login (struct tgl_state *TLS) {    
+  connection_data *conn = TLS->ev_base;
+  conn->login_start = tglt_get_double_time ();
   read_auth_file (TLS);
   read_state_file (TLS);
   read_secret_chat_file (TLS);
@@ -534,7 +716,8 @@ void telegram_login (struct tgl_state *TLS) {
     telegram_send_sms (TLS);
     return;
   }
-  purple_timeout_add (100, check_all_authorized, TLS);
+  debug ("login: waiting for DC authorization\n");
+  conn->on_rpc_read = check_all_authorized;
 }
 
 PurpleConversation *chat_show (PurpleConnection *gc, int id) {
@@ -632,7 +815,7 @@ int generate_ident_icon (struct tgl_state *TLS, unsigned char* sha1_key)
   }
   unsigned char* png;
   size_t pngsize;
-  unsigned error = lodepng_encode32(&png, &pngsize, image, img_size, img_size);
+  unsigned error = tgp_png_encode32(&png, &pngsize, image, img_size, img_size, LCL_FAST);
   int imgStoreId = -1;
   if(!error)
   {
@@ -30,6 +30,11 @@ void read_secret_chat_file (struct tgl_state *TLS);
 void write_secret_chat_file (struct tgl_state *TLS);
 
 void telegram_login (struct tgl_state *TLS);
+void telegram_load_photo (struct tgl_state *TLS, struct tgl_photo *photo,
+    void (*callback) (struct tgl_state *TLS, void *extra, int success, char *filename), void *extra);
+void telegram_dc_waiting_free (struct tgl_state *TLS);
+void telegram_photo_copy (struct tgl_photo *to, const struct tgl_photo *from);
+void telegram_photo_copy_free (struct tgl_photo *photo);
 PurpleConversation *chat_show (PurpleConnection *gc, int id);
 int chat_add_message (struct tgl_state *TLS, struct tgl_message *M, char *text);
 void chat_add_all_users (PurpleConversation *pc, struct tgl_chat *chat);
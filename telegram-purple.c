@@ -57,6 +57,7 @@
 #include "tgp-2prpl.h"
 #include "tgp-net.h"
 #include "tgp-timers.h"
+#include "tgp-download.h"
 #include "telegram-base.h"
 #include "telegram-purple.h"
 #include "msglog.h"
@@ -320,13 +321,72 @@ static void on_update_chat_participants (struct tgl_state *TLS, struct tgl_chat
   }
 }
 
-static void on_update_new_user_status (struct tgl_state *TLS, void *peer) __attribute__ ((unused));
-static void on_update_new_user_status (struct tgl_state *TLS, void *peer) {
-  tgl_peer_t *p = peer;
-  p2tgl_prpl_got_user_status(TLS, p->id, &p->user.status);
+/*
+  Presence changes are collected and applied at most once per presence interval. Only the
+  latest status of each user is applied, and only if it differs from the one applied before.
+  The applied status is only remembered for users in the buddy list, it is dropped again when
+  the buddy is removed.
+*/
+static int presence_flush (gpointer arg) {
+  struct tgl_state *TLS = arg;
+  connection_data *conn = TLS->ev_base;
+  conn->presence_ev = 0;
+  
+  int applied = 0, unchanged = 0;
+  GHashTableIter iter;
+  gpointer id;
+  g_hash_table_iter_init (&iter, conn->presence_pending);
+  while (g_hash_table_iter_next (&iter, &id, NULL)) {
+    tgl_peer_t *U = tgl_peer_get (TLS, TGL_MK_USER (GPOINTER_TO_INT(id)));
+    if (!U || !p2tgl_buddy_find (TLS, U->id)) {
+      // libpurple ignores the status of users that are not buddies
+      g_hash_table_remove (conn->presence_last, id);
+      continue;
+    }
+    struct tgl_user_status *last = g_hash_table_lookup (conn->presence_last, id);
+    if (last && last->online == U->user.status.online && last->when == U->user.status.when) {
+      unchanged ++;
+      continue;
+    }
+    if (!last) {
+      last = g_new (struct tgl_user_status, 1);
+      g_hash_table_insert (conn->presence_last, id, last);
+    }
+    *last = U->user.status;
+    p2tgl_prpl_got_user_status (TLS, U->id, &U->user.status);
+    applied ++;
+  }
+  g_hash_table_remove_all (conn->presence_pending);
+  
+  conn->presence_unchanged += unchanged;
+  debug ("presence: %d applied, %d unchanged, %d superseded (total %d unchanged, %d superseded)\n", applied,
+      unchanged, conn->presence_batch_superseded, conn->presence_unchanged, conn->presence_superseded);
+  conn->presence_batch_superseded = 0;
+  return FALSE;
+}
+
+static void presence_push (struct tgl_state *TLS, struct tgl_user *U) {
+  connection_data *conn = TLS->ev_base;
+  gpointer id = GINT_TO_POINTER(tgl_get_peer_id (U->id));
+  if (g_hash_table_contains (conn->presence_pending, id)) {
+    conn->presence_superseded ++;
+    conn->presence_batch_superseded ++;
+    return;
+  }
+  g_hash_table_add (conn->presence_pending, id);
+  if (!conn->presence_ev) {
+    conn->presence_ev = purple_timeout_add (conn->presence_interval, presence_flush, TLS);
+  }
+}
+
+static void update_user_status (struct tgl_state *TLS, struct tgl_user *U) {
+  if (TLS->our_id != tgl_get_peer_id (U->id)) {
+    presence_push (TLS, U);
+  }
 }
 
 static void update_message_received (struct tgl_state *TLS, struct tgl_message *M);
+static void buddy_sync_apply (struct tgl_state *TLS, tgl_peer_id_t id);
 static void update_user_handler (struct tgl_state *TLS, struct tgl_user *U, unsigned flags);
 static void update_chat_handler (struct tgl_state *TLS, struct tgl_chat *C, unsigned flags);
 static void update_secret_chat_handler (struct tgl_state *TLS, struct tgl_secret_chat *C, unsigned flags);
@@ -339,20 +399,25 @@ struct tgl_update_callback tgp_callback = {
   .chat_update = update_chat_handler,
   .secret_chat_update = update_secret_chat_handler,
   .type_notification = update_user_typing,
+  .status_notification = update_user_status,
   .create_print_name = format_print_name
 };
 
 void on_message_load_photo (struct tgl_state *TLS, void *extra, int success, char *filename) {
   connection_data *conn = TLS->ev_base;
   
-  gchar *data = NULL;
-  size_t len;
-  GError *err = NULL;
-  g_file_get_contents (filename, &data, &len, &err);
-  int imgStoreId = purple_imgstore_add_with_id (g_memdup(data, (guint)len), len, NULL);
-  used_images_add (conn, imgStoreId);
-  
-  char *image = format_img_full (imgStoreId);
+  char *image;
+  if (success) {
+    gchar *data = NULL;
+    size_t len;
+    GError *err = NULL;
+    g_file_get_contents (filename, &data, &len, &err);
+    int imgStoreId = purple_imgstore_add_with_id (g_memdup(data, (guint)len), len, NULL);
+    used_images_add (conn, imgStoreId);
+    image = format_img_full (imgStoreId);
+  } else {
+    image = g_strdup ("[photo]");
+  }
   struct tgl_message *M = extra;
   switch (tgl_get_peer_type (M->to_id)) {
     case TGL_PEER_CHAT:
@@ -377,12 +442,28 @@ void on_message_load_photo (struct tgl_state *TLS, void *extra, int success, cha
   conn->updated = 1;
 }
 
+static int conversation_is_open (struct tgl_state *TLS, tgl_peer_id_t peer) {
+  connection_data *conn = TLS->ev_base;
+  if (tgl_get_peer_type (peer) == TGL_PEER_CHAT) {
+    return purple_find_chat (conn->gc, tgl_get_peer_id (peer)) != NULL;
+  }
+  char name[16];
+  g_snprintf (name, sizeof (name), "%d", tgl_get_peer_id (peer));
+  return purple_find_conversation_with_account (PURPLE_CONV_TYPE_IM, name, conn->pa) != NULL;
+}
+
 static void update_message_received (struct tgl_state *TLS, struct tgl_message *M) {
   debug ("received message\n");
   connection_data *conn = TLS->ev_base;
   conn->updated = 1;
+  // users still waiting in the startup sync get their buddy before the message is shown
+  buddy_sync_apply (TLS, M->from_id);
+  buddy_sync_apply (TLS, M->to_id);
 
   if (M->service) {
+    if (recent_messages_seen (&conn->recent, M->id)) {
+      return;
+    }
     debug ("service message, skipping...\n");
     char *text = format_service_msg (TLS, M);
     if (text) {
@@ -404,13 +485,24 @@ static void update_message_received (struct tgl_state *TLS, struct tgl_message *
   if ((M->flags & (FLAG_MESSAGE_EMPTY | FLAG_DELETED)) || !(M->flags & FLAG_CREATED)) {
     return;
   }
+  // new_msg and msg_receive both end up here, and get_difference may repeat messages
+  if (recent_messages_seen (&conn->recent, M->id)) {
+    debug ("message %lld already delivered\n", M->id);
+    return;
+  }
   if (!tgl_get_peer_type (M->to_id)) {
     warning ("Bad msg\n");
     return;
   }
 
   if (M->media.type == tgl_message_media_photo) {
-    tgl_do_load_photo (TLS, &M->media.photo, on_message_load_photo, M);
+    tgl_peer_id_t peer = M->to_id;
+    if (tgl_get_peer_type (peer) == TGL_PEER_USER && !out_msg (TLS, M)) {
+      peer = M->from_id;
+    }
+    tgp_download_photo (TLS, &M->media.photo,
+        conversation_is_open (TLS, peer) ? TGP_DOWNLOAD_CONVERSATION : TGP_DOWNLOAD_MESSAGE,
+        peer, on_message_load_photo, M);
     return;
   }
 
@@ -452,31 +544,204 @@ static void update_message_received (struct tgl_state *TLS, struct tgl_message *
   g_free (text);
 }
 
+/*
+  Userpics are not loaded when they change, but when the buddy is first shown in a tooltip,
+  info dialog or conversation. The rest trickles in while no other downloads are running.
+*/
+#define AVATAR_TRICKLE_INTERVAL 2
+
+static void avatar_fetch (struct tgl_state *TLS, tgl_peer_id_t id) {
+  connection_data *conn = TLS->ev_base;
+  if (!g_hash_table_remove (conn->avatar_pending, GINT_TO_POINTER(tgl_get_peer_id (id)))) {
+    return;
+  }
+  get_user_info_data* info_data = malloc (sizeof(get_user_info_data));
+  info_data->show_info = 0;
+  info_data->peer = 0;
+  tgl_do_get_user_info (TLS, id, 0, on_user_get_info, info_data);
+}
+
+static int avatar_trickle (gpointer arg) {
+  struct tgl_state *TLS = arg;
+  connection_data *conn = TLS->ev_base;
+  if (tgp_downloads_pending (conn->downloads)) {
+    return TRUE;
+  }
+  GHashTableIter iter;
+  gpointer id;
+  g_hash_table_iter_init (&iter, conn->avatar_pending);
+  if (g_hash_table_iter_next (&iter, &id, NULL)) {
+    avatar_fetch (TLS, TGL_MK_USER (GPOINTER_TO_INT(id)));
+  }
+  if (!g_hash_table_size (conn->avatar_pending)) {
+    conn->avatar_ev = 0;
+    return FALSE;
+  }
+  return TRUE;
+}
+
+static void avatar_request (struct tgl_state *TLS, tgl_peer_id_t id) {
+  connection_data *conn = TLS->ev_base;
+  g_hash_table_add (conn->avatar_pending, GINT_TO_POINTER(tgl_get_peer_id (id)));
+  if (!conn->avatar_ev) {
+    conn->avatar_ev = purple_timeout_add_seconds (AVATAR_TRICKLE_INTERVAL, avatar_trickle, TLS);
+  }
+}
+
+static void on_conversation_created (PurpleConversation *conv, gpointer data) {
+  connection_data *conn = data;
+  if (purple_conversation_get_account (conv) != conn->pa ||
+      purple_conversation_get_type (conv) != PURPLE_CONV_TYPE_IM) {
+    return;
+  }
+  avatar_fetch (conn->TLS, TGL_MK_USER (atoi (purple_conversation_get_name (conv))));
+}
+
+// convo_closed is only called for IMs, the signal comes for chats too
+static void on_conversation_deleting (PurpleConversation *conv, gpointer data) {
+  connection_data *conn = data;
+  if (purple_conversation_get_account (conv) != conn->pa) {
+    return;
+  }
+  if (purple_conversation_get_type (conv) == PURPLE_CONV_TYPE_CHAT) {
+    tgp_download_demote_peer (conn->TLS, TGL_MK_CHAT (purple_conv_chat_get_id (purple_conversation_get_chat_data (conv))));
+  } else if (purple_conversation_get_type (conv) == PURPLE_CONV_TYPE_IM) {
+    tgp_download_demote_peer (conn->TLS, TGL_MK_USER (atoi (purple_conversation_get_name (conv))));
+  }
+}
+
+static void update_user_apply (struct tgl_state *TLS, struct tgl_user *user, unsigned flags) {
+  connection_data *conn = TLS->ev_base;
+  PurpleBuddy *buddy = p2tgl_buddy_find (TLS, user->id);
+  if (!buddy) {
+    buddy = p2tgl_buddy_new (TLS, (tgl_peer_t *)user);
+    purple_blist_add_buddy (buddy, NULL, tggroup, NULL);
+    // a new buddy starts offline, whatever was applied before
+    g_hash_table_remove (conn->presence_last, GINT_TO_POINTER(tgl_get_peer_id (user->id)));
+  }
+  if (flags & TGL_UPDATE_CREATED) {
+    purple_buddy_set_protocol_data (buddy, (gpointer)user);
+    presence_push (TLS, user);
+    p2tgl_buddy_set_alias (TLS, buddy, (tgl_peer_t *)user, flags);
+  }
+  if (flags & TGL_UPDATE_PHOTO) {
+    avatar_request (TLS, user->id);
+  }
+  if (flags & TGL_UPDATE_DELETED && buddy) {
+    g_hash_table_remove (conn->presence_last, GINT_TO_POINTER(tgl_get_peer_id (user->id)));
+    purple_blist_remove_buddy (buddy);
+  }
+}
+
+/*
+  During the startup sync, user updates are collected into a batch and applied to the buddy
+  list from the main loop, so a user that changes several times within the sync is only
+  touched once. The batch is applied in time slices, so that the UI stays responsive on
+  accounts with many contacts. Users with unread dialogs go first, followed by recently
+  active dialogs, and a user is applied right away when a message or secret chat needs the
+  buddy. After the sync, updates are applied as they come.
+*/
+#define BUDDY_SYNC_SLICE 0.01
+
+static int buddy_sync_run (gpointer arg) {
+  struct tgl_state *TLS = arg;
+  connection_data *conn = TLS->ev_base;
+  double start = tglt_get_double_time ();
+  int n = 0;
+
+  while (n % 16 || tglt_get_double_time () - start < BUDDY_SYNC_SLICE) {
+    gpointer id = g_queue_pop_head (conn->sync_priority);
+    if (!id) {
+      id = g_queue_pop_head (conn->sync_queue);
+    }
+    if (!id) {
+      break;
+    }
+    gpointer flags;
+    if (!g_hash_table_lookup_extended (conn->sync_flags, id, NULL, &flags)) {
+      // already applied through the priority queue
+      continue;
+    }
+    g_hash_table_remove (conn->sync_flags, id);
+    tgl_peer_t *U = tgl_peer_get (TLS, TGL_MK_USER (GPOINTER_TO_INT(id)));
+    if (U) {
+      update_user_apply (TLS, &U->user, GPOINTER_TO_UINT(flags));
+    }
+    n ++;
+  }
+  conn->sync_done += n;
+  double t = tglt_get_double_time () - start;
+  debug ("buddy sync: %d users applied in %.3f ms (%.1f us per user)\n", n, t * 1e3, n ? t * 1e6 / n : 0);
+
+  if (!g_hash_table_size (conn->sync_flags)) {
+    g_queue_clear (conn->sync_priority);
+    g_queue_clear (conn->sync_queue);
+    if (conn->syncing) {
+      debug ("buddy sync: %d users added to the buddy list\n", conn->sync_done);
+    }
+    conn->sync_ev = 0;
+    return FALSE;
+  }
+  debug ("buddy sync: %d users done, %d pending\n", conn->sync_done, g_hash_table_size (conn->sync_flags));
+  return TRUE;
+}
+
+static void buddy_sync_push (struct tgl_state *TLS, struct tgl_user *user, unsigned flags) {
+  connection_data *conn = TLS->ev_base;
+  gpointer id = GINT_TO_POINTER(tgl_get_peer_id (user->id));
+  gpointer old;
+  if (g_hash_table_lookup_extended (conn->sync_flags, id, NULL, &old)) {
+    flags |= GPOINTER_TO_UINT(old);
+  } else {
+    g_queue_push_tail (conn->sync_queue, id);
+  }
+  g_hash_table_insert (conn->sync_flags, id, GUINT_TO_POINTER(flags));
+  if (!conn->sync_ev) {
+    conn->sync_ev = purple_timeout_add (0, buddy_sync_run, TLS);
+  }
+}
+
+// removes the user from the batch, returns its pending flags or 0
+static unsigned buddy_sync_take (struct tgl_state *TLS, tgl_peer_id_t id) {
+  connection_data *conn = TLS->ev_base;
+  gpointer key = GINT_TO_POINTER(tgl_get_peer_id (id));
+  gpointer flags;
+  if (tgl_get_peer_type (id) != TGL_PEER_USER || !g_hash_table_lookup_extended (conn->sync_flags, key, NULL, &flags)) {
+    return 0;
+  }
+  g_hash_table_remove (conn->sync_flags, key);
+  conn->sync_done ++;
+  return GPOINTER_TO_UINT(flags);
+}
+
+// applies the pending update of the user now, if there is one
+static void buddy_sync_apply (struct tgl_state *TLS, tgl_peer_id_t id) {
+  unsigned flags = buddy_sync_take (TLS, id);
+  tgl_peer_t *U = flags ? tgl_peer_get (TLS, id) : NULL;
+  if (U) {
+    update_user_apply (TLS, &U->user, flags);
+  }
+}
+
+static void buddy_sync_prioritize (struct tgl_state *TLS, tgl_peer_id_t id) {
+  connection_data *conn = TLS->ev_base;
+  gpointer key = GINT_TO_POINTER(tgl_get_peer_id (id));
+  if (tgl_get_peer_type (id) == TGL_PEER_USER && g_hash_table_contains (conn->sync_flags, key)) {
+    g_queue_push_tail (conn->sync_priority, key);
+  }
+}
+
 static void update_user_handler (struct tgl_state *TLS, struct tgl_user *user, unsigned flags) {
+  connection_data *conn = TLS->ev_base;
   if (TLS->our_id == tgl_get_peer_id (user->id)) {
     if (flags & TGL_UPDATE_NAME) {
       p2tgl_connection_set_display_name (TLS, (tgl_peer_t *)user);
     }
+  } else if (conn->syncing) {
+    buddy_sync_push (TLS, user, flags);
   } else {
-    PurpleBuddy *buddy = p2tgl_buddy_find (TLS, user->id);
-    if (!buddy) {
-      buddy = p2tgl_buddy_new (TLS, (tgl_peer_t *)user);
-      purple_blist_add_buddy (buddy, NULL, tggroup, NULL);
-    }
-    if (flags & TGL_UPDATE_CREATED) {
-      purple_buddy_set_protocol_data (buddy, (gpointer)user);
-      p2tgl_prpl_got_user_status (TLS, user->id, &user->status);
-      p2tgl_buddy_update (TLS, (tgl_peer_t *)user, flags);
-    }
-    if (flags & TGL_UPDATE_PHOTO) {
-      get_user_info_data* info_data = malloc (sizeof(get_user_info_data));
-      info_data->show_info = 0;
-      info_data->peer = 0;
-      tgl_do_get_user_info (TLS, user->id, 0, on_user_get_info, info_data);
-    }
-    if (flags & TGL_UPDATE_DELETED && buddy) {
-      purple_blist_remove_buddy (buddy);
-    }
+    // a user that is still in the batch of the startup sync is applied with this update
+    update_user_apply (TLS, user, flags | buddy_sync_take (TLS, user->id));
   }
 }
 
@@ -534,6 +799,7 @@ static void update_secret_chat_handler (struct tgl_state *TLS, struct tgl_secret
       tgl_do_accept_encr_chat_request (TLS, U, write_secret_chat_cb, 0);
       
     } else if (! strcmp(choice, "ask")) {
+      buddy_sync_apply (TLS, TGL_MK_USER(U->user_id));
       PurpleBuddy *who = p2tgl_buddy_find (TLS, TGL_MK_USER(U->user_id));
       
       struct accept_secret_chat_data *data = g_new (struct accept_secret_chat_data, 1);
@@ -545,7 +811,7 @@ static void update_secret_chat_handler (struct tgl_state *TLS, struct tgl_secret
       purple_request_accept_cancel (conn->gc, "Secret Chat", message, "Secret chats can only have one "
                                     "end point. If you accept a secret chat on this device, its messages will "
                                     "not be available anywhere else. If you decline, you can accept"
-                                    " the chat on other devices.", 0, conn->pa, who->name, NULL, data,
+                                    " the chat on other devices.", 0, conn->pa, who ? who->name : U->print_name, NULL, data,
                                     G_CALLBACK(accept_secret_chat_cb), G_CALLBACK(decline_secret_chat_cb));
       g_free (message);
     }
@@ -613,6 +879,9 @@ static void on_userpic_loaded (struct tgl_state *TLS, void *extra, int success,
     struct download_desc *dld = extra;
     struct tgl_user *U = dld->data;
     warning ("Can not load userpic for user %s %s\n", U->first_name, U->last_name);
+    g_free (dld->get_user_info_data);
+    free (dld);
+    return;
   }
   connection_data *conn = TLS->ev_base;
 
@@ -698,7 +967,8 @@ void on_user_get_info (struct tgl_state *TLS, void *info_data, int success, stru
     struct download_desc *dld = malloc (sizeof(struct download_desc));
     dld->data = U;
     dld->get_user_info_data = info_data;
-    tgl_do_load_photo (TLS, &U->photo, on_userpic_loaded, dld);
+    tgp_download_photo (TLS, &U->photo, user_info_data->show_info ? TGP_DOWNLOAD_CONVERSATION : TGP_DOWNLOAD_AVATAR,
+        U->id, on_userpic_loaded, dld);
   }
 }
 
@@ -733,6 +1003,38 @@ void on_chat_get_info (struct tgl_state *TLS, void *extra, int success, struct t
   g_free (name);
 }
 
+/*
+  Startup sync: the missed updates come first, then the dialog list, which decides the order
+  in which the buddy list is populated, and finally the contact list.
+*/
+static void on_contact_list_loaded (struct tgl_state *TLS, void *extra, int success, int size, struct tgl_user *list[]) {
+  connection_data *conn = TLS->ev_base;
+  debug ("startup: %d contacts loaded after %.3f seconds\n", size, tglt_get_double_time () - conn->sync_start);
+  conn->syncing = 0;
+}
+
+static void on_dialog_list_loaded (struct tgl_state *TLS, void *extra, int success, int size, tgl_peer_id_t peers[],
+    int last_msg_id[], int unread_count[]) {
+  connection_data *conn = TLS->ev_base;
+  debug ("startup: %d dialogs loaded after %.3f seconds\n", size, tglt_get_double_time () - conn->sync_start);
+  
+  // dialogs are ordered by recent activity
+  int i;
+  for (i = 0; i < size; i++) if (unread_count[i] > 0) {
+    buddy_sync_prioritize (TLS, peers[i]);
+  }
+  for (i = 0; i < size; i++) if (unread_count[i] <= 0) {
+    buddy_sync_prioritize (TLS, peers[i]);
+  }
+  tgl_do_update_contact_list (TLS, on_contact_list_loaded, 0);
+}
+
+static void on_get_difference_done (struct tgl_state *TLS, void *extra, int success) {
+  connection_data *conn = TLS->ev_base;
+  debug ("startup: difference loaded after %.3f seconds\n", tglt_get_double_time () - conn->sync_start);
+  tgl_do_get_dialog_list (TLS, on_dialog_list_loaded, 0);
+}
+
 void on_ready (struct tgl_state *TLS) {
   debug ("on_ready().\n");
   connection_data *conn = TLS->ev_base;
@@ -747,9 +1049,9 @@ void on_ready (struct tgl_state *TLS) {
   }
   
   debug ("seq = %d, pts = %d\n", TLS->seq, TLS->pts);
-  tgl_do_get_difference (TLS, 0, 0, 0);
-  tgl_do_get_dialog_list (TLS, 0, 0);
-  tgl_do_update_contact_list (TLS, 0, 0);
+  conn->syncing = 1;
+  conn->sync_start = tglt_get_double_time ();
+  tgl_do_get_difference (TLS, 0, on_get_difference_done, 0);
   
   conn->timer = purple_timeout_add (5000, queries_timerfunc, conn);
 }
@@ -771,6 +1073,7 @@ static void tgprpl_tooltip_text (PurpleBuddy * buddy, PurpleNotifyUserInfo * inf
     warning ("tgprpl_tooltip_text: warning peer with id %d not found in tree.\n", peer->id);
     return;
   }
+  avatar_fetch (get_conn_from_buddy (buddy)->TLS, P->id);
   purple_notify_user_info_add_pair_plaintext (info, "Status", format_status(&P->user.status));
   purple_notify_user_info_add_pair_plaintext (info, "Last seen: ", format_time(P->user.status.when));
 }
@@ -847,15 +1150,44 @@ static void tgprpl_login (PurpleAccount * acct) {
   sprintf (ddir, "%s/downloads", TLS->base_path);
   tgl_set_download_directory (TLS, ddir);
   g_mkdir_with_parents(ddir, 0700);
-  free (ddir);
   
   tgl_set_verbosity (TLS, 4);
-  tgl_set_rsa_key (TLS, pk_path);
+  const char *pk = purple_account_get_string (acct, "public-key", pk_path);
+  tgl_set_rsa_key (TLS, (pk && *pk) ? pk : pk_path);
+  if (purple_account_get_bool (acct, "test-mode", FALSE)) {
+    tgl_set_test_mode (TLS);
+  }
   
   // create handle to store additional info for libpurple in
   // the new telegram instance
   connection_data *conn = connection_data_init (TLS, gc, acct);
   purple_connection_set_protocol_data (gc, conn);
+  tgp_downloads_open_cache (conn->downloads, ddir, (long long)purple_account_get_int (acct, "cache-size", 512) << 20);
+  free (ddir);
+  purple_signal_connect (purple_conversations_get_handle (), "conversation-created", conn,
+      PURPLE_CALLBACK(on_conversation_created), conn);
+  purple_signal_connect (purple_conversations_get_handle (), "deleting-conversation", conn,
+      PURPLE_CALLBACK(on_conversation_deleting), conn);
+#ifdef TGP_NET_URING
+  if (purple_account_get_bool (acct, "net-io-uring", TRUE)) {
+    conn->uring = tgln_uring_new ();
+    if (!conn->uring) {
+      warning ("io_uring not available, using poll\n");
+    }
+  }
+#endif
+  conn->presence_interval = purple_account_get_int (acct, "presence-interval", 250);
+  if (conn->presence_interval < 0) {
+    conn->presence_interval = 0;
+  }
+  const char *capture = purple_account_get_string (acct, "capture-file", "");
+  if (capture && *capture) {
+    conn->capture = tgln_capture_new (capture);
+  }
+  const char *replay = purple_account_get_string (acct, "replay-file", "");
+  if (replay && *replay) {
+    conn->replay = tgln_replay_new (replay, purple_account_get_bool (acct, "replay-fast", FALSE));
+  }
   
   tgl_set_ev_base (TLS, conn);
   tgl_set_net_methods (TLS, &tgp_conn_methods);
@@ -939,6 +1271,8 @@ static void tgprpl_get_info (PurpleConnection * gc, const char *who) {
   switch (tgl_get_peer_type (peer->id)) {
     case TGL_PEER_USER:
     case TGL_PEER_CHAT:
+      // loads the userpic as well
+      g_hash_table_remove (conn->avatar_pending, GINT_TO_POINTER(tgl_get_peer_id (peer->id)));
       tgl_do_get_user_info (conn->TLS, peer->id, 0, on_user_get_info, info_data);
       break;
     case TGL_PEER_ENCR_CHAT: {
@@ -1005,6 +1339,7 @@ static void tgprpl_remove_buddy (PurpleConnection * gc, PurpleBuddy * buddy, Pur
       bl_do_encr_chat_delete (conn->TLS, &peer->encr_chat);
       break;
     case TGL_PEER_USER:
+      g_hash_table_remove (conn->presence_last, GINT_TO_POINTER(tgl_get_peer_id (peer->id)));
       tgl_do_del_contact (conn->TLS, peer->id, NULL, NULL);
       break;
   }
@@ -1231,6 +1566,42 @@ static void tgprpl_init (PurplePlugin *plugin) {
   opt = purple_account_option_bool_new("Fallback SMS verification", "compat-verification", 0);
   prpl_info.protocol_options = g_list_append(prpl_info.protocol_options, opt);
   
+#ifdef TGP_NET_URING
+  opt = purple_account_option_bool_new("Use io_uring for network I/O", "net-io-uring", 1);
+  prpl_info.protocol_options = g_list_append(prpl_info.protocol_options, opt);
+#endif
+  
+  opt = purple_account_option_bool_new("Connect to media servers on demand", "lazy-dc", 0);
+  prpl_info.protocol_options = g_list_append(prpl_info.protocol_options, opt);
+  
+  opt = purple_account_option_int_new("Presence update interval (ms)", "presence-interval", 250);
+  prpl_info.protocol_options = g_list_append(prpl_info.protocol_options, opt);
+  
+  opt = purple_account_option_int_new("Download cache size (MB, 0 for no limit)", "cache-size", 512);
+  prpl_info.protocol_options = g_list_append(prpl_info.protocol_options, opt);
+  
+  opt = purple_account_option_bool_new("Use test servers", "test-mode", 0);
+  prpl_info.protocol_options = g_list_append(prpl_info.protocol_options, opt);
+  
+  // stored keys and state are kept apart per server, see server_file_name
+  opt = purple_account_option_string_new("Custom server", "server", "");
+  prpl_info.protocol_options = g_list_append(prpl_info.protocol_options, opt);
+  
+  opt = purple_account_option_int_new("Custom server port", "server-port", 443);
+  prpl_info.protocol_options = g_list_append(prpl_info.protocol_options, opt);
+  
+  opt = purple_account_option_string_new("Server public key", "public-key", pk_path);
+  prpl_info.protocol_options = g_list_append(prpl_info.protocol_options, opt);
+  
+  opt = purple_account_option_string_new("Capture network traffic to file", "capture-file", "");
+  prpl_info.protocol_options = g_list_append(prpl_info.protocol_options, opt);
+  
+  opt = purple_account_option_string_new("Replay network capture from file", "replay-file", "");
+  prpl_info.protocol_options = g_list_append(prpl_info.protocol_options, opt);
+  
+  opt = purple_account_option_bool_new("Replay capture as fast as possible", "replay-fast", 0);
+  prpl_info.protocol_options = g_list_append(prpl_info.protocol_options, opt);
+  
   _telegram_protocol = plugin;
 }
 
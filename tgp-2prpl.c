@@ -143,17 +143,24 @@ PurpleBuddy *p2tgl_buddy_new  (struct tgl_state *TLS, tgl_peer_t *user) {
   return b;
 }
 
+void p2tgl_buddy_set_alias (struct tgl_state *TLS, PurpleBuddy *b, tgl_peer_t *user, unsigned flags) {
+  if (flags & (TGL_UPDATE_NAME | TGL_UPDATE_REAL_NAME | TGL_UPDATE_USERNAME)) {
+    char *alias = p2tgl_strdup_alias (user);
+    // aliasing saves and redraws the buddy list, even if nothing changed
+    if (g_strcmp0 (alias, purple_buddy_get_alias_only (b))) {
+      debug ("Update username for id%d (name %s %s)\n", tgl_get_peer_id (user->id), user->user.first_name, user->user.last_name);
+      purple_blist_alias_buddy(b, alias);
+    }
+    g_free (alias);
+  }
+}
+
 PurpleBuddy *p2tgl_buddy_update (struct tgl_state *TLS, tgl_peer_t *user, unsigned flags) {
   PurpleBuddy *b = p2tgl_buddy_find (TLS, user->id);
   if (!b) {
     b = p2tgl_buddy_new (TLS, user);
   }
-  if (flags & (TGL_UPDATE_NAME | TGL_UPDATE_REAL_NAME | TGL_UPDATE_USERNAME)) {
-    debug ("Update username for id%d (name %s %s)\n", tgl_get_peer_id (user->id), user->user.first_name, user->user.last_name);
-    char *alias = p2tgl_strdup_alias (user);
-    purple_blist_alias_buddy(b, alias);
-    g_free (alias);
-  }
+  p2tgl_buddy_set_alias (TLS, b, user, flags);
   return b;
 }
 
@@ -174,36 +181,34 @@ void p2tgl_prpl_got_set_status_offline (struct tgl_state *TLS, tgl_peer_id_t use
 }
 
 void p2tgl_prpl_got_user_status (struct tgl_state *TLS, tgl_peer_id_t user, struct tgl_user_status *status) {
+  char name[16];
+  g_snprintf (name, sizeof (name), "%d", tgl_get_peer_id (user));
   
   if (status->online == 1) {
-    char *name = p2tgl_peer_strdup_id (user);
     purple_prpl_got_user_status (tg_get_acc(TLS), name, "available", NULL);
-    g_free (name);
   } else {
-    char *name = p2tgl_peer_strdup_id (user);
-    char *when;
+    char buf[16];
+    const char *when;
     switch (status->online) {
     case -1:
-      when = g_strdup_printf("%d", status->when);
+      g_snprintf (buf, sizeof (buf), "%d", status->when);
+      when = buf;
       break;
     case -2:
-      when = g_strdup_printf("recently");
+      when = "recently";
       break;
     case -3:
-      when = g_strdup_printf("last week");
+      when = "last week";
       break;
     case -4:
-      when = g_strdup_printf("last month");
+      when = "last month";
       break;
     default:
-      when = g_strdup ("unknown");
+      when = "unknown";
       break;
     }
   
     purple_prpl_got_user_status (tg_get_acc(TLS), name, "mobile", "last online", when, NULL);
-  
-    g_free(name);
-    g_free(when);
   }
 }
 
@@ -0,0 +1,212 @@
+/*
+    This file is part of telegram-purple
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111-1301  USA
+
+    Copyright Matthias Jentsch 2014
+*/
+
+/*
+  tgp-download-test.c: Tests the cache index of tgp-download.c, run by make check
+
+  The cache functions are static, so the file is included here. The few calls into the rest
+  of the plugin are replaced by the stand-ins below, no download is ever started.
+*/
+
+#include <assert.h>
+#include <utime.h>
+
+#include "tgp-download.c"
+
+static int failed;
+
+#define CHECK(cond) do { \
+    if (!(cond)) { \
+      fprintf (stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+      failed ++; \
+    } \
+  } while (0)
+
+void debug (const char *format, ...) {
+}
+
+void warning (const char *format, ...) {
+}
+
+void telegram_load_photo (struct tgl_state *TLS, struct tgl_photo *photo, tgp_download_cb callback, void *extra) {
+  assert (0);
+}
+
+void telegram_photo_copy (struct tgl_photo *to, const struct tgl_photo *from) {
+  memset (to, 0, sizeof (*to));
+}
+
+void telegram_photo_copy_free (struct tgl_photo *photo) {
+}
+
+// creates a file of size bytes in dir and returns its path
+static char *make_file (const char *dir, const char *name, int size, time_t mtime) {
+  char *path = g_build_filename (dir, name, NULL);
+  char *data = g_malloc0 (size);
+  assert (g_file_set_contents (path, data, size, NULL));
+  g_free (data);
+  struct utimbuf t = { mtime, mtime };
+  utime (path, &t);
+  return path;
+}
+
+static int cache_has (struct tgp_downloads *D, long long id) {
+  char *path = cache_lookup (D, id);
+  g_free (path);
+  return path != NULL;
+}
+
+// the cached file names, least recently used first
+static const char *lru_names (struct tgp_downloads *D) {
+  static char names[256];
+  names[0] = 0;
+  GList *l;
+  for (l = D->cache_lru->head; l; l = l->next) {
+    struct cache_entry *E = l->data;
+    if (names[0]) {
+      g_strlcat (names, " ", sizeof (names));
+    }
+    g_strlcat (names, E->name, sizeof (names));
+  }
+  return names;
+}
+
+static void remove_dir (const char *dir) {
+  GDir *d = g_dir_open (dir, 0, NULL);
+  const char *name;
+  while ((name = g_dir_read_name (d))) {
+    char *path = g_build_filename (dir, name, NULL);
+    g_unlink (path);
+    g_free (path);
+  }
+  g_dir_close (d);
+  g_rmdir (dir);
+}
+
+// the least recently used photo goes first, a lookup counts as a use
+static void test_lru (const char *dir) {
+  struct tgp_downloads *D = tgp_downloads_new ();
+  tgp_downloads_open_cache (D, dir, 100);
+
+  char *a = make_file (dir, "a", 40, 1000);
+  char *b = make_file (dir, "b", 40, 1000);
+  char *c = make_file (dir, "c", 40, 1000);
+  cache_add (D, 1, a);
+  cache_add (D, 2, b);
+  CHECK(D->cache_size == 80);
+  CHECK(cache_has (D, 1));
+
+  cache_add (D, 3, c);
+  CHECK(D->evictions == 1);
+  CHECK(D->cache_size == 80);
+  CHECK(!g_file_test (b, G_FILE_TEST_EXISTS));
+  CHECK(!cache_has (D, 2));
+  CHECK(cache_has (D, 1));
+  CHECK(cache_has (D, 3));
+  CHECK(D->hits == 3);
+  CHECK(D->misses == 1);
+
+  // adding the same photo again does not count it twice
+  cache_add (D, 3, c);
+  CHECK(D->cache_size == 80);
+  CHECK(g_queue_get_length (D->cache_lru) == 2);
+
+  // files outside of the cache directory are not managed
+  cache_add (D, 4, "/tmp/not-in-cache");
+  CHECK(!g_hash_table_contains (D->cache, &(long long){4}));
+
+  tgp_downloads_free (D);
+  g_free (a);
+  g_free (b);
+  g_free (c);
+}
+
+// a file removed behind the back of the cache is a miss and leaves the index
+static void test_missing_file (const char *dir) {
+  struct tgp_downloads *D = tgp_downloads_new ();
+  tgp_downloads_open_cache (D, dir, 0);
+
+  char *a = make_file (dir, "a", 40, 1000);
+  cache_add (D, 1, a);
+  g_unlink (a);
+  CHECK(!cache_has (D, 1));
+  CHECK(D->misses == 1);
+  CHECK(D->cache_size == 0);
+  CHECK(g_hash_table_size (D->cache) == 0);
+  CHECK(g_queue_get_length (D->cache_lru) == 0);
+
+  tgp_downloads_free (D);
+  g_free (a);
+}
+
+// the index and the LRU order survive a restart, unknown files are evicted first, oldest first
+static void test_reopen (const char *dir) {
+  struct tgp_downloads *D = tgp_downloads_new ();
+  tgp_downloads_open_cache (D, dir, 0);
+  char *a = make_file (dir, "a", 10, 3000);
+  char *b = make_file (dir, "b", 10, 3000);
+  cache_add (D, 1, a);
+  cache_add (D, 2, b);
+  CHECK(cache_has (D, 1));
+  tgp_downloads_free (D);
+
+  char *old = make_file (dir, "old", 10, 1000);
+  char *new = make_file (dir, "new", 10, 2000);
+
+  D = tgp_downloads_new ();
+  tgp_downloads_open_cache (D, dir, 30);
+  CHECK(D->evictions == 1);
+  CHECK(!g_file_test (old, G_FILE_TEST_EXISTS));
+  CHECK(D->cache_size == 30);
+  CHECK(!strcmp (lru_names (D), "new b a"));
+
+  char *c = make_file (dir, "c", 20, 4000);
+  cache_add (D, 3, c);
+  CHECK(D->evictions == 3);
+  CHECK(!g_file_test (new, G_FILE_TEST_EXISTS));
+  CHECK(!cache_has (D, 2));
+  CHECK(cache_has (D, 1));
+  CHECK(cache_has (D, 3));
+  tgp_downloads_free (D);
+
+  g_free (a);
+  g_free (b);
+  g_free (c);
+  g_free (old);
+  g_free (new);
+}
+
+int main (void) {
+  void (*tests[]) (const char *dir) = { test_lru, test_missing_file, test_reopen };
+  unsigned i;
+  for (i = 0; i < sizeof (tests) / sizeof (tests[0]); i++) {
+    char *dir = g_dir_make_tmp ("tgp-download-test-XXXXXX", NULL);
+    assert (dir);
+    tests[i] (dir);
+    remove_dir (dir);
+    g_free (dir);
+  }
+  if (failed) {
+    fprintf (stderr, "tgp-download-test: %d checks failed\n", failed);
+    return 1;
+  }
+  printf ("tgp-download-test: ok\n");
+  return 0;
+}
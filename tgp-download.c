@@ -0,0 +1,426 @@
+/*
+    This file is part of telegram-purple
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111-1301  USA
+
+    Copyright Matthias Jentsch 2014
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <tgl.h>
+
+#include "tgp-download.h"
+#include "tgp-structs.h"
+#include "telegram-base.h"
+#include "msglog.h"
+
+/*
+  tgp-download.c: Schedules photo downloads
+
+  Requests for the same photo are merged into one download, at most MAX_DOWNLOADS photos
+  are loaded at once and the rest wait in one queue per priority class. Photos waiting for
+  a conversation that was closed fall back to the priority of new messages, they are still
+  loaded and delivered with their message.
+
+  Loaded photos are remembered by photo id in an index of the downloads directory, so they
+  are not loaded again, even after a restart. When the directory grows beyond the cache
+  budget, the least recently used files are deleted.
+*/
+
+#define CACHE_INDEX "cache-index"
+
+struct cache_entry {
+  long long id;      // 0 for files that are not in the index
+  char *name;        // file name inside the cache directory
+  gint64 size;
+};
+
+struct download_waiter {
+  tgl_peer_id_t peer;
+  enum tgp_download_priority priority;
+  tgp_download_cb callback;
+  void *extra;
+};
+
+struct download_file {
+  long long id;
+  // a copy, the message or peer holding the photo can go away while it waits in the queue
+  struct tgl_photo photo;
+  enum tgp_download_priority priority;
+  int running;
+  GList *waiters;
+};
+
+struct tgp_downloads {
+  GHashTable *files;
+  GQueue *queue[TGP_DOWNLOAD_PRIORITIES];
+  int running;
+
+  char *cache_dir;
+  gint64 cache_budget;
+  gint64 cache_size;
+  GQueue *cache_lru;    // least recently used first
+  GHashTable *cache;    // photo id -> link in cache_lru
+  int hits, misses, evictions;
+};
+
+struct tgp_downloads *tgp_downloads_new (void) {
+  struct tgp_downloads *D = g_new0 (struct tgp_downloads, 1);
+  // keys point to the id inside the file
+  D->files = g_hash_table_new (g_int64_hash, g_int64_equal);
+  int i;
+  for (i = 0; i < TGP_DOWNLOAD_PRIORITIES; i++) {
+    D->queue[i] = g_queue_new ();
+  }
+  D->cache_lru = g_queue_new ();
+  D->cache = g_hash_table_new (g_int64_hash, g_int64_equal);
+  return D;
+}
+
+static void cache_entry_free (gpointer data) {
+  struct cache_entry *E = data;
+  g_free (E->name);
+  g_free (E);
+}
+
+static void cache_evict (struct tgp_downloads *D) {
+  if (!D->cache_budget) {
+    return;
+  }
+  while (D->cache_size > D->cache_budget) {
+    struct cache_entry *E = g_queue_pop_head (D->cache_lru);
+    if (!E) {
+      break;
+    }
+    if (E->id) {
+      g_hash_table_remove (D->cache, &E->id);
+    }
+    char *path = g_build_filename (D->cache_dir, E->name, NULL);
+    g_unlink (path);
+    g_free (path);
+    D->cache_size -= E->size;
+    D->evictions ++;
+    debug ("download cache: evicted %s (%" G_GINT64_FORMAT " bytes)\n", E->name, E->size);
+    cache_entry_free (E);
+  }
+}
+
+static void cache_insert (struct tgp_downloads *D, long long id, const char *name, gint64 size) {
+  struct cache_entry *E = g_new0 (struct cache_entry, 1);
+  E->id = id;
+  E->name = g_strdup (name);
+  E->size = size;
+  g_queue_push_tail (D->cache_lru, E);
+  if (id) {
+    g_hash_table_insert (D->cache, &E->id, D->cache_lru->tail);
+  }
+  D->cache_size += size;
+}
+
+struct cache_orphan {
+  struct cache_entry *E;
+  gint64 mtime;
+};
+
+static gint cache_compare_orphans (gconstpointer a, gconstpointer b) {
+  const struct cache_orphan *x = a, *y = b;
+  return x->mtime < y->mtime ? -1 : x->mtime > y->mtime;
+}
+
+void tgp_downloads_open_cache (struct tgp_downloads *D, const char *dir, long long budget) {
+  D->cache_dir = g_strdup (dir);
+  D->cache_budget = budget > 0 ? budget : 0;
+
+  GHashTable *known = g_hash_table_new (g_str_hash, g_str_equal);
+  char *index = g_build_filename (dir, CACHE_INDEX, NULL);
+  FILE *f = fopen (index, "r");
+  if (f) {
+    long long id;
+    char name[256];
+    while (fscanf (f, "%lld %255s", &id, name) == 2) {
+      char *path = g_build_filename (dir, name, NULL);
+      GStatBuf st;
+      if (!g_stat (path, &st) && !g_hash_table_contains (D->cache, &id)) {
+        cache_insert (D, id, name, st.st_size);
+        g_hash_table_add (known, ((struct cache_entry *)D->cache_lru->tail->data)->name);
+      }
+      g_free (path);
+    }
+    fclose (f);
+  }
+  g_free (index);
+
+  // files that are not in the index, e.g. after a crash, are evicted first, oldest first
+  GDir *d = g_dir_open (dir, 0, NULL);
+  if (d) {
+    GList *orphans = NULL;
+    const char *name;
+    while ((name = g_dir_read_name (d))) {
+      if (g_str_has_prefix (name, CACHE_INDEX) || g_hash_table_contains (known, name)) {
+        continue;
+      }
+      char *path = g_build_filename (dir, name, NULL);
+      GStatBuf st;
+      if (!g_stat (path, &st) && S_ISREG (st.st_mode)) {
+        struct cache_orphan *O = g_new (struct cache_orphan, 1);
+        O->E = g_new0 (struct cache_entry, 1);
+        O->E->name = g_strdup (name);
+        O->E->size = st.st_size;
+        O->mtime = st.st_mtime;
+        orphans = g_list_prepend (orphans, O);
+      }
+      g_free (path);
+    }
+    g_dir_close (d);
+
+    orphans = g_list_sort (orphans, cache_compare_orphans);
+    GList *l;
+    for (l = g_list_last (orphans); l; l = l->prev) {
+      struct cache_orphan *O = l->data;
+      g_queue_push_head (D->cache_lru, O->E);
+      D->cache_size += O->E->size;
+    }
+    g_list_free_full (orphans, g_free);
+  }
+  g_hash_table_destroy (known);
+
+  debug ("download cache: %d files, %" G_GINT64_FORMAT " bytes in %s\n", g_queue_get_length (D->cache_lru),
+      D->cache_size, dir);
+  cache_evict (D);
+}
+
+static void cache_save (struct tgp_downloads *D) {
+  char *index = g_build_filename (D->cache_dir, CACHE_INDEX, NULL);
+  char *tmp = g_strconcat (index, ".tmp", NULL);
+  FILE *f = fopen (tmp, "w");
+  if (f) {
+    GList *l;
+    for (l = D->cache_lru->head; l; l = l->next) {
+      struct cache_entry *E = l->data;
+      if (E->id) {
+        fprintf (f, "%lld %s\n", E->id, E->name);
+      }
+    }
+    if (fclose (f) || g_rename (tmp, index)) {
+      warning ("download cache: can not write %s\n", index);
+    }
+  }
+  g_free (tmp);
+  g_free (index);
+}
+
+// returns the cached file of the photo, or NULL
+static char *cache_lookup (struct tgp_downloads *D, long long id) {
+  if (!D->cache_dir) {
+    return NULL;
+  }
+  GList *link = g_hash_table_lookup (D->cache, &id);
+  if (link) {
+    struct cache_entry *E = link->data;
+    char *path = g_build_filename (D->cache_dir, E->name, NULL);
+    if (g_file_test (path, G_FILE_TEST_EXISTS)) {
+      g_queue_unlink (D->cache_lru, link);
+      g_queue_push_tail_link (D->cache_lru, link);
+      D->hits ++;
+      return path;
+    }
+    g_free (path);
+    g_hash_table_remove (D->cache, &id);
+    g_queue_delete_link (D->cache_lru, link);
+    D->cache_size -= E->size;
+    cache_entry_free (E);
+  }
+  D->misses ++;
+  return NULL;
+}
+
+static void cache_add (struct tgp_downloads *D, long long id, const char *filename) {
+  if (!D->cache_dir || g_hash_table_contains (D->cache, &id)) {
+    return;
+  }
+  char *dir = g_path_get_dirname (filename);
+  int inside = !strcmp (dir, D->cache_dir);
+  g_free (dir);
+  GStatBuf st;
+  if (!inside || g_stat (filename, &st)) {
+    return;
+  }
+  char *name = g_path_get_basename (filename);
+  cache_insert (D, id, name, st.st_size);
+  g_free (name);
+  cache_evict (D);
+  debug ("download cache: %d hits, %d misses (%.0f%% hit ratio), %d evictions, %" G_GINT64_FORMAT " bytes\n",
+      D->hits, D->misses, 100.0 * D->hits / (D->hits + D->misses ? D->hits + D->misses : 1), D->evictions,
+      D->cache_size);
+}
+
+static void download_file_free (struct download_file *F) {
+  g_list_free_full (F->waiters, g_free);
+  telegram_photo_copy_free (&F->photo);
+  g_free (F);
+}
+
+void tgp_downloads_free (struct tgp_downloads *D) {
+  GHashTableIter iter;
+  gpointer value;
+  g_hash_table_iter_init (&iter, D->files);
+  while (g_hash_table_iter_next (&iter, NULL, &value)) {
+    // running downloads were dropped by tgl_free_all, their callbacks never come
+    download_file_free (value);
+  }
+  g_hash_table_destroy (D->files);
+  int i;
+  for (i = 0; i < TGP_DOWNLOAD_PRIORITIES; i++) {
+    g_queue_free (D->queue[i]);
+  }
+  if (D->cache_dir) {
+    cache_save (D);
+    g_free (D->cache_dir);
+  }
+  g_hash_table_destroy (D->cache);
+  g_queue_free_full (D->cache_lru, cache_entry_free);
+  g_free (D);
+}
+
+int tgp_downloads_pending (struct tgp_downloads *D) {
+  return g_hash_table_size (D->files);
+}
+
+static void download_next (struct tgl_state *TLS);
+
+static void download_done (struct tgl_state *TLS, void *extra, int success, char *filename) {
+  connection_data *conn = TLS->ev_base;
+  struct tgp_downloads *D = conn->downloads;
+  struct download_file *F = extra;
+
+  g_hash_table_remove (D->files, &F->id);
+  D->running --;
+  debug ("download: photo %lld done (success=%d), %d waiting\n", F->id, success, g_list_length (F->waiters));
+
+  GList *l;
+  for (l = F->waiters; l; l = l->next) {
+    struct download_waiter *W = l->data;
+    W->callback (TLS, W->extra, success, filename);
+  }
+  if (success) {
+    cache_add (D, F->id, filename);
+  }
+  download_file_free (F);
+  download_next (TLS);
+}
+
+static void download_next (struct tgl_state *TLS) {
+  connection_data *conn = TLS->ev_base;
+  struct tgp_downloads *D = conn->downloads;
+  int i;
+  for (i = 0; i < TGP_DOWNLOAD_PRIORITIES && D->running < MAX_DOWNLOADS; i++) {
+    struct download_file *F;
+    while (D->running < MAX_DOWNLOADS && (F = g_queue_pop_head (D->queue[i]))) {
+      F->running = 1;
+      D->running ++;
+      telegram_load_photo (TLS, &F->photo, download_done, F);
+    }
+  }
+}
+
+void tgp_download_photo (struct tgl_state *TLS, struct tgl_photo *photo, enum tgp_download_priority priority,
+    tgl_peer_id_t peer, tgp_download_cb callback, void *extra) {
+  connection_data *conn = TLS->ev_base;
+  struct tgp_downloads *D = conn->downloads;
+
+  char *path = cache_lookup (D, photo->id);
+  if (path) {
+    debug ("download: photo %lld found in cache\n", photo->id);
+    callback (TLS, extra, 1, path);
+    g_free (path);
+    return;
+  }
+
+  struct download_waiter *W = g_new0 (struct download_waiter, 1);
+  W->peer = peer;
+  W->priority = priority;
+  W->callback = callback;
+  W->extra = extra;
+
+  struct download_file *F = g_hash_table_lookup (D->files, &photo->id);
+  if (F) {
+    debug ("download: photo %lld already requested\n", photo->id);
+    F->waiters = g_list_append (F->waiters, W);
+    if (!F->running && priority < F->priority) {
+      g_queue_remove (D->queue[F->priority], F);
+      F->priority = priority;
+      g_queue_push_tail (D->queue[priority], F);
+    }
+    download_next (TLS);
+    return;
+  }
+
+  F = g_new0 (struct download_file, 1);
+  F->id = photo->id;
+  telegram_photo_copy (&F->photo, photo);
+  F->priority = priority;
+  F->waiters = g_list_append (NULL, W);
+  g_hash_table_insert (D->files, &F->id, F);
+  g_queue_push_tail (D->queue[priority], F);
+  download_next (TLS);
+}
+
+// the highest priority of the waiters
+static enum tgp_download_priority download_file_priority (struct download_file *F) {
+  enum tgp_download_priority priority = TGP_DOWNLOAD_AVATAR;
+  GList *w;
+  for (w = F->waiters; w; w = w->next) {
+    struct download_waiter *W = w->data;
+    if (W->priority < priority) {
+      priority = W->priority;
+    }
+  }
+  return priority;
+}
+
+void tgp_download_demote_peer (struct tgl_state *TLS, tgl_peer_id_t peer) {
+  connection_data *conn = TLS->ev_base;
+  struct tgp_downloads *D = conn->downloads;
+  int demoted = 0;
+  GList *l = D->queue[TGP_DOWNLOAD_CONVERSATION]->head;
+  while (l) {
+    GList *next = l->next;
+    struct download_file *F = l->data;
+    GList *w;
+    for (w = F->waiters; w; w = w->next) {
+      struct download_waiter *W = w->data;
+      if (W->priority == TGP_DOWNLOAD_CONVERSATION && !memcmp (&W->peer, &peer, sizeof (peer))) {
+        W->priority = TGP_DOWNLOAD_MESSAGE;
+      }
+    }
+    enum tgp_download_priority priority = download_file_priority (F);
+    if (priority != F->priority) {
+      g_queue_delete_link (D->queue[F->priority], l);
+      F->priority = priority;
+      g_queue_push_tail (D->queue[priority], F);
+      demoted ++;
+    }
+    l = next;
+  }
+  if (demoted) {
+    debug ("download: demoted %d photos for closed conversation with %d\n", demoted, tgl_get_peer_id (peer));
+  }
+}
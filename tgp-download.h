@@ -0,0 +1,48 @@
+/*
+    This file is part of telegram-purple
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111-1301  USA
+
+    Copyright Matthias Jentsch 2014
+*/
+#ifndef __TGP_DOWNLOAD_H__
+#define __TGP_DOWNLOAD_H__
+
+#include <tgl.h>
+
+// at most this many photos are loaded at the same time
+#define MAX_DOWNLOADS 4
+
+enum tgp_download_priority {
+  TGP_DOWNLOAD_CONVERSATION,  // photo in an open conversation, or requested by the user
+  TGP_DOWNLOAD_MESSAGE,       // photo in a new message
+  TGP_DOWNLOAD_AVATAR,        // userpic
+  TGP_DOWNLOAD_PRIORITIES
+};
+
+typedef void (*tgp_download_cb) (struct tgl_state *TLS, void *extra, int success, char *filename);
+
+struct tgp_downloads;
+
+struct tgp_downloads *tgp_downloads_new (void);
+void tgp_downloads_free (struct tgp_downloads *D);
+int tgp_downloads_pending (struct tgp_downloads *D);
+void tgp_downloads_open_cache (struct tgp_downloads *D, const char *dir, long long budget);
+
+void tgp_download_photo (struct tgl_state *TLS, struct tgl_photo *photo, enum tgp_download_priority priority,
+    tgl_peer_id_t peer, tgp_download_cb callback, void *extra);
+void tgp_download_demote_peer (struct tgl_state *TLS, tgl_peer_id_t peer);
+
+#endif
@@ -32,11 +32,13 @@
 #include <netinet/tcp.h>
 #include <sys/fcntl.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <errno.h>
 #include <stdio.h>
 #include <unistd.h>
 #include <poll.h>
 #include <openssl/rand.h>
+#include <openssl/evp.h>
 #include <arpa/inet.h>
 #include <sys/time.h>
 #include <time.h>
@@ -45,12 +47,18 @@
 #include "tgp-structs.h"
 #include <tgl.h>
 #include <tgl-inner.h>
+#include <mtproto-common.h>
 
 #include <glib.h>
 #include <eventloop.h>
 #include <telegram-purple.h>
 #include <msglog.h>
 
+#ifdef TGP_NET_URING
+#include <sys/eventfd.h>
+#include <liburing.h>
+#endif
+
 #ifndef POLLRDHUP
 #define POLLRDHUP 0
 #endif
@@ -60,9 +68,18 @@
 //extern struct mtproto_methods auth_methods;
 
 static void fail_connection (struct connection *c);
+static void uring_add (struct tgp_uring *U, struct connection *c);
+static void uring_remove (struct connection *c);
+static void uring_write (struct connection *c);
+static void capture_message (struct connection *c, int type, const unsigned char *data, int len);
+static void replay_connection (struct connection *c);
 
 #define PING_TIMEOUT 10
 
+#define CAPTURE_FILE_MAGIC 0x5e1f0c4a
+#define CAPTURE_IN 0
+#define CAPTURE_OUT 1
+
 static void start_ping_timer (struct connection *c);
 static int ping_alarm (gpointer arg) {
   struct connection *c = arg;
@@ -128,8 +145,16 @@ int tgln_write_out (struct connection *c, const void *_data, int len) {
   const unsigned char *data = _data;
   if (!len) { return 0; }
   assert (len > 0);
+  connection_data *conn = TLS->ev_base;
+  if (conn->capture) {
+    capture_message (c, CAPTURE_OUT, data, len);
+  }
+  if (conn->replay) {
+    // nobody is listening
+    return len;
+  }
   int x = 0;
-  if (!c->out_bytes) {
+  if (!c->out_bytes && !c->uring) {
     assert (c->write_ev == -1);
     c->write_ev = purple_input_add (c->fd, PURPLE_INPUT_WRITE, conn_try_write, c);
   }
@@ -147,6 +172,7 @@ int tgln_write_out (struct connection *c, const void *_data, int len) {
       int y = c->out_tail->end - c->out_tail->wptr;
       assert (y < len);
       memcpy (c->out_tail->wptr, data, y);
+      c->out_tail->wptr += y;
       x += y;
       len -= y;
       data += y;
@@ -217,7 +243,26 @@ int tgln_read_in_lookup (struct connection *c, void *_data, int len) {
   return x;
 }
 
+static void try_write (struct connection *c);
+
+/*
+  libtgl calls this after every complete packet. Write it right away instead
+  of waiting for the write watch to fire in the next main loop iteration,
+  the watch is only kept when the socket buffer is full.
+*/
 void tgln_flush_out (struct connection *c) {
+  if (c->uring) {
+    uring_write (c);
+    return;
+  }
+  if (c->state != conn_ready || !c->out_bytes) {
+    return;
+  }
+  try_write (c);
+  if (!c->out_bytes && c->write_ev >= 0) {
+    purple_input_remove (c->write_ev);
+    c->write_ev = -1;
+  }
 }
 
 //#define MAX_CONNECTIONS 100
@@ -239,7 +284,6 @@ static void rotate_port (struct connection *c) {
 }
 
 static void try_read (struct connection *c);
-static void try_write (struct connection *c);
 
 static void conn_try_read (gpointer arg, gint source, PurpleInputCondition cond) {
   struct connection *c = arg;
@@ -272,10 +316,19 @@ static void net_on_connected (gpointer arg, gint fd, const gchar *error_message)
   }
 
   c->fd = fd;
-  c->read_ev = purple_input_add (fd, PURPLE_INPUT_READ, conn_try_read, c);
+  connection_data *conn = TLS->ev_base;
+  if (conn->uring) {
+    uring_add (conn->uring, c);
+  } else {
+    c->read_ev = purple_input_add (fd, PURPLE_INPUT_READ, conn_try_read, c);
+  }
   
   char byte = 0xef;
   assert (tgln_write_out (c, &byte, 1) == 1);
+  if (c->uring) {
+    // the connection is ready once this byte is written
+    uring_write (c);
+  }
   
   c->last_receive_time = tglt_get_double_time ();
   start_ping_timer (c);
@@ -304,7 +357,13 @@ struct connection *tgln_create_connection (struct tgl_state *TLS, const char *ho
   c->session = session;
   c->methods = methods;
 
+  c->replay_ev = -1;
+
   connection_data *conn = TLS->ev_base;
+  if (conn->replay) {
+    replay_connection (c);
+    return c;
+  }
   c->prpl_data = purple_proxy_connect (conn->gc, conn->pa, host, port, net_on_connected, c);
 
   return c;
@@ -335,6 +394,7 @@ static void fail_connection (struct connection *c) {
     purple_input_remove (c->read_ev);
     c->read_ev = -1;
   }
+  uring_remove (c);
   
   rotate_port (c);
 
@@ -364,25 +424,51 @@ static void fail_connection (struct connection *c) {
   restart_connection (c);
 }
 
+#define WRITE_MAX_IOV 16
+
+// releases the first len bytes of the output, they were written to the socket
+static void drop_written (struct connection *c, int len) {
+  while (c->out_head) {
+    int y = c->out_head->wptr - c->out_head->rptr;
+    if (y > len) {
+      c->out_head->rptr += len;
+      break;
+    }
+    len -= y;
+    struct connection_buffer *b = c->out_head;
+    c->out_head = b->next;
+    if (!c->out_head) {
+      c->out_tail = 0;
+    }
+    delete_connection_buffer (b);
+  }
+}
+
 //extern FILE *log_net_f;
 static void try_write (struct connection *c) {
   struct tgl_state *TLS = c->TLS;
   vlogprintf (E_DEBUG, "try write: fd = %d\n", c->fd);
   int x = 0;
   while (c->out_head) {
-    int r = write (c->fd, c->out_head->rptr, c->out_head->wptr - c->out_head->rptr);
+    // gather all pending buffers into a single syscall
+    struct iovec iov[WRITE_MAX_IOV];
+    int n = 0;
+    int total = 0;
+    struct connection_buffer *b = c->out_head;
+    while (b && n < WRITE_MAX_IOV) {
+      iov[n].iov_base = b->rptr;
+      iov[n].iov_len = b->wptr - b->rptr;
+      total += iov[n].iov_len;
+      n ++;
+      b = b->next;
+    }
+    int r = writev (c->fd, iov, n);
     if (r >= 0) {
       x += r;
-      c->out_head->rptr += r;
-      if (c->out_head->rptr != c->out_head->wptr) {
+      drop_written (c, r);
+      if (r != total) {
         break;
       }
-      struct connection_buffer *b = c->out_head;
-      c->out_head = b->next;
-      if (!c->out_head) {
-        c->out_tail = 0;
-      }
-      delete_connection_buffer (b);
     } else {
       if (errno != EAGAIN && errno != EWOULDBLOCK) {
         vlogprintf (E_NOTICE, "fail_connection: write_error %m\n");
@@ -397,22 +483,23 @@ static void try_write (struct connection *c) {
   c->out_bytes -= x;
 }
 
-static void try_rpc_read (struct connection *c) {
+// hands all complete frames to libtgl, returns -1 if it stopped early because execute failed or the connection was closed
+static int try_rpc_read (struct connection *c) {
   assert (c->in_head);
   struct tgl_state *TLS = c->TLS;
 
   while (1) {
-    if (c->in_bytes < 1) { return; }
+    if (c->in_bytes < 1) { return 0; }
     unsigned len = 0;
     unsigned t = 0;
     assert (tgln_read_in_lookup (c, &len, 1) == 1);
     if (len >= 1 && len <= 0x7e) {
-      if (c->in_bytes < (int)(1 + 4 * len)) { return; }
+      if (c->in_bytes < (int)(1 + 4 * len)) { return 0; }
     } else {
-      if (c->in_bytes < 4) { return; }
+      if (c->in_bytes < 4) { return 0; }
       assert (tgln_read_in_lookup (c, &len, 4) == 4);
       len = (len >> 8);
-      if (c->in_bytes < (int)(4 + 4 * len)) { return; }
+      if (c->in_bytes < (int)(4 + 4 * len)) { return 0; }
       len = 0x7f;
     }
 
@@ -429,39 +516,105 @@ static void try_rpc_read (struct connection *c) {
     len *= 4;
     int op;
     assert (tgln_read_in_lookup (c, &op, 4) == 4);
-    if (c->methods->execute (TLS, c, op, len) < 0) { 
-      return;
+    connection_data *conn = TLS->ev_base;
+    if (conn->capture) {
+      unsigned char *data = malloc (len);
+      assert (tgln_read_in_lookup (c, data, len) == (int)len);
+      capture_message (c, CAPTURE_IN, data, len);
+      free (data);
+    }
+    int r = c->methods->execute (TLS, c, op, len);
+    if (conn->on_rpc_read) {
+      conn->on_rpc_read (TLS);
     }
+    if (r < 0 || c->state == conn_failed) { 
+      return -1;
+    }
+  }
+}
+
+// returns the total length of the first frame in buf, or 0 if the header is incomplete
+static int frame_length (const unsigned char *buf, int len) {
+  if (len < 1) { return 0; }
+  if (buf[0] >= 1 && buf[0] <= 0x7e) {
+    return 1 + 4 * buf[0];
+  }
+  if (len < 4) { return 0; }
+  return 4 + 4 * (buf[1] | (buf[2] << 8) | (buf[3] << 16));
+}
+
+#define IN_BUFFER_SIZE (1 << 16)
+
+/*
+  Makes sure that the frame at the head of the input fits into the last buffer.
+  Large frames get a buffer of exactly their size, so a multi-megabyte file part
+  is received into one contiguous region and not spread over several buffers.
+*/
+static void reserve_frame (struct connection *c) {
+  unsigned char header[4];
+  int len = frame_length (header, tgln_read_in_lookup (c, header, 4));
+  if (c->in_tail && c->in_head == c->in_tail) {
+    if (len && c->in_tail->end - c->in_tail->rptr >= len) { return; }
+    if (!len && c->in_tail->wptr != c->in_tail->end) { return; }
+  }
+
+  int size = IN_BUFFER_SIZE;
+  if (size < len) { size = len; }
+  if (size < c->in_bytes) { size = c->in_bytes; }
+  struct connection_buffer *b = new_connection_buffer (size);
+  int n = c->in_bytes;
+  if (n) {
+    assert (tgln_read_in (c, b->wptr, n) == n);
+    b->wptr += n;
   }
+  while (c->in_head) {
+    struct connection_buffer *d = c->in_head;
+    c->in_head = d->next;
+    delete_connection_buffer (d);
+  }
+  c->in_head = c->in_tail = b;
+  c->in_bytes = n;
 }
 
 static void try_read (struct connection *c) {
   struct tgl_state *TLS = c->TLS;
   vlogprintf (E_DEBUG, "try read: fd = %d\n", c->fd);
-  if (!c->in_tail) {
-    c->in_head = c->in_tail = new_connection_buffer (1 << 20);
-  }
+  reserve_frame (c);
   #ifdef EVENT_V1
     struct timeval tv = {5, 0};
     event_add (c->read_ev, &tv);
   #endif
   int x = 0;
   while (1) {
-    int r = read (c->fd, c->in_tail->wptr, c->in_tail->end - c->in_tail->wptr);
+    int len = c->in_tail->end - c->in_tail->wptr;
+    if (!len) {
+      // libtgl stopped at a complete frame that fills the buffer, never read() 0 bytes in this case
+      if (try_rpc_read (c) < 0) {
+        return;
+      }
+      reserve_frame (c);
+      continue;
+    }
+    int r = read (c->fd, c->in_tail->wptr, len);
     if (r > 0) {
       c->last_receive_time = tglt_get_double_time ();
       stop_ping_timer (c);
       start_ping_timer (c);
-    }
-    if (r >= 0) {
       c->in_tail->wptr += r;
+      c->in_bytes += r;
       x += r;
       if (c->in_tail->wptr != c->in_tail->end) {
         break;
       }
-      struct connection_buffer *b = new_connection_buffer (1 << 20);
-      c->in_tail->next = b;
-      c->in_tail = b;
+      // hand over all complete frames, then make room for the rest of the current one
+      if (try_rpc_read (c) < 0) {
+        return;
+      }
+      reserve_frame (c);
+    } else if (r == 0) {
+      vlogprintf (E_NOTICE, "fail_connection: closed by server\n");
+      fail_connection (c);
+      return;
     } else {
       if (errno != EAGAIN && errno != EWOULDBLOCK) {
         vlogprintf (E_NOTICE, "fail_connection: read_error %m\n");
@@ -473,11 +626,684 @@ static void try_read (struct connection *c) {
     }
   }
   vlogprintf (E_DEBUG, "Received %d bytes from %d\n", x, c->fd);
-  c->in_bytes += x;
   if (x) {
     try_rpc_read (c);
   }
 }
+
+/*
+  Optional io_uring backend, built with configure --enable-io-uring: every
+  socket of the account gets a multishot receive that fills buffers from a
+  ring registered with the kernel, and writes are queued as sendmsg requests.
+  All requests queued during one main loop iteration go to the kernel with a
+  single io_uring_enter, and completions are signalled through an eventfd
+  watched by the main loop. A burst of incoming frames then costs one wakeup
+  and no read() calls, and a burst of outgoing packets a single syscall.
+  Without buffer rings (Linux < 5.19) no ring is created and the poll path
+  above is used, without multishot receive (Linux < 6.0) the connection reads
+  through the poll path and only writes go through the ring.
+*/
+
+#ifdef TGP_NET_URING
+
+#define URING_ENTRIES 64
+#define URING_BUFS 64
+#define URING_BUF_SIZE (1 << 14)
+#define URING_BUF_GROUP 0
+
+// the request type is kept in the low bits of the user data
+#define URING_RECV 1
+#define URING_SEND 2
+
+struct tgp_uring_conn {
+  struct connection *c;   // NULL once the connection is released
+  int fd;
+  int inflight;           // requests that did not post their last completion yet
+  int completing;         // a completion is being handled, uring_complete frees a released connection
+  int recv_armed;
+  int sending;
+  struct connection_buffer *out;  // output of a released connection, read by the running send
+  struct iovec iov[WRITE_MAX_IOV];
+  struct msghdr msg;
+};
+
+struct tgp_uring {
+  struct io_uring ring;
+  struct io_uring_buf_ring *br;
+  unsigned char *bufs;
+  int event_fd;
+  int event_ev;
+  int submit_ev;
+  int released;           // released connections that still wait for their completions
+};
+
+static void uring_submit (struct tgp_uring *U) {
+  if (U->submit_ev >= 0) {
+    purple_timeout_remove (U->submit_ev);
+    U->submit_ev = -1;
+  }
+  if (io_uring_sq_ready (&U->ring)) {
+    io_uring_submit (&U->ring);
+  }
+}
+
+static int uring_submit_alarm (gpointer arg) {
+  struct tgp_uring *U = arg;
+  U->submit_ev = -1;
+  uring_submit (U);
+  return FALSE;
+}
+
+// requests are submitted together at the end of the current main loop iteration
+static struct io_uring_sqe *uring_sqe (struct tgp_uring *U) {
+  struct io_uring_sqe *sqe = io_uring_get_sqe (&U->ring);
+  if (!sqe) {
+    io_uring_submit (&U->ring);
+    sqe = io_uring_get_sqe (&U->ring);
+    assert (sqe);
+  }
+  if (U->submit_ev < 0) {
+    U->submit_ev = purple_timeout_add (0, uring_submit_alarm, U);
+  }
+  return sqe;
+}
+
+static void uring_recv (struct tgp_uring *U, struct tgp_uring_conn *u) {
+  struct io_uring_sqe *sqe = uring_sqe (U);
+  io_uring_prep_recv_multishot (sqe, u->fd, NULL, 0, 0);
+  sqe->flags |= IOSQE_BUFFER_SELECT;
+  sqe->buf_group = URING_BUF_GROUP;
+  io_uring_sqe_set_data (sqe, (void *) ((uintptr_t) u | URING_RECV));
+  u->recv_armed = 1;
+  u->inflight ++;
+}
+
+static void uring_add (struct tgp_uring *U, struct connection *c) {
+  struct tgp_uring_conn *u = malloc (sizeof (*u));
+  memset (u, 0, sizeof (*u));
+  u->c = c;
+  u->fd = c->fd;
+  c->uring = u;
+  uring_recv (U, u);
+}
+
+static void uring_write (struct connection *c) {
+  struct tgp_uring_conn *u = c->uring;
+  if (u->sending || !c->out_bytes) {
+    return;
+  }
+  connection_data *conn = c->TLS->ev_base;
+  int n = 0;
+  struct connection_buffer *b = c->out_head;
+  while (b && n < WRITE_MAX_IOV) {
+    // the kernel only reads up to the current wptr, tgln_write_out can keep appending behind it
+    u->iov[n].iov_base = b->rptr;
+    u->iov[n].iov_len = b->wptr - b->rptr;
+    n ++;
+    b = b->next;
+  }
+  memset (&u->msg, 0, sizeof (u->msg));
+  u->msg.msg_iov = u->iov;
+  u->msg.msg_iovlen = n;
+
+  struct io_uring_sqe *sqe = uring_sqe (conn->uring);
+  io_uring_prep_sendmsg (sqe, u->fd, &u->msg, MSG_NOSIGNAL);
+  io_uring_sqe_set_data (sqe, (void *) ((uintptr_t) u | URING_SEND));
+  u->sending = 1;
+  u->inflight ++;
+}
+
+static void uring_cancel (struct tgp_uring *U, struct tgp_uring_conn *u, int type) {
+  struct io_uring_sqe *sqe = uring_sqe (U);
+  io_uring_prep_cancel64 (sqe, (uintptr_t) u | type, 0);
+  io_uring_sqe_set_data (sqe, NULL);
+}
+
+static void uring_conn_free (struct tgp_uring_conn *u) {
+  while (u->out) {
+    struct connection_buffer *b = u->out;
+    u->out = b->next;
+    delete_connection_buffer (b);
+  }
+  free (u);
+}
+
+static void uring_remove (struct connection *c) {
+  struct tgp_uring_conn *u = c->uring;
+  if (!u) { return; }
+  connection_data *conn = c->TLS->ev_base;
+  struct tgp_uring *U = conn->uring;
+  if (u->recv_armed) {
+    uring_cancel (U, u, URING_RECV);
+  }
+  if (u->sending) {
+    // the kernel may still read the output, it is freed with the last completion
+    uring_cancel (U, u, URING_SEND);
+    u->out = c->out_head;
+    c->out_head = c->out_tail = 0;
+    c->out_bytes = 0;
+  }
+  u->c = NULL;
+  c->uring = NULL;
+  if (u->inflight || u->completing) {
+    U->released ++;
+  } else {
+    uring_conn_free (u);
+  }
+  uring_submit (U);
+}
+
+static void uring_sent (struct tgp_uring_conn *u, int res) {
+  struct connection *c = u->c;
+  struct tgl_state *TLS = c->TLS;
+  if (res < 0) {
+    vlogprintf (E_NOTICE, "fail_connection: write_error %s\n", strerror (-res));
+    fail_connection (c);
+    return;
+  }
+  vlogprintf (E_DEBUG, "Sent %d bytes to %d\n", res, c->fd);
+  drop_written (c, res);
+  c->out_bytes -= res;
+  if (c->state == conn_connecting) {
+    c->state = conn_ready;
+    c->methods->ready (TLS, c);
+  }
+  if (c->uring) {
+    uring_write (c);
+  }
+}
+
+// appends data received without read() to the input, in the same buffers try_read fills
+static void conn_receive (struct connection *c, const unsigned char *data, int len) {
+  struct tgl_state *TLS = c->TLS;
+  vlogprintf (E_DEBUG, "Received %d bytes from %d\n", len, c->fd);
+  c->last_receive_time = tglt_get_double_time ();
+  stop_ping_timer (c);
+  start_ping_timer (c);
+  reserve_frame (c);
+  while (len) {
+    int n = c->in_tail->end - c->in_tail->wptr;
+    if (!n) {
+      // libtgl stopped at a complete frame that fills the buffer, keep the data behind it
+      struct connection_buffer *b = new_connection_buffer (IN_BUFFER_SIZE);
+      c->in_tail->next = b;
+      c->in_tail = b;
+      continue;
+    }
+    if (n > len) { n = len; }
+    memcpy (c->in_tail->wptr, data, n);
+    c->in_tail->wptr += n;
+    c->in_bytes += n;
+    data += n;
+    len -= n;
+    if (c->in_tail->wptr == c->in_tail->end) {
+      if (try_rpc_read (c) < 0 && c->state == conn_failed) {
+        return;
+      }
+      reserve_frame (c);
+    }
+  }
+  try_rpc_read (c);
+}
+
+static void uring_received (struct tgp_uring *U, struct tgp_uring_conn *u, const struct io_uring_cqe *cqe) {
+  if (cqe->flags & IORING_CQE_F_BUFFER) {
+    int id = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+    unsigned char *buf = U->bufs + id * URING_BUF_SIZE;
+    if (u->c && cqe->res > 0) {
+      conn_receive (u->c, buf, cqe->res);
+    }
+    io_uring_buf_ring_add (U->br, buf, URING_BUF_SIZE, id, io_uring_buf_ring_mask (URING_BUFS), 0);
+    io_uring_buf_ring_advance (U->br, 1);
+  }
+  if (cqe->flags & IORING_CQE_F_MORE) {
+    return;
+  }
+  u->recv_armed = 0;
+  u->inflight --;
+  struct connection *c = u->c;
+  if (!c) { return; }
+  struct tgl_state *TLS = c->TLS;
+  if (cqe->res == -EINVAL) {
+    vlogprintf (E_NOTICE, "no multishot receive, reading fd %d through poll\n", u->fd);
+    c->read_ev = purple_input_add (u->fd, PURPLE_INPUT_READ, conn_try_read, c);
+  } else if (cqe->res == 0) {
+    vlogprintf (E_NOTICE, "fail_connection: closed by server\n");
+    fail_connection (c);
+  } else if (cqe->res < 0 && cqe->res != -ENOBUFS) {
+    vlogprintf (E_NOTICE, "fail_connection: read_error %s\n", strerror (-cqe->res));
+    fail_connection (c);
+  } else {
+    // out of buffers or stopped by the kernel, all buffers are back in the ring now
+    uring_recv (U, u);
+  }
+}
+
+static void uring_complete (struct tgp_uring *U, const struct io_uring_cqe *cqe) {
+  uintptr_t data = (uintptr_t) io_uring_cqe_get_data (cqe);
+  if (!data) { return; }
+  struct tgp_uring_conn *u = (void *) (data & ~(uintptr_t) 3);
+  // the handlers can fail the connection, which releases u through uring_remove
+  u->completing = 1;
+  if ((data & 3) == URING_RECV) {
+    uring_received (U, u, cqe);
+  } else {
+    u->sending = 0;
+    u->inflight --;
+    if (u->c) {
+      uring_sent (u, cqe->res);
+    }
+  }
+  u->completing = 0;
+  if (!u->c && !u->inflight) {
+    U->released --;
+    uring_conn_free (u);
+  }
+}
+
+static void uring_drain (gpointer arg, gint source, PurpleInputCondition cond) {
+  struct tgp_uring *U = arg;
+  eventfd_t v;
+  eventfd_read (U->event_fd, &v);
+
+  struct io_uring_cqe *cqe;
+  while (!io_uring_peek_cqe (&U->ring, &cqe)) {
+    struct io_uring_cqe e = *cqe;
+    io_uring_cqe_seen (&U->ring, cqe);
+    uring_complete (U, &e);
+  }
+  uring_submit (U);
+}
+
+struct tgp_uring *tgln_uring_new (void) {
+  struct tgp_uring *U = malloc (sizeof (*U));
+  memset (U, 0, sizeof (*U));
+  if (io_uring_queue_init (URING_ENTRIES, &U->ring, 0) < 0) {
+    free (U);
+    return NULL;
+  }
+  int err;
+  U->br = io_uring_setup_buf_ring (&U->ring, URING_BUFS, URING_BUF_GROUP, 0, &err);
+  if (!U->br) {
+    io_uring_queue_exit (&U->ring);
+    free (U);
+    return NULL;
+  }
+  U->bufs = malloc (URING_BUFS * URING_BUF_SIZE);
+  int i;
+  for (i = 0; i < URING_BUFS; i++) {
+    io_uring_buf_ring_add (U->br, U->bufs + i * URING_BUF_SIZE, URING_BUF_SIZE, i, io_uring_buf_ring_mask (URING_BUFS), i);
+  }
+  io_uring_buf_ring_advance (U->br, URING_BUFS);
+
+  U->event_fd = eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC);
+  assert (U->event_fd >= 0);
+  assert (io_uring_register_eventfd (&U->ring, U->event_fd) == 0);
+  U->event_ev = purple_input_add (U->event_fd, PURPLE_INPUT_READ, uring_drain, U);
+  U->submit_ev = -1;
+  return U;
+}
+
+void tgln_uring_free (struct tgp_uring *U) {
+  purple_input_remove (U->event_ev);
+  uring_submit (U);
+  // wait a little for the cancellations of released connections, their buffers may still be in use
+  struct __kernel_timespec ts = { 0, 100 * 1000 * 1000 };
+  struct io_uring_cqe *cqe;
+  while (U->released && !io_uring_wait_cqe_timeout (&U->ring, &cqe, &ts)) {
+    struct io_uring_cqe e = *cqe;
+    io_uring_cqe_seen (&U->ring, cqe);
+    uring_complete (U, &e);
+  }
+  io_uring_free_buf_ring (&U->ring, U->br, URING_BUFS, URING_BUF_GROUP);
+  io_uring_queue_exit (&U->ring);
+  free (U->bufs);
+  close (U->event_fd);
+  free (U);
+}
+
+#else
+
+static void uring_add (struct tgp_uring *U, struct connection *c) {
+  assert (0);
+}
+
+static void uring_remove (struct connection *c) {
+}
+
+static void uring_write (struct connection *c) {
+}
+
+struct tgp_uring *tgln_uring_new (void) {
+  return NULL;
+}
+
+void tgln_uring_free (struct tgp_uring *U) {
+}
+
+#endif
+
+/*
+  Traffic capture and replay: the capture file records the decrypted MTProto
+  messages of every authorized connection, inbound ones as they pass
+  try_rpc_read and outbound ones as libtgl hands them to tgln_write_out.
+  Messages are stored with their inner header (salt, session id, message id,
+  seq no, length) and body, the op of a record is the constructor id of the
+  body. The auth key exchange is not encrypted and not recorded.
+
+  A replay opens no sockets. Each recorded inbound message is encrypted again
+  like the server would do it, for the auth key and the session of the new
+  connection and with a fresh message id, and then goes through try_rpc_read
+  and methods->execute, either at the recorded pace or as fast as possible.
+  The DC needs an auth key, so the account has to be logged in once, but it
+  does not have to be the account the capture was recorded with. Replies to
+  queries of the capture do not match any pending query, and libtgl drops
+  updates older than the stored pts and seq, so a replay is best started on
+  a copy of the account directory taken when the capture started.
+
+  File layout: magic, version, then records of
+  type, dc, time (double, seconds since capture start), op, len, payload
+*/
+
+#define CAPTURE_FILE_VERSION 2
+#define REPLAY_BATCH 64
+#define REPLAY_MAX_DC 100
+
+// salt, session_id, msg_id, seq_no, msg_len in front of the body of a decrypted message
+#define MESSAGE_HEADER_SIZE 32
+// auth_key_id and msg_key in front of the encrypted part
+#define MESSAGE_ENC_OFFSET 24
+
+struct tgp_capture {
+  FILE *f;
+  double start;
+};
+
+struct replay_frame {
+  double time;
+  int len;
+  unsigned char *data;   // decrypted header and body
+};
+
+struct tgp_replay {
+  GQueue *frames[REPLAY_MAX_DC];
+  int fast;
+  double start;
+  long long last_msg_id;
+  int count;
+  long long bytes;
+};
+
+// the msg_key of a decrypted message is the middle of the SHA1 of its header and body
+static int message_key (const unsigned char *plain, int len, char *msg_key) {
+  unsigned char sha[EVP_MAX_MD_SIZE];
+  if (!EVP_Digest (plain, len, sha, NULL, EVP_sha1 (), NULL)) {
+    return -1;
+  }
+  memcpy (msg_key, sha + 4, 16);
+  return 0;
+}
+
+static void capture_frame (struct connection *c, int type, int op, const void *data, int len) {
+  connection_data *conn = c->TLS->ev_base;
+  struct tgp_capture *C = conn->capture;
+  int x[2];
+  x[0] = type;
+  x[1] = c->dc ? c->dc->id : 0;
+  double time = tglt_get_double_time () - C->start;
+  int y[2];
+  y[0] = op;
+  y[1] = len;
+  if (fwrite (x, 4, 2, C->f) != 2 || fwrite (&time, 8, 1, C->f) != 1 ||
+      fwrite (y, 4, 2, C->f) != 2 || (int)fwrite (data, 1, len, C->f) != len) {
+    warning ("capture: write failed, stopping capture\n");
+    tgln_capture_free (C);
+    conn->capture = NULL;
+  }
+}
+
+// records data if it is a message encrypted with the auth key of the DC, anything else is skipped
+static void capture_message (struct connection *c, int type, const unsigned char *data, int len) {
+  struct tgl_dc *DC = c->dc;
+  if (!DC || !DC->auth_key_id || len < MESSAGE_ENC_OFFSET + MESSAGE_HEADER_SIZE || (len & 15) != 8 ||
+      memcmp (data, &DC->auth_key_id, 8)) {
+    return;
+  }
+  // same keys as libtgl uses for the connection, messages from the server start 8 bytes into the auth key
+  char msg_key[16], check[16];
+  memcpy (msg_key, data + 8, 16);
+  tgl_init_aes_auth ((char *) DC->auth_key + (type == CAPTURE_IN ? 8 : 0), msg_key, AES_DECRYPT);
+  int l = len - MESSAGE_ENC_OFFSET;
+  unsigned char *plain = malloc (l);
+  memcpy (plain, data + MESSAGE_ENC_OFFSET, l);
+  if (tgl_pad_aes_decrypt ((char *) plain, l, (char *) plain, l) < 0) {
+    free (plain);
+    return;
+  }
+  int msg_len;
+  memcpy (&msg_len, plain + 28, 4);
+  if (msg_len < 4 || msg_len > l - MESSAGE_HEADER_SIZE || (msg_len & 3)) {
+    free (plain);
+    return;
+  }
+  if (message_key (plain, MESSAGE_HEADER_SIZE + msg_len, check) < 0 || memcmp (check, msg_key, 16)) {
+    free (plain);
+    return;
+  }
+  int op;
+  memcpy (&op, plain + MESSAGE_HEADER_SIZE, 4);
+  capture_frame (c, type, op, plain, MESSAGE_HEADER_SIZE + msg_len);
+  free (plain);
+}
+
+struct tgp_capture *tgln_capture_new (const char *path) {
+  FILE *f = fopen (path, "wb");
+  if (!f) {
+    warning ("capture: can not open %s\n", path);
+    return NULL;
+  }
+  int x[2];
+  x[0] = CAPTURE_FILE_MAGIC;
+  x[1] = CAPTURE_FILE_VERSION;
+  if (fwrite (x, 4, 2, f) != 2) {
+    fclose (f);
+    return NULL;
+  }
+  struct tgp_capture *C = malloc (sizeof (*C));
+  C->f = f;
+  C->start = tglt_get_double_time ();
+  info ("capture: recording network traffic to %s\n", path);
+  return C;
+}
+
+void tgln_capture_free (struct tgp_capture *C) {
+  fclose (C->f);
+  free (C);
+}
+
+static void replay_frame_free (gpointer data) {
+  struct replay_frame *f = data;
+  free (f->data);
+  free (f);
+}
+
+struct tgp_replay *tgln_replay_new (const char *path, int fast) {
+  FILE *f = fopen (path, "rb");
+  if (!f) {
+    warning ("replay: can not open %s\n", path);
+    return NULL;
+  }
+  int x[2];
+  if (fread (x, 4, 2, f) != 2 || x[0] != CAPTURE_FILE_MAGIC || x[1] != CAPTURE_FILE_VERSION) {
+    warning ("replay: %s is not a capture file of version %d\n", path, CAPTURE_FILE_VERSION);
+    fclose (f);
+    return NULL;
+  }
+  struct tgp_replay *R = malloc (sizeof (*R));
+  memset (R, 0, sizeof (*R));
+  R->fast = fast;
+  int i;
+  for (i = 0; i < REPLAY_MAX_DC; i++) {
+    R->frames[i] = g_queue_new ();
+  }
+
+  int n = 0;
+  while (1) {
+    double time;
+    int y[2];
+    if (fread (x, 4, 2, f) != 2 || fread (&time, 8, 1, f) != 1 || fread (y, 4, 2, f) != 2) {
+      break;
+    }
+    int type = x[0], dc = x[1], len = y[1];
+    if (dc < 0 || dc >= REPLAY_MAX_DC || len < 0) {
+      warning ("replay: broken record, stopping at %d messages\n", n);
+      break;
+    }
+    if (type == CAPTURE_IN && len >= MESSAGE_HEADER_SIZE + 4 && len % 4 == 0) {
+      struct replay_frame *F = malloc (sizeof (*F));
+      F->time = time;
+      F->len = len;
+      F->data = malloc (len);
+      if ((int)fread (F->data, 1, len, f) != len) {
+        replay_frame_free (F);
+        break;
+      }
+      g_queue_push_tail (R->frames[dc], F);
+      n ++;
+    } else if (fseek (f, len, SEEK_CUR) < 0) {
+      break;
+    }
+  }
+  fclose (f);
+  info ("replay: loaded %d inbound messages from %s\n", n, path);
+  R->start = tglt_get_double_time ();
+  return R;
+}
+
+void tgln_replay_free (struct tgp_replay *R) {
+  int i;
+  for (i = 0; i < REPLAY_MAX_DC; i++) {
+    g_queue_free_full (R->frames[i], replay_frame_free);
+  }
+  free (R);
+}
+
+// server message ids are close to the current time, increasing and 1 mod 4
+static long long replay_msg_id (struct tgp_replay *R) {
+  long long id = (long long)(tglt_get_double_time () * (1LL << 32)) & ~3LL;
+  id |= 1;
+  if (id <= R->last_msg_id) {
+    id = R->last_msg_id + 4;
+  }
+  R->last_msg_id = id;
+  return id;
+}
+
+// encrypts a recorded message for the session of c and appends it as an abridged frame to the input
+static int replay_message (struct connection *c, struct replay_frame *F) {
+  connection_data *conn = c->TLS->ev_base;
+  struct tgp_replay *R = conn->replay;
+  struct tgl_dc *DC = c->dc;
+  if (!DC->auth_key_id || !c->session) {
+    return -1;
+  }
+
+  int l = (F->len + 15) & ~15;
+  int len = MESSAGE_ENC_OFFSET + l;
+  int h = len / 4 <= 0x7e ? 1 : 4;
+  struct connection_buffer *b = new_connection_buffer (h + len);
+  unsigned char *p = b->start;
+  if (h == 1) {
+    p[0] = len / 4;
+  } else {
+    p[0] = 0x7f;
+    p[1] = (len / 4) & 0xff;
+    p[2] = ((len / 4) >> 8) & 0xff;
+    p[3] = ((len / 4) >> 16) & 0xff;
+  }
+  p += h;
+
+  unsigned char *plain = p + MESSAGE_ENC_OFFSET;
+  long long msg_id = replay_msg_id (R);
+  memcpy (plain, F->data, F->len);
+  memcpy (plain + 8, &c->session->session_id, 8);
+  memcpy (plain + 16, &msg_id, 8);
+
+  char msg_key[16];
+  if (message_key (plain, F->len, msg_key) < 0) {
+    delete_connection_buffer (b);
+    return -1;
+  }
+  memcpy (p, &DC->auth_key_id, 8);
+  memcpy (p + 8, msg_key, 16);
+  // encrypted like the server does it, libtgl decrypts it with the same key in methods->execute
+  tgl_init_aes_auth ((char *) DC->auth_key + 8, msg_key, AES_ENCRYPT);
+  assert (tgl_pad_aes_encrypt ((char *) plain, F->len, (char *) plain, l) == l);
+
+  b->wptr = b->end;
+  if (c->in_tail) {
+    c->in_tail->next = b;
+  } else {
+    c->in_head = b;
+  }
+  c->in_tail = b;
+  c->in_bytes += h + len;
+  R->bytes += h + len;
+  return 0;
+}
+
+static int replay_alarm (gpointer arg) {
+  struct connection *c = arg;
+  struct tgl_state *TLS = c->TLS;
+  connection_data *conn = TLS->ev_base;
+  struct tgp_replay *R = conn->replay;
+  GQueue *q = R->frames[c->dc->id];
+  c->replay_ev = -1;
+
+  if (c->state == conn_connecting) {
+    c->state = conn_ready;
+    c->methods->ready (TLS, c);
+  }
+
+  double t = tglt_get_double_time ();
+  int n = 0;
+  struct replay_frame *F;
+  while ((F = g_queue_peek_head (q))) {
+    if (R->fast ? n >= REPLAY_BATCH : F->time > t - R->start) {
+      break;
+    }
+    g_queue_pop_head (q);
+    if (replay_message (c, F) < 0) {
+      warning ("replay: dc %d has no auth key or session, log in once before replaying\n", c->dc->id);
+      replay_frame_free (F);
+      g_queue_free_full (q, replay_frame_free);
+      R->frames[c->dc->id] = g_queue_new ();
+      return FALSE;
+    }
+    replay_frame_free (F);
+    c->last_receive_time = t;
+    R->count ++;
+    n ++;
+
+    try_rpc_read (c);
+  }
+
+  if (!F) {
+    info ("replay: dc %d done, %d messages and %lld bytes total after %.3f seconds\n", c->dc->id, R->count,
+        R->bytes, tglt_get_double_time () - R->start);
+    return FALSE;
+  }
+  double delay = R->fast ? 0 : F->time - (tglt_get_double_time () - R->start);
+  if (delay < 0) { delay = 0; }
+  c->replay_ev = purple_timeout_add (1000 * delay, replay_alarm, c);
+  return FALSE;
+}
+
+static void replay_connection (struct connection *c) {
+  assert (c->dc && c->dc->id >= 0 && c->dc->id < REPLAY_MAX_DC);
+  c->replay_ev = purple_timeout_add (0, replay_alarm, c);
+}
+
 /*
 int tgl_connections_make_poll_array (struct pollfd *fds, int max) {
   int _max = max;
@@ -537,6 +1363,8 @@ static struct tgl_session *get_session (struct connection *c) {
 }
 
 static void tgln_free (struct connection *c) {
+  // a running io_uring write still owns the output buffers
+  uring_remove (c);
   if (c->ip) { free (c->ip); }
   struct connection_buffer *b = c->out_head;
   while (b) {
@@ -559,6 +1387,10 @@ static void tgln_free (struct connection *c) {
     purple_timeout_remove (c->fail_ev);
     c->fail_ev = -1;
   }
+  if (c->replay_ev >= 0) { 
+    purple_timeout_remove (c->replay_ev);
+    c->replay_ev = -1;
+  }
     
   if (c->read_ev >= 0) { 
     purple_input_remove (c->read_ev);
@@ -64,8 +64,14 @@ struct connection {
   int write_ev;
   double last_receive_time;
   void *prpl_data;
+  struct tgp_uring_conn *uring;
+  int replay_ev;
 };
 
+struct tgp_uring;
+struct tgp_capture;
+struct tgp_replay;
+
 //extern struct connection *Connections[];
 
 int tgln_write_out (struct connection *c, const void *data, int len);
@@ -77,6 +83,14 @@ int tgln_read_in_lookup (struct connection *c, void *data, int len);
 
 extern struct tgl_net_methods tgp_conn_methods;
 
+struct tgp_uring *tgln_uring_new (void);
+void tgln_uring_free (struct tgp_uring *U);
+
+struct tgp_capture *tgln_capture_new (const char *path);
+void tgln_capture_free (struct tgp_capture *C);
+struct tgp_replay *tgln_replay_new (const char *path, int fast);
+void tgln_replay_free (struct tgp_replay *R);
+
 //void create_all_outbound_connections (void);
 
 //struct connection *create_connection (const char *host, int port, struct tgl_session *session, struct connection_methods *methods);
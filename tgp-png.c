@@ -0,0 +1,176 @@
+/*
+    This file is part of telegram-purple
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111-1301  USA
+
+    Copyright Matthias Jentsch 2014
+*/
+
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef TGP_PNG_LIBDEFLATE
+#include <libdeflate.h>
+#elif defined(TGP_PNG_ZLIB)
+#include <zlib.h>
+#endif
+
+#include "tgp-png.h"
+
+/*
+  tgp-png.c: PNG encoding and decoding through lodepng
+
+  Built with --enable-png-zlib, the zlib streams inside the PNGs are compressed and
+  decompressed by libdeflate, or by the system zlib when libdeflate is not installed,
+  instead of lodepng's own deflate. They are plugged in with lodepng's custom_zlib hooks,
+  lodepng still does filtering and chunk handling. The buffers handed back to lodepng are
+  released with lodepng_free, so they must come from malloc.
+
+  tgp_png_encode32 is used for many small images in a row, the identicons. Its large
+  temporary buffers, like the LZ77 hash tables, are kept in one lodepng scratch that is
+  reused by every call, so it must only be called from the main loop.
+*/
+
+// lodepng error codes
+#define PNG_ERROR_ALLOC 83
+#define PNG_ERROR_DATA 10
+
+// zlib levels matching lodepng's LCL_FAST, LCL_DEFAULT and LCL_MAX presets
+static const int png_zlib_levels[] = { 1, 6, 9 };
+
+#define PNG_ZLIB_LEVEL(settings) (*(const int *) (settings)->custom_context)
+
+#ifdef TGP_PNG_LIBDEFLATE
+static unsigned png_zlib_compress (unsigned char **out, size_t *outsize, const unsigned char *in, size_t insize,
+    const LodePNGCompressSettings *settings) {
+  struct libdeflate_compressor *c = libdeflate_alloc_compressor (PNG_ZLIB_LEVEL(settings));
+  if (!c) {
+    return PNG_ERROR_ALLOC;
+  }
+  size_t bound = libdeflate_zlib_compress_bound (c, insize);
+  *out = malloc (bound);
+  if (!*out) {
+    libdeflate_free_compressor (c);
+    return PNG_ERROR_ALLOC;
+  }
+  *outsize = libdeflate_zlib_compress (c, in, insize, *out, bound);
+  libdeflate_free_compressor (c);
+  return *outsize ? 0 : PNG_ERROR_ALLOC;
+}
+
+static unsigned png_zlib_decompress (unsigned char **out, size_t *outsize, const unsigned char *in, size_t insize,
+    const LodePNGDecompressSettings *settings) {
+  struct libdeflate_decompressor *d = libdeflate_alloc_decompressor ();
+  if (!d) {
+    return PNG_ERROR_ALLOC;
+  }
+  // the size of the image is not known here, grow the buffer until it fits
+  size_t avail = insize * 4 + 1024;
+  enum libdeflate_result result;
+  do {
+    unsigned char *buf = realloc (*out, avail);
+    if (!buf) {
+      libdeflate_free_decompressor (d);
+      return PNG_ERROR_ALLOC;
+    }
+    *out = buf;
+    result = libdeflate_zlib_decompress (d, in, insize, *out, avail, outsize);
+    avail *= 2;
+  } while (result == LIBDEFLATE_INSUFFICIENT_SPACE);
+  libdeflate_free_decompressor (d);
+  return result == LIBDEFLATE_SUCCESS ? 0 : PNG_ERROR_DATA;
+}
+
+#elif defined(TGP_PNG_ZLIB)
+static unsigned png_zlib_compress (unsigned char **out, size_t *outsize, const unsigned char *in, size_t insize,
+    const LodePNGCompressSettings *settings) {
+  uLongf len = compressBound (insize);
+  *out = malloc (len);
+  if (!*out) {
+    return PNG_ERROR_ALLOC;
+  }
+  int err = compress2 (*out, &len, in, insize, PNG_ZLIB_LEVEL(settings));
+  *outsize = len;
+  return err == Z_OK ? 0 : PNG_ERROR_ALLOC;
+}
+
+static unsigned png_zlib_decompress (unsigned char **out, size_t *outsize, const unsigned char *in, size_t insize,
+    const LodePNGDecompressSettings *settings) {
+  z_stream s;
+  memset (&s, 0, sizeof (s));
+  if (inflateInit (&s) != Z_OK) {
+    return PNG_ERROR_ALLOC;
+  }
+  s.next_in = (Bytef *) in;
+  s.avail_in = insize;
+  size_t avail = insize * 4 + 1024;
+  *outsize = 0;
+  int err;
+  do {
+    unsigned char *buf = realloc (*out, avail);
+    if (!buf) {
+      inflateEnd (&s);
+      return PNG_ERROR_ALLOC;
+    }
+    *out = buf;
+    s.next_out = *out + *outsize;
+    s.avail_out = avail - *outsize;
+    err = inflate (&s, Z_FINISH);
+    *outsize = avail - s.avail_out;
+    avail *= 2;
+  } while (err == Z_BUF_ERROR && s.avail_out == 0);
+  inflateEnd (&s);
+  if (err == Z_MEM_ERROR) {
+    return PNG_ERROR_ALLOC;
+  }
+  return err == Z_STREAM_END ? 0 : PNG_ERROR_DATA;
+}
+
+#endif
+
+// only used from the main loop, the identicons are encoded there
+static LodePNGScratch *png_scratch_get (void) {
+  static LodePNGScratch scratch;
+  static int init = 0;
+  if (!init) {
+    lodepng_scratch_init (&scratch);
+    init = 1;
+  }
+  return &scratch;
+}
+
+void tgp_png_state_init (LodePNGState *state, LodePNGCompressLevel level) {
+  lodepng_state_init (state);
+  lodepng_compress_settings_level (&state->encoder.zlibsettings, level);
+#if defined(TGP_PNG_LIBDEFLATE) || defined(TGP_PNG_ZLIB)
+  state->encoder.zlibsettings.custom_zlib = png_zlib_compress;
+  state->encoder.zlibsettings.custom_context = &png_zlib_levels[level];
+  state->decoder.zlibsettings.custom_zlib = png_zlib_decompress;
+#endif
+}
+
+unsigned tgp_png_encode32 (unsigned char **out, size_t *outsize, const unsigned char *image, unsigned w, unsigned h,
+    LodePNGCompressLevel level) {
+  LodePNGState state;
+  tgp_png_state_init (&state, level);
+  state.scratch = png_scratch_get ();
+  state.info_raw.colortype = LCT_RGBA;
+  state.info_raw.bitdepth = 8;
+  state.info_png.color.colortype = LCT_RGBA;
+  state.info_png.color.bitdepth = 8;
+  unsigned error = lodepng_encode (out, outsize, image, w, h, &state);
+  lodepng_state_cleanup (&state);
+  return error;
+}
@@ -0,0 +1,33 @@
+/*
+    This file is part of telegram-purple
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111-1301  USA
+
+    Copyright Matthias Jentsch 2014
+*/
+#ifndef __TGP_PNG_H__
+#define __TGP_PNG_H__
+
+#include <stddef.h>
+#include "lodepng/lodepng.h"
+
+// initializes a lodepng state that uses the zlib backend chosen at configure time,
+// compressing with the given speed/size preset
+void tgp_png_state_init (LodePNGState *state, LodePNGCompressLevel level);
+
+unsigned tgp_png_encode32 (unsigned char **out, size_t *outsize, const unsigned char *image, unsigned w, unsigned h,
+    LodePNGCompressLevel level);
+
+#endif
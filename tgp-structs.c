@@ -19,6 +19,9 @@
  */
 
 #include "tgp-structs.h"
+#include "tgp-net.h"
+#include "tgp-download.h"
+#include "telegram-base.h"
 #include "purple.h"
 #include "msglog.h"
 
@@ -96,6 +99,26 @@ void used_images_add (connection_data *data, gint imgid)
   debug ("used_image: add %d", imgid);
 }
 
+/*
+  Remembers the ids of the last RECENT_MESSAGES messages in a ring buffer. The hash
+  table points into the ring, so the filter does not allocate per message.
+*/
+int recent_messages_seen (struct recent_messages *R, long long id)
+{
+  if (g_hash_table_contains (R->set, &id)) {
+    return 1;
+  }
+  if (R->count == RECENT_MESSAGES) {
+    g_hash_table_remove (R->set, &R->ids[R->pos]);
+  } else {
+    R->count ++;
+  }
+  R->ids[R->pos] = id;
+  g_hash_table_add (R->set, &R->ids[R->pos]);
+  R->pos = (R->pos + 1) % RECENT_MESSAGES;
+  return 0;
+}
+
 connection_data *connection_data_init (struct tgl_state *TLS, PurpleConnection *gc, PurpleAccount *pa)
 {
   connection_data *conn = g_new0 (connection_data, 1);
@@ -105,17 +128,57 @@ connection_data *connection_data_init (struct tgl_state *TLS, PurpleConnection *
   conn->new_messages = g_queue_new ();
   conn->pending_reads = g_queue_new ();
   conn->joining_chats = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+  conn->dc_waiting = g_queue_new ();
+  conn->sync_queue = g_queue_new ();
+  conn->sync_priority = g_queue_new ();
+  conn->sync_flags = g_hash_table_new (g_direct_hash, g_direct_equal);
+  conn->presence_pending = g_hash_table_new (g_direct_hash, g_direct_equal);
+  conn->presence_last = g_hash_table_new_full (g_direct_hash, g_direct_equal, NULL, g_free);
+  conn->recent.set = g_hash_table_new (g_int64_hash, g_int64_equal);
+  conn->downloads = tgp_downloads_new ();
+  conn->avatar_pending = g_hash_table_new (g_direct_hash, g_direct_equal);
   return conn;
 }
 
 void *connection_data_free (connection_data *conn)
 {
   purple_timeout_remove(conn->timer);
+  if (conn->login_ev) {
+    purple_timeout_remove (conn->login_ev);
+  }
+  if (conn->sync_ev) {
+    purple_timeout_remove (conn->sync_ev);
+  }
+  g_queue_free (conn->sync_queue);
+  g_queue_free (conn->sync_priority);
+  g_hash_table_destroy (conn->sync_flags);
+  if (conn->presence_ev) {
+    purple_timeout_remove (conn->presence_ev);
+  }
+  g_hash_table_destroy (conn->presence_pending);
+  g_hash_table_destroy (conn->presence_last);
+  g_hash_table_destroy (conn->recent.set);
+  if (conn->avatar_ev) {
+    purple_timeout_remove (conn->avatar_ev);
+  }
+  g_hash_table_destroy (conn->avatar_pending);
+  purple_signals_disconnect_by_handle (conn);
   g_queue_free_full (conn->pending_reads, pending_reads_free_cb);
   g_queue_free_full (conn->new_messages, message_text_free);
   g_hash_table_destroy (conn->joining_chats);
+  telegram_dc_waiting_free (conn->TLS);
   g_list_free_full (conn->used_images, used_image_free);
   tgl_free_all (conn->TLS);
+  tgp_downloads_free (conn->downloads);
+  if (conn->uring) {
+    tgln_uring_free (conn->uring);
+  }
+  if (conn->capture) {
+    tgln_capture_free (conn->capture);
+  }
+  if (conn->replay) {
+    tgln_replay_free (conn->replay);
+  }
   free (conn);
   return NULL;
 }
@@ -26,6 +26,15 @@
 #include <tgl.h>
 #include <glib.h>
 
+#define RECENT_MESSAGES 1024
+
+struct recent_messages {
+  long long ids[RECENT_MESSAGES];
+  int pos;
+  int count;
+  GHashTable *set;
+};
+
 typedef struct {
   struct tgl_state *TLS;
   char *hash;
@@ -36,8 +45,34 @@ typedef struct {
   GQueue *pending_reads;
   GList *used_images;
   GHashTable *joining_chats;
+  GQueue *dc_waiting;
+  int syncing;
+  double sync_start;
+  GQueue *sync_queue;
+  GQueue *sync_priority;
+  GHashTable *sync_flags;
+  int sync_done;
+  guint sync_ev;
+  GHashTable *presence_pending;
+  GHashTable *presence_last;
+  guint presence_ev;
+  int presence_interval;
+  int presence_unchanged;
+  int presence_superseded;
+  int presence_batch_superseded;
+  struct recent_messages recent;
+  struct tgp_downloads *downloads;
+  GHashTable *avatar_pending;
+  guint avatar_ev;
   guint timer;
   int in_fallback_chat;
+  struct tgp_uring *uring;
+  struct tgp_capture *capture;
+  struct tgp_replay *replay;
+  // called after every frame handled by libtgl, while login waits for DC authorization
+  void (*on_rpc_read) (struct tgl_state *TLS);
+  guint login_ev;
+  double login_start;
 } connection_data;
 
 typedef struct { 
@@ -63,6 +98,8 @@ void message_text_free (gpointer data);
 
 void used_images_add (connection_data *data, gint imgid);
 
+int recent_messages_seen (struct recent_messages *R, long long id);
+
 void *connection_data_free (connection_data *conn);
 connection_data *connection_data_init (struct tgl_state *TLS, PurpleConnection *gc, PurpleAccount *pa);
 